@@ -0,0 +1,40 @@
+#!/bin/bash
+# Crash recovery test. Run from src/ once the client and server are built,
+# with no server running and no ../data: everything since the last shutdown
+# has to come back from the write-ahead log after a kill -9.
+#
+#   ../project_tests/crash.sh
+
+T=../project_tests
+OUT=$(mktemp)
+fail=0
+
+start() { ./server > /dev/null 2>&1 & SERVER=$!; sleep 1; }
+crash() { kill -9 $SERVER; wait $SERVER 2> /dev/null; }
+check() {
+    ./client < $T/$1.dsl > $OUT
+    if diff <(grep -v '^$' $OUT) <(grep -v '^$' $T/$1.exp) > /dev/null; then
+        echo "PASS $1 $2"
+    else
+        echo "FAIL $1 $2"
+        fail=1
+    fi
+}
+
+start
+./client < $T/test34.dsl > /dev/null
+crash
+start
+check test35 "after a crash"
+crash
+start
+check test36 "after a second crash"
+echo shutdown | ./client > /dev/null
+wait $SERVER
+start
+check test36 "after a shutdown"
+echo shutdown | ./client > /dev/null
+wait $SERVER
+
+rm -f $OUT
+exit $fail
@@ -0,0 +1,138 @@
+// Copyright 2015 <Luis Perez>
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "include/alloc.h"
+#include "include/common.h"
+
+// Updated by every thread that allocates (loads run in parallel).
+static alloc_stats stats;
+
+static inline void count(size_t* counter, size_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Makes sure arrays of at least a huge page get pages of their own, which is
+// what lets column_grow remap rather than copy them. The threshold is fixed,
+// as glibc would otherwise raise it as such arrays are freed.
+static void init_alloc(void) {
+#if defined(__GLIBC__) && defined(M_MMAP_THRESHOLD)
+    static int done = 0;
+    if (!__atomic_exchange_n(&done, 1, __ATOMIC_ACQ_REL)) {
+        mallopt(M_MMAP_THRESHOLD, HUGE_PAGE_SIZE);
+    }
+#endif
+}
+
+// Advises the bytes bytes at data to be backed by huge pages. Only the whole
+// huge pages inside are ours to advise on: the allocator may hand out what
+// lies around the array. Returns whether any were.
+static int advise_huge(void* data, size_t bytes) {
+#if HUGE_PAGES && defined(MADV_HUGEPAGE)
+    uintptr_t start = ((uintptr_t) data + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t) data + bytes) & ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+    return start < end && madvise((void*) start, end - start, MADV_HUGEPAGE) == 0;
+#else
+    (void) data;
+    (void) bytes;
+    return 0;
+#endif
+}
+
+// Allocates bytes (at least one) aligned as in alloc.h, without zeroing them.
+static void* aligned_block(size_t bytes) {
+    int huge = bytes >= HUGE_PAGE_SIZE;
+    void* data;
+    init_alloc();
+    if (posix_memalign(&data, (huge) ? HUGE_PAGE_SIZE : COLUMN_ALIGNMENT,
+            (bytes) ? bytes : 1) != 0) {
+        count(&stats.failures, 1);
+        return NULL;
+    }
+    count(&stats.allocations, 1);
+    count(&stats.bytes, bytes);
+
+    // This happens before anything touches the pages, so they are faulted in
+    // huge from the start.
+    if (huge && advise_huge(data, bytes)) {
+        count(&stats.huge_allocations, 1);
+        count(&stats.huge_bytes, bytes);
+    }
+    return data;
+}
+
+void* column_alloc_uninit(size_t n, size_t width) {
+    if (width && n > SIZE_MAX / width) {
+        count(&stats.failures, 1);
+        return NULL;
+    }
+    return aligned_block(n * width);
+}
+
+void* column_alloc(size_t n, size_t width) {
+    void* data = column_alloc_uninit(n, width);
+    if (data) {
+        memset(data, 0, n * width);
+    }
+    return data;
+}
+
+void* column_resize(const void* data, size_t osize, size_t nsize) {
+    assert(osize <= nsize);
+    char* ndata = aligned_block(nsize);
+    if (ndata) {
+        memcpy(ndata, data, osize);
+        memset(ndata + osize, 0, nsize - osize);
+    }
+    return ndata;
+}
+
+void* column_grow(void* data, size_t osize, size_t nsize) {
+    assert(osize <= nsize);
+    init_alloc();
+    char* ndata = realloc(data, (nsize) ? nsize : 1);
+    if (!ndata) {
+        count(&stats.failures, 1);
+        return NULL;
+    }
+
+    // Small arrays may have been copied somewhere less aligned. They are
+    // cheap to copy once more.
+    if ((uintptr_t) ndata % COLUMN_ALIGNMENT != 0) {
+        char* aligned = aligned_block(nsize);
+        if (!aligned) {
+            // The array is still all there, just not aligned.
+            return ndata;
+        }
+        memcpy(aligned, ndata, osize);
+        free(ndata);
+        return aligned;
+    }
+    count(&stats.grows, 1);
+    count(&stats.bytes, nsize - osize);
+
+    // Remapped pages keep their advice only if they stay where they were, and
+    // a moved array need not start on a huge page anymore, so we advise the
+    // whole array again: every huge page inside it still qualifies.
+    if (nsize >= HUGE_PAGE_SIZE && advise_huge(ndata, nsize)) {
+        count(&stats.huge_bytes, nsize - osize);
+    }
+    return ndata;
+}
+
+alloc_stats get_alloc_stats(void) {
+    alloc_stats now;
+    now.allocations = __atomic_load_n(&stats.allocations, __ATOMIC_RELAXED);
+    now.bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    now.huge_allocations = __atomic_load_n(&stats.huge_allocations, __ATOMIC_RELAXED);
+    now.huge_bytes = __atomic_load_n(&stats.huge_bytes, __ATOMIC_RELAXED);
+    now.failures = __atomic_load_n(&stats.failures, __ATOMIC_RELAXED);
+    now.grows = __atomic_load_n(&stats.grows, __ATOMIC_RELAXED);
+    return now;
+}
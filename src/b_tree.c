@@ -3,39 +3,96 @@
 // As a general note, everything is implemented iteratively to avoid function call
 // overhead whenever possible. If needed, we use tail recursion.
 
+#include <string.h>
+
+#include "include/alloc.h"
 #include "include/b_tree.h"
+#include "include/kernels.h"
 #include "include/utils.h"
 
-void bulk_load(Data* data, Data* pos, size_t n, Node* root) {
+// Allocates the key slots of a node we own.
+static Key* alloc_keys(void) {
+  return column_alloc(FANOUT, sizeof(Key));
+}
+
+// Makes sure we own the keys of node before they are modified, copying them
+// out of the mapping if needed.
+static void own_keys(Node* node) {
+  if (node->mapped && node->type == Position) {
+    Values values = alloc_values(node->pos_type, FANOUT);
+    memcpy(values.raw, node->values.raw, node->count * type_width(node->pos_type));
+    node->values = values;
+    node->mapped = 0;
+  }
+  else if (node->mapped) {
+    Key* keys = alloc_keys();
+    memcpy(keys, node->keys, node->count * sizeof(Key));
+    node->keys = keys;
+    node->mapped = 0;
+  }
+}
+
+void init_tree(Node* root) {
+  Values none;
+  none.raw = NULL;
+  bulk_load(NULL, none, POS32, 0, root);
+}
+
+// Returns the leftmost/rightmost leaf under root.
+static Node* first_leaf(Node* root) {
+  while (root->type == Internal) {
+    root = &root->children[0];
+  }
+  return root;
+}
+
+static Node* last_leaf(Node* root) {
+  while (root->type == Internal) {
+    root = &root->children[root->count - 1];
+  }
+  return root;
+}
+
+void bulk_load(Key* data, Values pos, DataType pos_type, size_t n, Node* root) {
   // If we can fit into a single node, just do that.
   size_t capacity = CAPACITY * FANOUT;
+  root->mapped = 0;
+  root->next_link = NULL;
+  root->keys = alloc_keys();
   if (n <= capacity) {
     root->count = n;
     root->type = Leaf;
-    root->next_link = NULL;
     root->children = calloc(1, sizeof(Node));
+    root->children->keys = NULL;
+    root->children->values = alloc_values(pos_type, FANOUT);
+    root->children->pos_type = pos_type;
     root->children->count = n;
     root->children->type = Position;
     root->children->children = NULL;
     root->children->next_link = NULL;
 
-    for(size_t i = 0; i < n; i++){
-      root->children->keys[i] = pos[i];
-      root->keys[i] = data[i];
+    if (n > 0) {
+      memcpy(root->children->values.raw, pos.raw, n * type_width(pos_type));
+      memcpy(root->keys, data, n * sizeof(Key));
     }
 
     return;
   }
 
   // Otherwise split the data by children and bulk load them first.
-  // Note that our tree will be left leaning.
-  size_t split_size = n / (capacity - 1);
-  root->children = calloc(FANOUT, sizeof(Node));
-  for (size_t i = 0; i < capacity && split_size * i < n; i++) {
+  // We use as few children as possible, each holding at least a full node.
+  size_t split_size = (n + capacity - 1) / capacity;
+  if (split_size < capacity) {
+    split_size = capacity;
+  }
+  size_t nchildren = (n + split_size - 1) / split_size;
+  root->children = column_alloc(nchildren, sizeof(Node));
+  for (size_t i = 0; i < nchildren; i++) {
     // Bulk load the first child!
     size_t start_index = split_size * i;
-    size_t length = (n - start_index) ? n - start_index : split_size;
-    bulk_load(&data[start_index], &pos[start_index], length, &root->children[i]);
+    size_t length = (n - start_index < split_size) ? n - start_index : split_size;
+    bulk_load(&data[start_index], values_at(pos, pos_type, start_index), pos_type,
+      length, &root->children[i]);
 
     // Set-up the keys to the tree (note that equal values might be split.
     // we take care of this in search?
@@ -48,29 +105,20 @@ void bulk_load(Data* data, Data* pos, size_t n, Node* root) {
       root->keys[i] = data[start_index + length];
     }
 
-
-    // Add a link from the previous child (unless first child)
-    if (i != 0 ) {
-      // This links all the children internally together.
-      root->children[i-1].next_link = &root->children[i];
-
-      // Node link the contiguous chunks together by linking the last from the
-      // previous group to the first of this group!
-      if (root->children[i-1].children) {
-
-        // Get the last one in the previous contiguous block!
-        root->children[i-1].children[root->children[i-1].count - 1].next_link = root->children[i].children;
-      }
+    // Link the last leaf of the previous child to the first of this one.
+    if (i != 0) {
+      last_leaf(&root->children[i-1])->next_link = first_leaf(&root->children[i]);
     }
   }
 
   // Note that the root node has now become an internal node.
+  root->count = nchildren;
   root->type = Internal;
 }
 
 
 // Iterate over the root tree.
-size_t find_element_tree(Data el, Node* root, Node** node) {
+size_t find_element_tree(Key el, Node* root, Node** node) {
   // If we got a null pointer, something went very wrong!
   if (!root) {
     log_err("Root pointer cannot be null! %s: line %d\n", __func__, __LINE__);
@@ -110,15 +158,15 @@ size_t find_element_tree(Data el, Node* root, Node** node) {
     *node = root;
     return data_idx;
   }
-  Data key = root->keys[data_idx];
+  Key key = root->keys[data_idx];
 
   // Look left. This should almost always be the case unless the values are equal!
-  if (el.i < key.i) {
+  if (el < key) {
     return find_element_tree(el, &root->children[data_idx], node);
   }
 
   // Equal values, so we actually look in both directions.
-  else if (el.i == key.i){
+  else if (el == key){
     log_info("Column contains duplicate values!");
 
     // Look right first because this is where we expect to find it.
@@ -144,7 +192,45 @@ size_t find_element_tree(Data el, Node* root, Node** node) {
   }
 }
 
-Data get_min_key(Node* root) {
+size_t lower_bound_tree(Key el, Node* root, Node** leaf) {
+  // Each key of an internal node bounds its child from above, so we go down
+  // the first child that could hold el. Inserts do not update the keys, so
+  // the last child is always a candidate.
+  while (root->type == Internal) {
+    size_t i = 0;
+    while (i + 1 < root->count && root->keys[i] < el) {
+      i++;
+    }
+    root = &root->children[i];
+  }
+
+  // Binary search the leaf for the first key no less than el.
+  size_t lo = 0;
+  size_t hi = root->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (root->keys[mid] < el) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  *leaf = root;
+  return lo;
+}
+
+size_t tree_begin(Node* root, Node** leaf) {
+  *leaf = first_leaf(root);
+  return 0;
+}
+
+size_t tree_end(Node* root, Node** leaf) {
+  *leaf = last_leaf(root);
+  return (*leaf)->count;
+}
+
+Key get_min_key(Node* root) {
   // If at leaf, we're done.
   if (root->type == Leaf) {
     return root->keys[0];
@@ -154,7 +240,7 @@ Data get_min_key(Node* root) {
   return get_min_key(&root->children[0]);
 }
 
-Data get_max_key(Node* root) {
+Key get_max_key(Node* root) {
   // If at leaf, we're done
   if (root->type == Leaf) {
     return root->keys[root->count - 1];
@@ -164,62 +250,81 @@ Data get_max_key(Node* root) {
   return get_max_key(&root->children[root->count - 1]);
 }
 
-Data get_min_value(Node* root) {
+size_t get_min_value(Node* root) {
   // Leaf, so we're done
   if (root->type == Leaf) {
-    return root->children->keys[0];
+    return get_pos(root->children->values, root->children->pos_type, 0);
   }
 
   return get_min_value(&root->children[0]);
 }
 
-Data get_max_value(Node* root) {
+size_t get_max_value(Node* root) {
   if (root->type == Leaf) {
-    return root->children->keys[root->count - 1];
+    return get_pos(root->children->values, root->children->pos_type, root->count - 1);
   }
 
   return get_max_value(&root->children[root->count - 1]);
 }
 
-void extract_data_leaf(Node* leaf, Data* keys, Data* values) {
-  // When the leaf is null, we're done
-  if (!leaf || leaf->count == 0) {
-    return;
-  }
-  // We assume arrays are pre-allocated with enough space to fit data
-  for(size_t i = 0; i < leaf->count; i++) {
-    keys[i] = leaf->keys[i];
-    values[i] = leaf->children->keys[i];
-  }
-
-  extract_data_leaf(leaf->next_link, keys + leaf->count, values + leaf->count);
+DataType tree_pos_type(Node* root) {
+  Node* leaf = first_leaf(root);
+  return (leaf->children) ? leaf->children->pos_type : POS32;
 }
 
-void extract_data(Node* root, Data* keys, Data* values) {
-  // Go all the way down until the bottom left!
-  if (root->type == Leaf) {
-    extract_data_leaf(root, keys, values);
+void widen_tree(Node* root) {
+  for (Node* leaf = first_leaf(root); leaf; leaf = leaf->next_link) {
+    Node* positions = leaf->children;
+    if (positions->pos_type == POS64) {
+      continue;
+    }
+    Values wide = alloc_values(POS64, FANOUT);
+    for (size_t i = 0; i < positions->count; i++) {
+      wide.p64[i] = positions->values.p32[i];
+    }
+    if (!positions->mapped) {
+      free(positions->values.raw);
+    }
+    positions->values = wide;
+    positions->pos_type = POS64;
+    positions->mapped = 0;
   }
-  else {
-    extract_data(&root->children[0], keys, values);
+}
+
+void extract_data(Node* root, Key* keys, Values values, DataType pos_type) {
+  // Go all the way down until the bottom left and walk the leaves from there.
+  // We assume arrays are pre-allocated with enough space to fit data
+  size_t n = 0;
+  for (Node* leaf = first_leaf(root); leaf; leaf = leaf->next_link) {
+    Node* positions = leaf->children;
+    for(size_t i = 0; i < leaf->count; i++) {
+      keys[n] = leaf->keys[i];
+      set_pos(values, pos_type, n++, get_pos(positions->values, positions->pos_type, i));
+    }
   }
 }
 
 void free_btree(Node* root) {
   // If NULL, we're done!
-  if (!root || root->count <= 0) {
+  if (!root) {
     return;
   }
 
-  // Free a leaf
   if (root->type == Internal) {
     // Free all of the children if we have any!
     if (root->children) {
-      for(size_t i = 0; i < FANOUT; i++) {
+      for(size_t i = 0; i < root->count; i++) {
         free_btree(&root->children[i]);
       }
     }
   }
+  else if (root->children && !root->children->mapped) {
+    // Free the values of a leaf.
+    free(root->children->values.raw);
+  }
+  if (!root->mapped) {
+    free(root->keys);
+  }
 
   // Now we free our children (the contiguous block we had allocated)
   free(root->children);
@@ -227,7 +332,7 @@ void free_btree(Node* root) {
   // Only the root needs to free itself, so we do this outside the function.
 }
 
-void insert_tree(Node* root, Data key, Data value) {
+void insert_tree(Node* root, Key key, size_t value) {
   // Find the node where we need to insert this value!
   Node* node;
   size_t pos = find_element_tree(key, root, &node);
@@ -238,15 +343,19 @@ void insert_tree(Node* root, Data key, Data value) {
 
   // Now we insert into the specified position if we have enough space.
   if (node->count < FANOUT) {
-    Data tmpKey;
-    Data tmpValue;
+    own_keys(node);
+    own_keys(node->children);
+    Values values = node->children->values;
+    DataType pos_type = node->children->pos_type;
+    Key tmpKey;
+    size_t tmpValue;
     while (pos < node->count) {
       tmpKey = node->keys[pos];
-      tmpValue = node->children->keys[pos];
+      tmpValue = get_pos(values, pos_type, pos);
 
       // Now copy over the current key/value.
       node->keys[pos] = key;
-      node->children->keys[pos++] = value;
+      set_pos(values, pos_type, pos++, value);
 
       // Now copy over.
       key = tmpKey;
@@ -255,7 +364,7 @@ void insert_tree(Node* root, Data key, Data value) {
 
     // Insert final item
     node->keys[node->count++] = key;
-    node->children->keys[node->children->count++] = value;
+    set_pos(values, pos_type, node->children->count++, value);
 
     // Now we're done!
   }
@@ -266,61 +375,204 @@ void insert_tree(Node* root, Data key, Data value) {
 
 }
 
-void write_tree(FILE* fp, Node* root) {
-  // Write out everything in binary as a struct!
-  if (1 != fwrite(root, sizeof(Node), 1, fp)) {
-    log_err("Failed at writing out node!!");
+// Pads fp with zeros up to the next page boundary.
+static int pad_page(FILE* fp, long base) {
+  static const char zeros[BTREE_PAGE_SIZE];
+  long used = (ftell(fp) - base) % BTREE_PAGE_SIZE;
+  if (used == 0) {
+    return 1;
   }
+  size_t pad = BTREE_PAGE_SIZE - used;
+  return fwrite(zeros, 1, pad, fp) == pad;
+}
 
-  // Write out the pointers depending on type!
-  if (root->type == Leaf) {
-    if (1 != fwrite(root->children, sizeof(Node), 1, fp)) {
-      log_err("Failed writing out values for leaf!");
+// Bytes taken on disk by the keys of a node, padded so the child page
+// numbers that follow the keys of an internal node are aligned.
+static size_t key_bytes(size_t count) {
+  return (count * sizeof(Key) + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+// Bytes taken on disk by a node of the given type, header included, when
+// positions are pos_width bytes.
+static size_t node_bytes(uint32_t type, size_t count, size_t pos_width) {
+  size_t values = (type == Leaf) ? pos_width : sizeof(uint64_t);
+  return sizeof(btree_page) + key_bytes(count) + count * values;
+}
+
+// Writes the subtree at node (children first) starting at page *next.
+// Stores the page number of node in *page and advances *next past it.
+static int write_node(FILE* fp, long base, Node* node, uint64_t* next, uint64_t* page) {
+  uint64_t* children = NULL;
+  if (node->type == Internal) {
+    children = calloc(node->count + 1, sizeof(uint64_t));
+    for (size_t i = 0; i < node->count; i++) {
+      if (!write_node(fp, base, &node->children[i], next, &children[i])) {
+        free(children);
+        return 0;
+      }
     }
   }
-  // Type is Internal!
-  else if (root->type == Internal) {
-    for (size_t i = 0; i < root->count; i++) {
-      write_tree(fp, &root->children[i]);
-    }
+  else if (node->type != Leaf) {
+    log_err("Node type not supported!");
+    return 0;
+  }
+
+  static const char zeros[sizeof(uint64_t)];
+  size_t width = (node->type == Leaf) ? type_width(node->children->pos_type) : 0;
+  size_t bytes = node_bytes(node->type, node->count, width);
+  size_t pad = key_bytes(node->count) - node->count * sizeof(Key);
+  btree_page header;
+  header.type = node->type;
+  header.pages = (bytes + BTREE_PAGE_SIZE - 1) / BTREE_PAGE_SIZE;
+  header.count = node->count;
+  int ok = fwrite(&header, sizeof(btree_page), 1, fp) == 1 &&
+    fwrite(node->keys, sizeof(Key), node->count, fp) == node->count &&
+    fwrite(zeros, 1, pad, fp) == pad;
+  if (ok && node->type == Leaf) {
+    ok = fwrite(node->children->values.raw, width, node->count, fp) == node->count;
+  }
+  else if (ok) {
+    ok = fwrite(children, sizeof(uint64_t), node->count, fp) == node->count;
+  }
+  free(children);
+  if (!ok || !pad_page(fp, base)) {
+    log_err("Failed at writing out node!!");
+    return 0;
+  }
+  *page = *next;
+  *next += header.pages;
+  return 1;
+}
+
+status write_tree(FILE* fp, Node* root) {
+  status ret;
+  long base = ftell(fp);
+  btree_header header;
+  header.magic = BTREE_MAGIC;
+  header.version = BTREE_VERSION;
+  header.page_size = BTREE_PAGE_SIZE;
+  header.fanout = FANOUT;
+  header.pos_width = type_width(tree_pos_type(root));
+  header.padding = 0;
+  header.page_count = 1;
+  header.root = 0;
+
+  // The header page goes first, but we only know where the root ended up
+  // once everything else is written, so we come back to it. We return to
+  // the end by offset, since a memory stream has no SEEK_END of its own.
+  long end = -1;
+  if (fwrite(&header, sizeof(btree_header), 1, fp) != 1 || !pad_page(fp, base) ||
+      !write_node(fp, base, root, &header.page_count, &header.root) ||
+      (end = ftell(fp)) < 0 ||
+      fseek(fp, base, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(btree_header), 1, fp) != 1 ||
+      fseek(fp, end, SEEK_SET) != 0) {
+    log_err("Failed writing out tree.\n");
+    ret.code = ERROR;
+    ret.error_message = "Could not write index.";
+    return ret;
+  }
+  ret.code = OK;
+  return ret;
+}
+
+// Points (or copies) the n positions of type pos_type at src into *dst.
+static void read_values(Values* dst, const char* src, size_t n, DataType pos_type,
+    int mapped) {
+  if (mapped) {
+    dst->raw = (void*) src;
   }
   else {
-    log_err("Node type not supported!");
+    *dst = alloc_values(pos_type, FANOUT);
+    memcpy(dst->raw, src, n * type_width(pos_type));
   }
 }
 
-void read_tree(FILE* fp, Node* root) {
-  // Read in the node
-  if (1 != fread(root, sizeof(Node), 1, fp)) {
-    log_err("Unable to read root node!");
+// Points (or copies) n Key values at src into *dst.
+static void read_keys(Key** dst, const char* src, size_t n, int mapped) {
+  if (mapped) {
+    *dst = (Key*) src;
+  }
+  else {
+    *dst = alloc_keys();
+    memcpy(*dst, src, n * sizeof(Key));
   }
+}
 
-  // Check to see if it's a leaf node
-  if (root->type == Leaf) {
-    root->children = calloc(1, sizeof(Node));
-    if (1 != fread(root->children, sizeof(Node), 1, fp)) {
-      log_err("Unable to read children node!");
+// Builds the subtree stored at page of buf into node. Leaves are reached
+// left to right, so we link each one to the previous leaf as we go.
+static int read_node(const char* buf, const btree_header* header, uint64_t page,
+    Node* node, int mapped, Node** prev_leaf) {
+  if (page >= header->page_count) {
+    return 0;
+  }
+  const char* start = buf + page * BTREE_PAGE_SIZE;
+  const btree_page* p = (const btree_page*) start;
+  const char* keys = start + sizeof(btree_page);
+  if (p->count > FANOUT || page + p->pages > header->page_count ||
+      node_bytes(p->type, p->count, header->pos_width) > p->pages * BTREE_PAGE_SIZE) {
+    return 0;
+  }
+  node->count = p->count;
+  node->type = p->type;
+  node->mapped = mapped;
+  node->next_link = NULL;
+  node->children = NULL;
+  read_keys(&node->keys, keys, node->count, mapped);
+
+  const char* rest = keys + key_bytes(node->count);
+  if (node->type == Leaf) {
+    node->children = calloc(1, sizeof(Node));
+    node->children->count = node->count;
+    node->children->type = Position;
+    node->children->mapped = mapped;
+    node->children->pos_type = (header->pos_width == sizeof(uint64_t)) ? POS64 : POS32;
+    read_values(&node->children->values, rest, node->count,
+      node->children->pos_type, mapped);
+    if (*prev_leaf) {
+      (*prev_leaf)->next_link = node;
     }
+    *prev_leaf = node;
+    return 1;
+  }
+  if (node->type != Internal || node->count == 0) {
+    node->count = 0;
+    return 0;
   }
-  else if (root->type == Internal) {
-    root->children = calloc(FANOUT, sizeof(Node));
-    for (size_t i = 0; i < root->count; i++) {
-      read_tree(fp, &root->children[i]);
-
-      // Let's link all the children together!
-      if (i != 0) {
-        root->children[i-1].next_link = root->children;
-      }
 
-      // And let's link contiguous groups together
-      if (root->children[i-1].children) {
-        // Get the last one in the previous continguous chunk
-        root->children[i-1].children[root->children[i-1].count - 1].next_link = root->children[i].children;
-      }
+  const uint64_t* children = (const uint64_t*) rest;
+  node->children = column_alloc(node->count, sizeof(Node));
+  for (size_t i = 0; i < node->count; i++) {
+    // Children are always written before their parent.
+    if (children[i] >= page ||
+        !read_node(buf, header, children[i], &node->children[i], mapped, prev_leaf)) {
+      node->count = i;
+      return 0;
     }
   }
+  return 1;
+}
 
-  else {
-    log_err("Node type is unsupported.");
+status read_tree(const char* buf, size_t length, Node* root, int mapped) {
+  status ret;
+  const btree_header* header = (const btree_header*) buf;
+  Node* prev_leaf = NULL;
+  if (length < sizeof(btree_header) || header->magic != BTREE_MAGIC ||
+      header->version != BTREE_VERSION || header->page_size != BTREE_PAGE_SIZE ||
+      header->fanout != FANOUT || header->page_count * BTREE_PAGE_SIZE > length ||
+      (header->pos_width != sizeof(uint32_t) && header->pos_width != sizeof(uint64_t))) {
+    log_err("Index is not a tree we can read.\n");
+    init_tree(root);
+    ret.code = ERROR;
+    ret.error_message = "Incompatible index format.\n";
+    return ret;
   }
-}
\ No newline at end of file
+  if (!read_node(buf, header, header->root, root, mapped, &prev_leaf)) {
+    log_err("Index tree is corrupt.\n");
+    ret.code = ERROR;
+    ret.error_message = "Corrupt index.\n";
+    return ret;
+  }
+  ret.code = OK;
+  return ret;
+}
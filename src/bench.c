@@ -0,0 +1,260 @@
+// Copyright 2015 <Luis Perez>
+
+// Loads a synthetic column with more rows than an int can count (2^31 + 2^20
+// by default, or the count given as the first argument) and times the main
+// query paths over it: a full column select, a fetch of the result, many
+// selects one by one and in a shared scan, and selects through a sorted and
+// a B+tree index. Each result is checked against a plain count over the
+// data.
+//
+// Build with "make bench". The default run needs about 40GB of memory.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "cs165_api.h"
+#include "db.h"
+#include "kernels.h"
+#include "positions.h"
+#include "utils.h"
+
+#define DEFAULT_ROWS ((1UL << 31) + (1UL << 20))
+
+// The selects ask for values in [low, high), about 1% of the rows.
+#define SELECTIVITY 100
+
+// How many selects (each of its own range) run in one shared scan.
+#define BATCH_SELECTS 32
+
+// The globals the server defines, which the engine expects to link against.
+Storage databases;
+int changed;
+
+static struct timespec started;
+
+// The name of the form a select returned its positions in.
+static const char* pos_form(DataType type) {
+    switch (type) {
+        case POS32:
+            return "32-bit";
+        case POS64:
+            return "64-bit";
+        case POSRANGE:
+            return "range";
+        default:
+            return "bitmap";
+    }
+}
+
+static void start_timer(void) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static double stop_timer(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+// Value of row i: a permutation-like spread of [0, 2^31) so the column is
+// not already sorted.
+static int value_of(size_t i) {
+    return (int) ((i * 2654435761UL) & 0x7fffffff);
+}
+
+// Fills c with the comparators for [low, high) on col, returning the first.
+static comparator* range_of(column* col, int low, int high, comparator c[2]) {
+    c[1].p_val = high;
+    c[1].col = col;
+    c[1].type = LESS_THAN;
+    c[1].next_comparator = NULL;
+    c[1].mode = NONE;
+
+    c[0].p_val = low;
+    c[0].col = col;
+    c[0].type = GREATER_THAN | EQUAL;
+    c[0].next_comparator = &c[1];
+    c[0].mode = AND;
+    return &c[0];
+}
+
+// Selects [low, high) on col, returning the result (NULL on failure).
+static result* select_range(column* col, int low, int high) {
+    comparator c[2];
+    result* r = calloc(1, sizeof(struct result));
+    r->num_tuples = col->count;
+    if (col_scan(range_of(col, low, high, c), col, &r).code != OK) {
+        free(r->payload.raw);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Runs and checks one select, reporting how long it took.
+static int run_select(const char* name, column* col, int low, int high, size_t expected) {
+    start_timer();
+    result* r = select_range(col, low, high);
+    double secs = stop_timer();
+    if (!r) {
+        printf("%-16s FAILED\n", name);
+        return 0;
+    }
+    int ok = r->num_tuples == expected;
+    printf("%-16s %10.3fs %12zu positions (%s) %s\n", name, secs, r->num_tuples,
+        pos_form(r->type), (ok) ? "ok" : "WRONG");
+    free(r->payload.raw);
+    free(r);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    size_t rows = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_ROWS;
+    int low = 1 << 20;
+    int high = low + (0x7fffffff / SELECTIVITY);
+    int ok = 1;
+
+    db* bench_db = NULL;
+    table* tbl = NULL;
+    column* col = NULL;
+    if (create_db("bench", &bench_db).code != OK ||
+        create_table(bench_db, "t", 1, &tbl).code != OK ||
+        create_column(tbl, "a", &col).code != OK) {
+        log_err("Could not set up the benchmark table.\n");
+        return 1;
+    }
+
+    // Load the column.
+    printf("Loading %zu rows.\n", rows);
+    start_timer();
+    for (size_t i = 0; i < rows; i++) {
+        Data d;
+        d.i = value_of(i);
+        if (insert(col, d).code != OK) {
+            log_err("Insert failed at row %zu.\n", i);
+            return 1;
+        }
+    }
+    tbl->length = col->count;
+    printf("%-16s %10.3fs\n", "load", stop_timer());
+
+    size_t expected = 0;
+    for (size_t i = 0; i < rows; i++) {
+        expected += col->data.i[i] >= low && col->data.i[i] < high;
+    }
+
+    // Scan, then fetch what qualified.
+    start_timer();
+    result* r = select_range(col, low, high);
+    double secs = stop_timer();
+    if (!r || r->num_tuples != expected) {
+        printf("%-16s WRONG\n", "scan");
+        return 1;
+    }
+    printf("%-16s %10.3fs %12zu positions (%s) ok\n", "scan", secs, r->num_tuples,
+        pos_form(r->type));
+
+    column pos;
+    pos.data = r->payload;
+    pos.type = r->type;
+    pos.count = pos.size = r->num_tuples;
+    result* values = NULL;
+    start_timer();
+    if (fetch(col, &pos, &values).code != OK) {
+        printf("%-16s FAILED\n", "fetch");
+        return 1;
+    }
+    secs = stop_timer();
+    if (expand_positions(&pos).code != OK) {
+        printf("%-16s FAILED\n", "fetch");
+        return 1;
+    }
+    r->payload = pos.data;
+    for (size_t i = 0; i < values->num_tuples; i++) {
+        ok = ok && values->payload.i[i] >= low && values->payload.i[i] < high &&
+            values->payload.i[i] == col->data.i[get_pos(pos.data, pos.type, i)];
+    }
+    printf("%-16s %10.3fs %12zu values %s\n", "fetch", secs, values->num_tuples,
+        (ok) ? "ok" : "WRONG");
+    if (values->base) {
+        values->base->views--;
+    }
+    else {
+        free(values->payload.raw);
+    }
+    free(values);
+    free(r->payload.raw);
+    free(r);
+
+    // Many selects, one scan each and then all in a single shared scan.
+    int lows[BATCH_SELECTS];
+    size_t counts[BATCH_SELECTS] = {0};
+    for (int q = 0; q < BATCH_SELECTS; q++) {
+        lows[q] = q * (0x7fffffff / BATCH_SELECTS);
+    }
+    for (size_t i = 0; i < rows; i++) {
+        for (int q = 0; q < BATCH_SELECTS; q++) {
+            counts[q] += col->data.i[i] >= lows[q] && col->data.i[i] < lows[q] + high - low;
+        }
+    }
+    start_timer();
+    for (int q = 0; q < BATCH_SELECTS; q++) {
+        r = select_range(col, lows[q], lows[q] + high - low);
+        ok = ok && r && r->num_tuples == counts[q];
+        if (r) {
+            free(r->payload.raw);
+            free(r);
+        }
+    }
+    printf("%-16s %10.3fs %12d selects %s\n", "separate scans", stop_timer(), BATCH_SELECTS,
+        (ok) ? "ok" : "WRONG");
+
+    comparator ranges[BATCH_SELECTS][2];
+    comparator* f[BATCH_SELECTS];
+    result results[BATCH_SELECTS];
+    result* rs[BATCH_SELECTS];
+    for (int q = 0; q < BATCH_SELECTS; q++) {
+        f[q] = range_of(col, lows[q], lows[q] + high - low, ranges[q]);
+        rs[q] = &results[q];
+    }
+    start_timer();
+    if (batch_scan(f, BATCH_SELECTS, col, rs).code != OK) {
+        printf("%-16s FAILED\n", "shared scan");
+        return 1;
+    }
+    secs = stop_timer();
+    for (int q = 0; q < BATCH_SELECTS; q++) {
+        ok = ok && results[q].num_tuples == counts[q];
+        free(results[q].payload.raw);
+    }
+    printf("%-16s %10.3fs %12d selects %s\n", "shared scan", secs, BATCH_SELECTS,
+        (ok) ? "ok" : "WRONG");
+
+    // The same select through each kind of index.
+    start_timer();
+    if (create_secondary_index(col, SORTED).code != OK) {
+        printf("%-16s FAILED\n", "sorted index");
+        return 1;
+    }
+    printf("%-16s %10.3fs\n", "sorted index", stop_timer());
+    ok = run_select("sorted select", col, low, high, expected) && ok;
+
+    start_timer();
+    if (recluster_col(col, B_PLUS_TREE).code != OK) {
+        printf("%-16s FAILED\n", "b+tree index");
+        return 1;
+    }
+    printf("%-16s %10.3fs\n", "b+tree index", stop_timer());
+    ok = run_select("b+tree select", col, low, high, expected) && ok;
+
+    alloc_stats stats = get_alloc_stats();
+    printf("%-16s %10zu arrays %14zu bytes, %zu on huge pages (%zu bytes), %zu grown\n",
+        "allocated", stats.allocations, stats.bytes, stats.huge_allocations, stats.huge_bytes,
+        stats.grows);
+    free_db(bench_db);
+    return (ok) ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+// Copyright 2015 <Luis Perez>
+
+#include <string.h>
+
+#include "include/catalog.h"
+#include "include/common.h"
+#include "include/utils.h"
+
+#define CHECKSUM_SEED 0xcbf29ce484222325ULL
+#define CHECKSUM_PRIME 0x100000001b3ULL
+
+uint64_t checksum(const void* data, size_t n) {
+    return checksum_extend(CHECKSUM_SEED, data, n);
+}
+
+uint64_t checksum_extend(uint64_t hash, const void* data, size_t n) {
+    // FNV-1a style, but consuming a word at a time so we can keep up with
+    // the disk when checksumming multi-GB columns.
+    const unsigned char* bytes = data;
+    uint64_t word;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash = (hash ^ word) * CHECKSUM_PRIME;
+        hash ^= hash >> 32;
+    }
+    for (; i < n; i++) {
+        hash = (hash ^ bytes[i]) * CHECKSUM_PRIME;
+    }
+    return hash;
+}
+
+status checksum_file(const char* fname, uint64_t* sum) {
+    status ret;
+    mapping* m = map_file(fname);
+
+    // An empty file has nothing to map.
+    if (!m) {
+        *sum = checksum(NULL, 0);
+        ret.code = OK;
+        return ret;
+    }
+
+    *sum = checksum(m->addr, m->length);
+    release_mapping(m);
+
+    ret.code = OK;
+    return ret;
+}
+
+status open_catalog(const char* fname, catalog* cat) {
+    status ret;
+    cat->map = map_file(fname);
+    if (!cat->map) {
+        ret.code = ERROR;
+        ret.error_message = "Could not map catalog.\n";
+        return ret;
+    }
+
+    char* base = cat->map->addr;
+    cat->header = (catalog_header*) base;
+    if (cat->map->length < sizeof(catalog_header) ||
+        cat->header->magic != CATALOG_MAGIC) {
+        log_err("%s is not a catalog file.\n", fname);
+        close_catalog(cat);
+        ret.code = ERROR;
+        ret.error_message = "Invalid catalog.\n";
+        return ret;
+    }
+    if (cat->header->version != CATALOG_VERSION) {
+        log_err("Catalog %s has version %u but we expect %u.\n", fname,
+            cat->header->version, CATALOG_VERSION);
+        close_catalog(cat);
+        ret.code = ERROR;
+        ret.error_message = "Unsupported catalog version.\n";
+        return ret;
+    }
+
+    size_t body = cat->header->db_count * sizeof(catalog_db) +
+        cat->header->table_count * sizeof(catalog_table) +
+        cat->header->column_count * sizeof(catalog_column);
+    if (cat->map->length != sizeof(catalog_header) + body ||
+        checksum(base + sizeof(catalog_header), body) != cat->header->checksum) {
+        log_err("Catalog %s is corrupt.\n", fname);
+        close_catalog(cat);
+        ret.code = ERROR;
+        ret.error_message = "Corrupt catalog.\n";
+        return ret;
+    }
+
+    // Entries are laid out back to back after the header.
+    cat->dbs = (catalog_db*) (base + sizeof(catalog_header));
+    cat->tables = (catalog_table*) (cat->dbs + cat->header->db_count);
+    cat->columns = (catalog_column*) (cat->tables + cat->header->table_count);
+
+    ret.code = OK;
+    return ret;
+}
+
+void close_catalog(catalog* cat) {
+    release_mapping(cat->map);
+    cat->map = NULL;
+    cat->header = NULL;
+    cat->dbs = NULL;
+    cat->tables = NULL;
+    cat->columns = NULL;
+}
+
+status write_catalog(const char* fname, uint64_t lsn, catalog_db* dbs, size_t db_count,
+    catalog_table* tables, size_t table_count,
+    catalog_column* columns, size_t column_count) {
+    status ret;
+
+    // Assemble the body first so we can checksum it in one pass.
+    size_t db_bytes = db_count * sizeof(catalog_db);
+    size_t table_bytes = table_count * sizeof(catalog_table);
+    size_t column_bytes = column_count * sizeof(catalog_column);
+    size_t body = db_bytes + table_bytes + column_bytes;
+    char* buffer = calloc(sizeof(catalog_header) + body, sizeof(char));
+    if (!buffer) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory.\n";
+        return ret;
+    }
+    char* cur = buffer + sizeof(catalog_header);
+    if (db_bytes) {
+        memcpy(cur, dbs, db_bytes);
+    }
+    cur += db_bytes;
+    if (table_bytes) {
+        memcpy(cur, tables, table_bytes);
+    }
+    cur += table_bytes;
+    if (column_bytes) {
+        memcpy(cur, columns, column_bytes);
+    }
+
+    catalog_header* header = (catalog_header*) buffer;
+    header->magic = CATALOG_MAGIC;
+    header->version = CATALOG_VERSION;
+    header->db_count = db_count;
+    header->table_count = table_count;
+    header->column_count = column_count;
+    header->lsn = lsn;
+    header->checksum = checksum(buffer + sizeof(catalog_header), body);
+
+    // Stage the catalog and rename it into place: it is the commit point for
+    // every file written before it, so it must never be seen half written.
+    char tmpname[DEFAULT_ARRAY_SIZE];
+    FILE* fp = begin_write(fname, tmpname);
+    if (!fp) {
+        free(buffer);
+        ret.code = ERROR;
+        ret.error_message = "Could not open catalog.\n";
+        return ret;
+    }
+    if (1 != fwrite(buffer, sizeof(catalog_header) + body, 1, fp)) {
+        log_err("Could not write catalog %s.\n", fname);
+        abort_write(fp, tmpname);
+        free(buffer);
+        ret.code = ERROR;
+        ret.error_message = "Could not write catalog.\n";
+        return ret;
+    }
+    ret = commit_write(fp, tmpname, fname);
+    if (ret.code != OK) {
+        free(buffer);
+        return ret;
+    }
+    free(buffer);
+
+    ret.code = OK;
+    return ret;
+}
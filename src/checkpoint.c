@@ -0,0 +1,336 @@
+// Copyright 2015 <Luis Perez>
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/catalog.h"
+#include "include/checkpoint.h"
+#include "include/common.h"
+#include "include/utils.h"
+#include "include/wal.h"
+
+// Global column to store pointers to databases we've created/loaded etc.
+extern Storage databases;
+
+pthread_mutex_t execution_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A column or index that was dirty when a checkpoint took its snapshot.
+typedef struct snapshot_item {
+    column* col;
+    int index;    // Whether this is the column's index rather than its data.
+    size_t db;    // Offset of the column's database in databases.
+} snapshot_item;
+
+// What the checkpoint wrote for a snapshot_item.
+typedef struct snapshot_result {
+    uint64_t item;
+    uint64_t epoch;
+    uint64_t checksum;
+    uint64_t length;
+    uint64_t codec;
+} snapshot_result;
+
+static struct {
+    pthread_t thread;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int running;
+    int stop;
+    uint64_t lsn;  // Log position of the last checkpoint.
+} checkpointer = {
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+status write_server_catalog(uint64_t lsn) {
+    status ret;
+    catalog_db* dbs = calloc(databases.count, sizeof(catalog_db));
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        if (strlen(db->name) >= MAX_STRING_LENGTH) {
+            log_err("Database name %s too long to persist.\n", db->name);
+            free(dbs);
+            ret.code = ERROR;
+            ret.error_message = "Database name too long.\n";
+            return ret;
+        }
+        strcpy(dbs[i].name, db->name);
+        dbs[i].table_count = db->table_count;
+    }
+
+    char filename[DEFAULT_ARRAY_SIZE];
+    sprintf(filename, "%s/%s.catalog", DATA_FOLDER, SYSTEM_META_FILE);
+    ret = write_catalog(filename, lsn, dbs, databases.count, NULL, 0, NULL, 0);
+    free(dbs);
+    if (ret.code != OK) {
+        log_err("Could not create catalog %s for server.\n", filename);
+    }
+    return ret;
+}
+
+status sync_databases(uint64_t lsn) {
+    // Make our data directory if it doesn't already exist.
+    struct stat st = {0};
+    if (stat(DATA_FOLDER, &st) == -1) {
+        mkdir(DATA_FOLDER, 0700);
+    }
+
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        db->lsn = lsn;
+        status s = sync_db(db);
+        if (s.code != OK) {
+            log_err("Unable to store database %s", db->name);
+            return s;
+        }
+    }
+    return write_server_catalog(lsn);
+}
+
+// Runs in the forked child: writes out the snapshot and reports each file
+// to the server over fd as soon as the catalog pointing to it is in place.
+// Returns the exit code of the child.
+static int write_snapshot(uint64_t lsn, snapshot_item* items, size_t n, int fd) {
+    size_t next = 0;
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        db->lsn = lsn;
+        if (sync_db(db).code != OK) {
+            log_err("Unable to checkpoint database %s.\n", db->name);
+            return 1;
+        }
+        for (; next < n && items[next].db == i; next++) {
+            column* col = items[next].col;
+            snapshot_result r;
+            r.item = next;
+            r.codec = 0;
+            if (items[next].index) {
+                r.epoch = col->index->epoch;
+                r.checksum = col->index->checksum;
+                r.length = col->index->length;
+            }
+            else {
+                r.epoch = col->epoch;
+                r.checksum = col->checksum;
+                r.length = col->length;
+                r.codec = col->codec;
+            }
+            if (write(fd, &r, sizeof(snapshot_result)) != sizeof(snapshot_result)) {
+                return 1;
+            }
+        }
+    }
+    return (write_server_catalog(lsn).code == OK) ? 0 : 1;
+}
+
+// Checkpoints every database up to the current end of the log. Called with
+// execution_lock held, which is released while the child does the writing.
+static status checkpoint(void) {
+    status ret;
+    ret.code = OK;
+    if (wal_lsn() == checkpointer.lsn) {
+        return ret;  // Nothing new since the last checkpoint.
+    }
+    // Later statements go to a new log segment, so the older ones can be
+    // deleted without touching the one in use.
+    uint64_t lsn = wal_switch();
+
+    // Remember what the child is going to write, in database order.
+    size_t ncols = 0;
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        for (size_t j = 0; j < db->table_count; j++) {
+            ncols += db->tables[j]->col_count;
+        }
+    }
+    snapshot_item* items = calloc(2 * ncols + 1, sizeof(snapshot_item));
+    size_t n = 0;
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        for (size_t j = 0; j < db->table_count; j++) {
+            table* tbl = db->tables[j];
+            for (size_t k = 0; k < tbl->col_count; k++) {
+                column* col = tbl->col[k];
+                if (col->dirty) {
+                    items[n].col = col;
+                    items[n].index = 0;
+                    items[n++].db = i;
+                }
+                if (col->index && col->index->dirty) {
+                    items[n].col = col;
+                    items[n].index = 1;
+                    items[n++].db = i;
+                }
+            }
+        }
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        free(items);
+        ret.code = ERROR;
+        ret.error_message = "Could not create pipe for checkpoint.\n";
+        return ret;
+    }
+    // Don't let the child inherit (and later repeat) buffered output.
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        free(items);
+        ret.code = ERROR;
+        ret.error_message = "Could not fork checkpoint.\n";
+        return ret;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(write_snapshot(lsn, items, n, fds[1]));
+    }
+    close(fds[1]);
+
+    // The child has its snapshot, so anything from here on is a new change.
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].index) {
+            items[i].col->index->dirty = 0;
+        }
+        else {
+            items[i].col->dirty = 0;
+        }
+    }
+
+    // Let statements run while the child writes.
+    pthread_mutex_unlock(&execution_lock);
+    snapshot_result* results = calloc(n + 1, sizeof(snapshot_result));
+    char* received = calloc(n + 1, sizeof(char));
+    snapshot_result r;
+    while (read(fds[0], &r, sizeof(snapshot_result)) == sizeof(snapshot_result)) {
+        if (r.item < n) {
+            results[r.item] = r;
+            received[r.item] = 1;
+        }
+    }
+    close(fds[0]);
+    int wstatus;
+    int ok = waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus) &&
+        WEXITSTATUS(wstatus) == 0;
+    pthread_mutex_lock(&execution_lock);
+
+    // The catalogs now point at whatever the child reported, even for
+    // columns that changed again since. Anything it did not get to is
+    // still only in memory.
+    for (size_t i = 0; i < n; i++) {
+        column* col = items[i].col;
+        if (items[i].index) {
+            if (!col->index) {
+                continue;
+            }
+            if (received[i]) {
+                col->index->epoch = results[i].epoch;
+                col->index->checksum = results[i].checksum;
+                col->index->length = results[i].length;
+            }
+            else {
+                col->index->dirty = 1;
+            }
+        }
+        else if (received[i]) {
+            col->epoch = results[i].epoch;
+            col->checksum = results[i].checksum;
+            col->length = results[i].length;
+            col->codec = results[i].codec;
+        }
+        else {
+            col->dirty = 1;
+        }
+    }
+    free(results);
+    free(received);
+    free(items);
+
+    if (!ok) {
+        log_err("Checkpoint up to %llu failed.\n", (unsigned long long) lsn);
+        ret.code = ERROR;
+        ret.error_message = "Checkpoint failed.\n";
+        return ret;
+    }
+    checkpointer.lsn = lsn;
+    log_info("Checkpointed up to %llu.\n", (unsigned long long) lsn);
+
+    // Statements can run while we delete the old segments.
+    pthread_mutex_unlock(&execution_lock);
+    ret = wal_checkpoint(lsn);
+    pthread_mutex_lock(&execution_lock);
+    return ret;
+}
+
+static void* run_checkpoints(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&execution_lock);
+    while (!checkpointer.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHECKPOINT_INTERVAL;
+        int rc = 0;
+        while (!checkpointer.stop && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&checkpointer.wake, &execution_lock, &deadline);
+        }
+        if (!checkpointer.stop) {
+            status s = checkpoint();
+            if (s.code != OK) {
+                log_err("Background checkpoint failed. %s", s.error_message);
+            }
+        }
+    }
+    checkpointer.running = 0;
+    pthread_cond_broadcast(&checkpointer.done);
+    pthread_mutex_unlock(&execution_lock);
+    return NULL;
+}
+
+status start_checkpointer(void) {
+    status ret;
+    ret.code = OK;
+    if (CHECKPOINT_INTERVAL <= 0) {
+        return ret;
+    }
+
+    // The first checkpoint is due once the log moves past the oldest catalog.
+    checkpointer.lsn = 0;
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        if (i == 0 || db->lsn < checkpointer.lsn) {
+            checkpointer.lsn = db->lsn;
+        }
+    }
+
+    checkpointer.stop = 0;
+    checkpointer.running = 1;
+    if (pthread_create(&checkpointer.thread, NULL, run_checkpoints, NULL) != 0) {
+        log_err("Could not start the checkpoint thread.\n");
+        checkpointer.running = 0;
+        ret.code = ERROR;
+        ret.error_message = "Could not start checkpoint thread.\n";
+    }
+    return ret;
+}
+
+void stop_checkpointer(void) {
+    if (!checkpointer.running) {
+        return;
+    }
+    checkpointer.stop = 1;
+    pthread_cond_signal(&checkpointer.wake);
+    while (checkpointer.running) {
+        pthread_cond_wait(&checkpointer.done, &execution_lock);
+    }
+    pthread_join(checkpointer.thread, NULL);
+}
@@ -69,7 +69,7 @@ void send_to_server(int socket, message* msg) {
         log_err("Failed to send message header.");
         exit(1);
     }
-    if (send(socket, msg->payload, msg->length, 0) == -1) {
+    if (send_all(socket, msg->payload, msg->length) == -1) {
         log_err("Failed to send query payload.");
         exit(1);
     }
@@ -175,23 +175,30 @@ int main(void)
             // Always wait for server response (even if it is just an OK message)
             if ((len = recv(client_socket, &(recv_message), sizeof(message), 0)) > 0) {
                 if (recv_message.status == OK_WAIT_FOR_RESPONSE &&
-                    (int) recv_message.length > 0) {
-                    // Calculate number of bytes in response package
-                    int num_bytes = (int) recv_message.length;
-                    char payload[num_bytes + 1];
+                    recv_message.length > 0) {
+                    // Calculate number of bytes in response package. Results
+                    // can be far larger than the stack.
+                    size_t num_bytes = recv_message.length;
+                    char* payload = malloc(num_bytes + 1);
+                    if (!payload) {
+                        log_err("Response of %zu bytes does not fit in memory.\n", num_bytes);
+                        exit(1);
+                    }
 
                     // Receive the payload and either print it out or shutdown.
-                    if ((len = recv(client_socket, payload, num_bytes, 0)) > 0) {
+                    if (recv_all(client_socket, payload, num_bytes) == 0) {
                         payload[num_bytes] = '\0';
 
                         // Server has requested that we shutdown the client.
                         if (strcmp(payload, SHUTDOWN_MESSAGE) == 0) {
                             // Print a final newline.
                             printf("\n");
+                            free(payload);
                             break;
                         }
                         printf("%s\n", payload);
                     }
+                    free(payload);
                 }
             }
             else {
@@ -0,0 +1,288 @@
+// Copyright 2015 <Luis Perez>
+
+#include <string.h>
+
+#include "include/codec.h"
+#include "include/kernels.h"
+#include "include/utils.h"
+
+// Reads value i of data, a column of type.
+static inline int64_t load_value(const void* data, size_t i, DataType type) {
+    return (type == INT) ? (int64_t) ((const int*) data)[i] :
+        (int64_t) ((const long int*) data)[i];
+}
+
+// Stores v as value i of data, a column of type.
+static inline void store_value(void* data, size_t i, int64_t v, DataType type) {
+    if (type == INT) {
+        ((int*) data)[i] = (int) v;
+    }
+    else {
+        ((long int*) data)[i] = v;
+    }
+}
+
+// Number of bits needed to store every value in [0, range].
+static unsigned width(uint64_t range) {
+    unsigned bits = 0;
+    while (range) {
+        bits++;
+        range >>= 1;
+    }
+    return bits;
+}
+
+// Bytes of payload for n values packed at bits each. We always keep one
+// spare word at the end so unpacking never has to check for it.
+static size_t packed_length(size_t n, unsigned bits) {
+    return ((n * bits + 63) / 64 + 1) * sizeof(uint64_t);
+}
+
+// Packs the n values of v, each less than 2^bits, into words.
+static void pack(const uint64_t* v, size_t n, unsigned bits, uint64_t* words) {
+    memset(words, 0, packed_length(n, bits));
+    if (bits == 0) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t bit = i * bits;
+        unsigned shift = bit & 63;
+        words[bit >> 6] |= v[i] << shift;
+        if (shift + bits > 64) {
+            words[(bit >> 6) + 1] |= v[i] >> (64 - shift);
+        }
+    }
+}
+
+// Unpacks n values of bits each from words into out. The high part of a
+// value straddling two words is shifted in unconditionally (it is zero when
+// the value fits in one word) so the loop has no branches.
+static void unpack(const uint64_t* words, size_t n, unsigned bits, uint64_t* out) {
+    uint64_t mask = (bits == 64) ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1;
+    for (size_t i = 0; i < n; i++) {
+        size_t bit = i * bits;
+        unsigned shift = bit & 63;
+        uint64_t lo = words[bit >> 6] >> shift;
+        uint64_t hi = (words[(bit >> 6) + 1] << 1) << (63 - shift);
+        out[i] = (lo | hi) & mask;
+    }
+}
+
+// Encodes the n values of v as a single block at out (header included),
+// which must have room for the raw block. Returns the bytes used.
+static size_t encode_block(const int64_t* v, size_t n, char* out, uint64_t* scratch) {
+    // Work out what each scheme would cost.
+    int64_t min = v[0], max = v[0];
+    int64_t min_step = 0, max_step = 0;
+    size_t runs = 1;
+    for (size_t i = 1; i < n; i++) {
+        min = (v[i] < min) ? v[i] : min;
+        max = (v[i] > max) ? v[i] : max;
+        int64_t step = (int64_t) ((uint64_t) v[i] - (uint64_t) v[i - 1]);
+        if (i == 1 || step < min_step) {
+            min_step = step;
+        }
+        if (i == 1 || step > max_step) {
+            max_step = step;
+        }
+        runs += v[i] != v[i - 1];
+    }
+    unsigned for_bits = width((uint64_t) max - (uint64_t) min);
+    unsigned delta_bits = width((uint64_t) max_step - (uint64_t) min_step);
+
+    codec_block* block = (codec_block*) out;
+    char* payload = out + sizeof(codec_block);
+    memset(block, 0, sizeof(codec_block));
+    block->count = n;
+
+    size_t raw_length = n * sizeof(int64_t);
+    size_t for_length = packed_length(n, for_bits);
+    size_t delta_length = packed_length(n - 1, delta_bits);
+    size_t rle_length = (runs * (sizeof(int64_t) + sizeof(uint32_t)) + 7) / 8 * 8;
+
+    if (rle_length < raw_length && rle_length <= for_length && rle_length <= delta_length) {
+        block->scheme = BLOCK_RLE;
+        block->length = rle_length;
+        block->base = runs;
+        memset(payload, 0, rle_length);
+        int64_t* values = (int64_t*) payload;
+        uint32_t* lengths = (uint32_t*) (values + runs);
+        size_t r = 0;
+        values[0] = v[0];
+        lengths[0] = 1;
+        for (size_t i = 1; i < n; i++) {
+            if (v[i] == v[i - 1]) {
+                lengths[r]++;
+            }
+            else {
+                values[++r] = v[i];
+                lengths[r] = 1;
+            }
+        }
+    }
+    else if (delta_length < raw_length && delta_length < for_length) {
+        block->scheme = BLOCK_DELTA;
+        block->bits = delta_bits;
+        block->length = delta_length;
+        block->base = v[0];
+        block->step = min_step;
+        for (size_t i = 1; i < n; i++) {
+            scratch[i - 1] = ((uint64_t) v[i] - (uint64_t) v[i - 1]) - (uint64_t) min_step;
+        }
+        pack(scratch, n - 1, delta_bits, (uint64_t*) payload);
+    }
+    else if (for_length < raw_length) {
+        block->scheme = BLOCK_FOR;
+        block->bits = for_bits;
+        block->length = for_length;
+        block->base = min;
+        for (size_t i = 0; i < n; i++) {
+            scratch[i] = (uint64_t) v[i] - (uint64_t) min;
+        }
+        pack(scratch, n, for_bits, (uint64_t*) payload);
+    }
+    else {
+        block->scheme = BLOCK_RAW;
+        block->length = raw_length;
+        memcpy(payload, v, raw_length);
+    }
+    return sizeof(codec_block) + block->length;
+}
+
+size_t encode_column(const void* data, size_t count, DataType type, char** out) {
+    *out = NULL;
+    if (count == 0 || type == DOUBLE) {
+        return 0;
+    }
+
+    // No block ever takes more than its raw values.
+    size_t nblocks = (count + CODEC_BLOCK_SIZE - 1) / CODEC_BLOCK_SIZE;
+    char* buf = malloc(nblocks * sizeof(codec_block) + count * sizeof(int64_t));
+    int64_t* values = malloc(CODEC_BLOCK_SIZE * sizeof(int64_t));
+    uint64_t* scratch = malloc(CODEC_BLOCK_SIZE * sizeof(uint64_t));
+    if (!buf || !values || !scratch) {
+        log_err("Could not allocate space to compress column.\n");
+        free(buf);
+        free(values);
+        free(scratch);
+        return 0;
+    }
+
+    size_t length = 0;
+    for (size_t start = 0; start < count; start += CODEC_BLOCK_SIZE) {
+        size_t n = (count - start < CODEC_BLOCK_SIZE) ? count - start : CODEC_BLOCK_SIZE;
+        for (size_t i = 0; i < n; i++) {
+            values[i] = load_value(data, start + i, type);
+        }
+        length += encode_block(values, n, buf + length, scratch);
+    }
+    free(values);
+    free(scratch);
+    *out = buf;
+    return length;
+}
+
+// The payload length a well-formed block header implies.
+static size_t expected_length(const codec_block* block) {
+    size_t n = block->count;
+    switch (block->scheme) {
+        case BLOCK_RAW:
+            return n * sizeof(int64_t);
+        case BLOCK_FOR:
+            return packed_length(n, block->bits);
+        case BLOCK_DELTA:
+            return packed_length(n - 1, block->bits);
+        case BLOCK_RLE:
+            if ((uint64_t) block->base > n) {
+                return 0;
+            }
+            return (block->base * (sizeof(int64_t) + sizeof(uint32_t)) + 7) / 8 * 8;
+        default:
+            return 0;
+    }
+}
+
+// Decodes a single block into out.
+static status decode_block(const codec_block* block, const char* payload,
+    void* out, DataType type, uint64_t* scratch) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    size_t n = block->count;
+    if (block->scheme == BLOCK_RAW) {
+        const int64_t* values = (const int64_t*) payload;
+        for (size_t i = 0; i < n; i++) {
+            store_value(out, i, values[i], type);
+        }
+    }
+    else if (block->scheme == BLOCK_FOR) {
+        unpack((const uint64_t*) payload, n, block->bits, scratch);
+        for (size_t i = 0; i < n; i++) {
+            store_value(out, i, (int64_t) (scratch[i] + (uint64_t) block->base), type);
+        }
+    }
+    else if (block->scheme == BLOCK_DELTA) {
+        unpack((const uint64_t*) payload, n - 1, block->bits, scratch);
+        uint64_t v = (uint64_t) block->base;
+        store_value(out, 0, (int64_t) v, type);
+        for (size_t i = 1; i < n; i++) {
+            v += scratch[i - 1] + (uint64_t) block->step;
+            store_value(out, i, (int64_t) v, type);
+        }
+    }
+    else if (block->scheme == BLOCK_RLE) {
+        size_t runs = block->base;
+        const int64_t* values = (const int64_t*) payload;
+        const uint32_t* lengths = (const uint32_t*) (values + runs);
+        size_t i = 0;
+        for (size_t r = 0; r < runs; r++) {
+            if (lengths[r] > n - i) {
+                break;
+            }
+            for (uint32_t j = 0; j < lengths[r]; j++) {
+                store_value(out, i++, values[r], type);
+            }
+        }
+        if (i != n) {
+            ret.code = ERROR;
+            ret.error_message = "Corrupt run-length block.\n";
+        }
+    }
+    else {
+        ret.code = ERROR;
+        ret.error_message = "Unknown block scheme.\n";
+    }
+    return ret;
+}
+
+status decode_column(const char* buf, size_t length, void* data, size_t count,
+    DataType type) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    uint64_t* scratch = malloc(CODEC_BLOCK_SIZE * sizeof(uint64_t));
+    size_t width = type_width(type);
+    size_t offset = 0;
+    size_t decoded = 0;
+    while (ret.code == OK && decoded < count) {
+        const codec_block* block = (const codec_block*) (buf + offset);
+        if (offset + sizeof(codec_block) > length ||
+            block->count == 0 || block->count > CODEC_BLOCK_SIZE ||
+            block->count > count - decoded || block->bits > 64 ||
+            block->length != expected_length(block) ||
+            offset + sizeof(codec_block) + block->length > length) {
+            ret.code = ERROR;
+            ret.error_message = "Corrupt compressed column.\n";
+            break;
+        }
+        ret = decode_block(block, buf + offset + sizeof(codec_block),
+            (char*) data + decoded * width, type, scratch);
+        decoded += block->count;
+        offset += sizeof(codec_block) + block->length;
+    }
+    free(scratch);
+    if (ret.code != OK) {
+        log_err("Could not decompress column. %s", ret.error_message);
+    }
+    return ret;
+}
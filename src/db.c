@@ -1,13 +1,28 @@
 // Copyright 2015 <Luis Perez>
 
+#define _XOPEN_SOURCE 700
+
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "db.h"
+#include "include/alloc.h"
 #include "include/b_tree.h"
+#include "include/catalog.h"
+#include "include/checkpoint.h"
+#include "include/codec.h"
 #include "include/common.h"
+#include "include/kernels.h"
+#include "include/morsels.h"
+#include "include/packed.h"
+#include "include/positions.h"
+#include "include/storage.h"
 #include "include/utils.h"
 #include "include/var_store.h"
+#include "include/zones.h"
 
 status global;
 
@@ -42,107 +57,398 @@ status create_db(const char* db_name, db** db) {
     return s;
 }
 
-// Loads the data belong to tbl into table. tbl must have all parameters set
-// except the columns, which are loaded here.
-// Metadata is a file ponter to the metadata file.
-status load_table(FILE* metadata, table* tbl, char* cluster_column) {
-    // Allocate space for the columns
-    tbl->col = calloc(1, sizeof(struct column*) * tbl->table_size);
+// Writes the name of the file holding part ("data" or "index") of column
+// name as of epoch into fname.
+void column_file(char* fname, const char* name, uint64_t epoch, const char* part) {
+    sprintf(fname, "%s/%s.%llu.%s", DATA_FOLDER, name,
+        (unsigned long long) epoch, part);
+}
 
-    char buffer[DEFAULT_ARRAY_SIZE];
-    char buffer2[DEFAULT_ARRAY_SIZE];
+// The offset of the positions in the index file of a SortedIndex over col.
+// They follow the sorted copy of the values, padded to a multiple of 8 bytes.
+static size_t sorted_pos_offset(column* col) {
+    size_t length = col->count * type_width(col->type);
+    return (length + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
 
-    // Read in each column.
-    FILE* fp;
+// Reads count values at offset in fp into a newly allocated array for col.
+// Used when the column file cannot be (or should not be) mapped.
+status read_column_data(FILE* fp, column* col, size_t offset, size_t count) {
     status ret;
-    for (size_t i = 0; i < tbl->table_size; i++) {
-        column* col = calloc(1, sizeof(struct column));
-        if (fscanf(metadata,
-            // Read column_name size index
-            (i < tbl->table_size - 1) ? " %s %zu %s " : " %s %zu %s\n",
-            buffer, &col->count, buffer2) != 3) {
-            log_err("Could not read from metadata file for column loading");
-            ret.code = ERROR;
-            ret.error_message = "Could read file.\n";
-            return ret;
-        }
-        col->size = col->count;
-        col->name = copystr(buffer);
+    size_t width = type_width(col->type);
+    col->data = alloc_values_uninit(col->type, count);
+    if (!col->data.raw ||
+        read_file_range(fp, col->data.raw, count * width, offset).code != OK) {
+        log_err("Could not read columnar file data for %s.\n", col->name);
+        ret.code = ERROR;
+        ret.error_message = "Could not read data.\n";
+        return ret;
+    }
+    ret.code = OK;
+    return ret;
+}
 
-        // Read in the data! We do this for all indexes!
-        col->data = calloc(col->size, sizeof(Data));
-        sprintf(buffer, "%s/%s.data", DATA_FOLDER, col->name);
-        fp = fopen(buffer, "rb");
-        if (!fp) {
-            log_err("Could not open columnar file %s.", buffer);
+// Maps (or when mapping is off or fails, opens) fname and checks that it
+// holds at least length bytes. Exactly one of *m and *fp is set on success.
+status open_column_file(const char* fname, size_t length, uint64_t sum,
+    mapping** m, FILE** fp) {
+    status ret;
+#ifdef VERIFY_CHECKSUMS
+    // Verifying touches every page, so we only do it when asked to.
+    uint64_t actual;
+    if (checksum_file(fname, &actual).code != OK || actual != sum) {
+        log_err("Checksum mismatch for columnar file %s.\n", fname);
+        ret.code = ERROR;
+        ret.error_message = "Corrupt columnar file.\n";
+        return ret;
+    }
+#else
+    (void) sum;
+#endif
+
+    *fp = NULL;
+    *m = (MMAP_COLUMNS) ? map_file(fname) : NULL;
+    if (*m && (*m)->length < length) {
+        log_err("Columnar file %s is truncated.\n", fname);
+        release_mapping(*m);
+        *m = NULL;
+    }
+    if (!*m) {
+        *fp = fopen(fname, "rb");
+        if (!*fp) {
+            log_err("Could not open columnar file %s.", fname);
             ret.code = ERROR;
             ret.error_message = "Could not open columnar file.\n";
             return ret;
         }
-        if (col->count != fread(col->data, sizeof(Data), col->count, fp)) {
-            log_err("Could not read columnar file data %s.\n", buffer);
+    }
+    ret.code = OK;
+    return ret;
+}
+
+// Releases whatever open_column_file handed out.
+void close_column_file(mapping* m, FILE* fp) {
+    if (m) {
+        release_mapping(m);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+// Decompresses the values of col from its data file, which was either mapped
+// (m) or opened (fp). Compressed columns always live on the heap.
+status read_compressed_data(mapping* m, FILE* fp, catalog_column* entry, column* col) {
+    status ret;
+    char* copy = NULL;
+    const char* buf;
+    if (m) {
+        buf = (char*) m->addr + entry->data_offset;
+    }
+    else {
+        copy = malloc(entry->data_length + 1);
+        if (!copy || read_file_range(fp, copy, entry->data_length,
+                entry->data_offset).code != OK) {
+            log_err("Could not read columnar file data for %s.\n", col->name);
+            free(copy);
             ret.code = ERROR;
             ret.error_message = "Could not read data.\n";
-            fclose(fp);
             return ret;
         }
+        buf = copy;
+    }
 
-        // Read in the index data!
-        if (strcmp(buffer2, "sorted" ) == 0) {
-            col->index = calloc(1, sizeof(column_index));
-            col->index->type = SORTED;
-            SortedIndex* idx = calloc(1, sizeof(SortedIndex));
-            // Read sorted values only when not the cluster
-            if (strcmp(col->name, cluster_column) != 0) {
-                idx->data = calloc(col->count, sizeof(Data));
-                if (col->count != fread(idx->data, sizeof(Data), col->count, fp)) {
-                    log_err("Could not read columnar file data %s.\n", buffer);
-                    ret.code = ERROR;
-                    ret.error_message = "Could not read data.\n";
-                    fclose(fp);
-                    free(idx);
-                    return ret;
-                }
+    col->map = NULL;
+    col->data = alloc_values_uninit(col->type, col->count + 1);
+    if (!col->data.raw) {
+        free(copy);
+        ret.code = ERROR;
+        ret.error_message = "Could not allocate space.\n";
+        return ret;
+    }
+    ret = decode_column(buf, entry->data_length, col->data.raw, col->count, col->type);
+    free(copy);
+    return ret;
+}
 
-                // Read positions mappings
-                idx->pos = calloc(col->count, sizeof(Data));
-                if (col->count != fread(idx->pos, sizeof(Data), col->count, fp)) {
-                    log_err("Could not read columnar file data %s.\n", buffer);
-                    ret.code = ERROR;
-                    ret.error_message = "Could not read data.\n";
-                    fclose(fp);
-                    free(idx);
-                    return ret;
-                }
-            } else {
-                // This a clustered column so index just point to data
-                idx->data = col;
-                idx->pos = NULL;
-            }
-            col->index->index = idx;
+// Loads the data of col (along with any index) from the files named in its
+// catalog entry, using the byte ranges recorded there.
+// When MMAP_COLUMNS is set, the data and SortedIndex arrays point directly
+// into a private mapping of the files rather than being copied out of them.
+// Everything loaded here matches the disk, so it all starts out clean.
+status load_column(column* col, catalog_column* entry, int clustered) {
+    status ret;
+    if (entry->index == B_PLUS_TREE && entry->fanout != FANOUT) {
+        log_err("Index for %s was written with fanout %u (expected %d).\n",
+            col->name, entry->fanout, FANOUT);
+        ret.code = ERROR;
+        ret.error_message = "Incompatible index parameters.\n";
+        return ret;
+    }
 
+    char fname[DEFAULT_ARRAY_SIZE];
+    mapping* m;
+    FILE* fp;
+    column_file(fname, col->name, entry->data_epoch, "data");
+    ret = open_column_file(fname, entry->data_offset + entry->data_length,
+        entry->data_checksum, &m, &fp);
+    if (ret.code != OK) {
+        return ret;
+    }
+    if (entry->data_codec == CODEC_BLOCKS) {
+        ret = read_compressed_data(m, fp, entry, col);
+    }
+    else if (m) {
+        attach_mapping(col, m, entry->data_offset);
+    }
+    else {
+        ret = read_column_data(fp, col, entry->data_offset, col->count);
+    }
+    close_column_file(m, fp);
+    if (ret.code != OK) {
+        return ret;
+    }
+    col->checksum = entry->data_checksum;
+    col->epoch = entry->data_epoch;
+    col->length = entry->data_length;
+    col->codec = entry->data_codec;
+    col->dirty = 0;
+
+    // The zones were written along with the data, unless the column had
+    // none then (or they were lost), in which case we work them out again.
+    column_file(fname, col->name, entry->data_epoch, "zones");
+    fp = fopen(fname, "rb");
+    if (!fp || !read_zones(col, fp)) {
+        build_zones(col);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+
+    // No index!
+    if (entry->index == CATALOG_NO_INDEX) {
+        col->index = NULL;
+        ret.code = OK;
+        return ret;
+    }
+
+    col->index = calloc(1, sizeof(column_index));
+    col->index->type = entry->index;
+    col->index->length = entry->index_length;
+    col->index->checksum = entry->index_checksum;
+    col->index->epoch = entry->index_epoch;
+    col->index->dirty = 0;
+
+    // A clustered sorted column is its own index, nothing else to read.
+    if (entry->index == SORTED && clustered) {
+        SortedIndex* idx = calloc(1, sizeof(SortedIndex));
+        idx->data = col;
+        idx->pos = NULL;
+        col->index->index = idx;
+        ret.code = OK;
+        return ret;
+    }
+
+    // Read in the index data!
+    column_file(fname, col->name, entry->index_epoch, "index");
+    ret = open_column_file(fname, entry->index_offset + entry->index_length,
+        entry->index_checksum, &m, &fp);
+    if (ret.code != OK) {
+        return ret;
+    }
+    if (entry->index == SORTED) {
+        SortedIndex* idx = calloc(1, sizeof(SortedIndex));
+        col->index->index = idx;
+        idx->data = calloc(1, sizeof(struct column));
+        idx->pos = calloc(1, sizeof(struct column));
+        idx->data->count = idx->data->size = col->count;
+        idx->pos->count = idx->pos->size = col->count;
+        idx->data->type = col->type;
+        idx->pos->type = pos_type(col->count);
+
+        // The sorted copy is followed by the positions.
+        size_t pos_offset = entry->index_offset + sorted_pos_offset(col);
+        if (m) {
+            attach_mapping(idx->data, m, entry->index_offset);
+            attach_mapping(idx->pos, m, pos_offset);
         }
-        else if (strcmp(buffer2, "btree") == 0) {
-            col->index = calloc(1, sizeof(column_index));
-            col->index->type = B_PLUS_TREE;
-            col->index->index = calloc(1, sizeof(Node));
-            read_tree(fp, col->index->index);
+        else if ((ret = read_column_data(fp, idx->data, entry->index_offset, col->count)).code == OK) {
+            ret = read_column_data(fp, idx->pos, pos_offset, col->count);
+        }
+    }
+    else if (entry->index == B_PLUS_TREE) {
+        Node* root = calloc(1, sizeof(Node));
+        col->index->index = root;
+        if (m) {
+            // The nodes point straight into the mapping, so the index keeps it.
+            ret = read_tree((char*) m->addr + entry->index_offset,
+                entry->index_length, root, 1);
+            col->index->map = m;
+            m = NULL;
         }
-        // No index!
         else {
-            col->index = NULL;
+            char* buf = malloc(entry->index_length);
+            if (!buf || read_file_range(fp, buf, entry->index_length,
+                    entry->index_offset).code != OK) {
+                log_err("Could not read index %s.\n", fname);
+                init_tree(root);
+                ret.code = ERROR;
+                ret.error_message = "Could not read index.\n";
+            }
+            else {
+                ret = read_tree(buf, entry->index_length, root, 0);
+            }
+            free(buf);
+        }
+    }
+    close_column_file(m, fp);
+    return ret;
+}
+
+// A column whose data and index are still only on disk.
+typedef struct pending_column {
+    catalog_column entry;
+    int clustered;
+} pending_column;
+
+// Loads the data and index of a column set up by load_table, and packs the
+// data (see packed.h). Does nothing if the column is already loaded.
+status load_pending_column(void* value) {
+    column* col = value;
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    if (!col->pending) {
+        return ret;
+    }
+    ret = load_column(col, &col->pending->entry, col->pending->clustered);
+    if (ret.code != OK) {
+        // Leave it pending so the next use can try again.
+        free_index(col);
+        release_data(col);
+        return ret;
+    }
+    free(col->pending);
+    col->pending = NULL;
+
+    // A column we cannot pack is still usable as it is.
+    if (pack_column(col).code != OK) {
+        log_err("Could not pack column %s.\n", col->name);
+    }
+    return ret;
+}
+
+// Columns being loaded by a pool of threads. Each thread takes the next
+// column until they run out, so a thread rebuilding a large tree does not
+// hold up the reads of the other columns.
+typedef struct load_job {
+    column** cols;
+    size_t n;
+    size_t next;
+    pthread_mutex_t lock;
+    status ret;
+} load_job;
+
+static void* run_load_job(void* arg) {
+    load_job* job = arg;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        int failed = job->ret.code != OK;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->n || failed) {
+            break;
+        }
+
+        column* col = job->cols[i];
+        if (!col->pending) {
+            continue;
+        }
+        size_t bytes = col->pending->entry.data_length + col->pending->entry.index_length;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        status s = load_pending_column(col);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        log_info("Loaded %s (%zu bytes) in %.3fms.\n", col->name, bytes,
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        if (s.code != OK) {
+            pthread_mutex_lock(&job->lock);
+            job->ret = s;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+// Loads the n pending columns in cols on up to LOAD_THREADS threads
+// (including the calling one).
+status load_columns(column** cols, size_t n) {
+    load_job job;
+    job.cols = cols;
+    job.n = n;
+    job.next = 0;
+    job.ret.code = OK;
+    job.ret.error_message = NULL;
+    pthread_mutex_init(&job.lock, NULL);
+
+    size_t nthreads = (n < LOAD_THREADS) ? n : LOAD_THREADS;
+    pthread_t threads[nthreads + 1];
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, run_load_job, &job) == 0) {
+            started++;
+        }
+    }
+    run_load_job(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    return job.ret;
+}
+
+// Loads every column of a table. Statements that name a table (inserts,
+// loads, clustering) touch all of its columns.
+status load_pending_table(void* value) {
+    table* tbl = value;
+    return load_columns(tbl->col, tbl->col_count);
+}
+
+// Sets up the columns of tbl described by the catalog entries. tbl must have
+// all parameters set except the columns, which are created here.
+// cluster is the offset of the clustering column (-1 if none).
+// With LAZY_LOAD, we only remember where each column lives and load it the
+// first time it (or its table) is looked up.
+status load_table(table* tbl, catalog_column* entries, int64_t cluster) {
+    // Allocate space for the columns
+    tbl->col = calloc(1, sizeof(struct column*) * tbl->table_size);
+
+    // Set up each column.
+    for (size_t i = 0; i < tbl->col_count; i++) {
+        column* col = calloc(1, sizeof(struct column));
+        col->name = copystr(entries[i].name);
+        col->count = entries[i].count;
+        col->size = col->count;
+        col->type = entries[i].type;
+        col->checksum = entries[i].data_checksum;
+        col->epoch = entries[i].data_epoch;
+        col->pending = malloc(sizeof(pending_column));
+        col->pending->entry = entries[i];
+        col->pending->clustered = (int64_t) i == cluster;
+
+        // Restore the clustering column.
+        if ((int64_t) i == cluster) {
+            tbl->cluster_column = col;
         }
 
         // Add the column to the variable pool
-        set_resource(col->name, col);
+        set_lazy_resource(col->name, col, load_pending_column);
 
         // Add column to the table
         tbl->col[i] = col;
-
-        fclose(fp);
     }
 
-
+    status ret;
     ret.code = OK;
     return ret;
 }
@@ -156,149 +462,361 @@ status open_db(const char* filename, db** db, OpenFlags flags)
         return ret;
     }
 
-    // Open the file with the data
-    FILE* mfile = fopen(filename, "r");
-    if (!mfile) {
-        ret.error_message = "Open failed.\n";
-        ret.code = ERROR;
+    // Map the catalog with the data
+    catalog cat;
+    ret = open_catalog(filename, &cat);
+    if (ret.code != OK) {
         return ret;
     }
 
     // Allocate space for the tables
+    (*db)->table_count = cat.header->table_count;
+    (*db)->lsn = cat.header->lsn;
     (*db)->tables = calloc((*db)->table_count, sizeof(struct table*));
     if (!(*db)->tables) {
         ret.error_message = "Could not allocate space.\n";
         ret.code = ERROR;
-        fclose(mfile);
+        close_catalog(&cat);
         return ret;
     }
 
     // Iterate over the tables and load each one
-    char buffer[DEFAULT_ARRAY_SIZE];
     for(size_t i = 0; i < (*db)->table_count; i++) {
-        table* tbl = calloc(1, sizeof(struct table));
-
-        // Read in the table name and column count
-        if (fscanf(mfile, " %s %zu ",
-            buffer, &tbl->col_count) != 2) {
+        catalog_table* entry = &cat.tables[i];
+        if (entry->first_column + entry->col_count > cat.header->column_count) {
             ret.code = ERROR;
             ret.error_message = "Could not read metadata.";
             log_err(ret.error_message);
-            fclose(mfile);
+            close_catalog(&cat);
             return ret;
         }
-        tbl->table_size = tbl->col_count;
-        tbl->name = copystr(buffer);
 
-        // Read in the cluster index name!
-        if (fscanf(mfile, " %s ", buffer) != 1) {
-            ret.code = ERROR;
-            ret.error_message = "Could not read metadata.";
-            log_err(ret.error_message);
-            free(tbl);
-            fclose(mfile);
-            return ret;
-        }
+        table* tbl = calloc(1, sizeof(struct table));
+        tbl->name = copystr(entry->name);
+        tbl->col_count = entry->col_count;
+        tbl->table_size = tbl->col_count;
 
-        // Read the rest of the line for this table!
-        status s = load_table(mfile, tbl, buffer);
+        status s = load_table(tbl, &cat.columns[entry->first_column], entry->cluster_column);
         if (s.code != OK) {
-            fclose(mfile);
+            close_catalog(&cat);
             free(tbl);
             return s;
         }
+        if (tbl->cluster_column) {
+            tbl->cluster_column->delta = entry->delta;
+        }
 
         tbl->length = 0;  // unused
 
         // Add the table to the variable pool
-        set_resource(tbl->name, tbl);
+        set_lazy_resource(tbl->name, tbl, load_pending_table);
 
         // Add the table to the database
         (*db)->tables[i] = tbl;
     }
 
-    fclose(mfile);
+    close_catalog(&cat);
+
+    // Without LAZY_LOAD, every column of the database is loaded upfront.
+    ret.code = OK;
+    if (!LAZY_LOAD) {
+        size_t ncols = 0;
+        for (size_t i = 0; i < (*db)->table_count; i++) {
+            ncols += (*db)->tables[i]->col_count;
+        }
+        column** cols = calloc(ncols + 1, sizeof(column*));
+        size_t n = 0;
+        for (size_t i = 0; i < (*db)->table_count; i++) {
+            table* tbl = (*db)->tables[i];
+            for (size_t j = 0; j < tbl->col_count; j++) {
+                cols[n++] = tbl->col[j];
+            }
+        }
+        ret = load_columns(cols, n);
+        free(cols);
+    }
+    return ret;
+}
+
+static struct {
+    pthread_t thread;
+    FILE* list;
+    int stop;
+} warmup;
+
+static void* run_warmup(void* arg) {
+    (void) arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t loaded = 0;
+    char name[DEFAULT_ARRAY_SIZE];
+    while (fgets(name, DEFAULT_ARRAY_SIZE, warmup.list)) {
+        name[strcspn(name, "\r\n")] = '\0';
+        if (name[0] == '\0') {
+            continue;
+        }
+        pthread_mutex_lock(&execution_lock);
+        if (warmup.stop) {
+            pthread_mutex_unlock(&execution_lock);
+            break;
+        }
+        if (get_resource(name)) {
+            loaded++;
+        }
+        else {
+            log_err("Could not warm up %s.\n", name);
+        }
+        pthread_mutex_unlock(&execution_lock);
+    }
+    fclose(warmup.list);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_info("Warmed up %zu resources in %.3fs.\n", loaded,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return NULL;
+}
 
+status start_warmup(void) {
+    status ret;
     ret.code = OK;
+    char fname[DEFAULT_ARRAY_SIZE];
+    sprintf(fname, "%s/%s", DATA_FOLDER, WARMUP_FILE);
+    warmup.list = fopen(fname, "r");
+    if (!warmup.list) {
+        return ret;
+    }
+
+    // Nobody waits for it; shutdown just tells it to stop.
+    warmup.stop = 0;
+    if (pthread_create(&warmup.thread, NULL, run_warmup, NULL) != 0) {
+        log_err("Could not start the warm-up thread.\n");
+        fclose(warmup.list);
+        ret.code = ERROR;
+        ret.error_message = "Could not start warm-up thread.\n";
+        return ret;
+    }
+    pthread_detach(warmup.thread);
     return ret;
 }
 
+void stop_warmup(void) {
+    warmup.stop = 1;
+}
+
 status drop_db(db* db)
 {
     (void) db;
     return global;
 }
 
-// Writes out a table.
-status sync_table(table* tbl){
+// Files superseded during a sync. They are removed once the new catalog is
+// in place, so a crash mid-sync leaves the old catalog's files intact.
+typedef struct stale_files {
+    char** names;
+    size_t count;
+} stale_files;
+
+// Remembers the file for part of col as of epoch if a sync to new_epoch
+// replaces it.
+void add_stale(stale_files* stale, const char* name, uint64_t epoch,
+    uint64_t new_epoch, const char* part) {
+    if (epoch == new_epoch) {
+        return;
+    }
+    char fname[DEFAULT_ARRAY_SIZE];
+    column_file(fname, name, epoch, part);
+    stale->names[stale->count++] = copystr(fname);
+}
+
+// Stages the values of col in batch as a new data file for epoch. The
+// column is taken to be synced from here on; if the batch fails, it is
+// marked dirty again.
+status sync_column_data(column* col, uint64_t epoch, stale_files* stale,
+    file_batch* batch) {
     char fname[DEFAULT_ARRAY_SIZE];
     status s;
-    for (size_t i = 0; i < tbl->col_count; i++) {
-        sprintf(fname, "%s/%s.data", DATA_FOLDER, tbl->col[i]->name);
-        FILE* data = fopen(fname, "wb");
-        if (!data) {
+    column_file(fname, col->name, epoch, "data");
+
+    // A packed column is written from a plain copy, which the batch owns.
+    Values data = col->data;
+    if (col->packed) {
+        data = alloc_values_uninit(col->type, col->count);
+        if (!data.raw) {
             s.code = ERROR;
-            s.error_message = "Could not open file.";
-            log_err("Could not open %s\n", fname);
+            s.error_message = "Low on memory";
             return s;
         }
-        if (tbl->col[i]->count != fwrite(tbl->col[i]->data, sizeof(Data), tbl->col[i]->count, data)) {
+        unpack_values(col->packed, data);
+    }
+
+    // Only keep the compressed copy if it is worth giving up the mapping.
+    size_t length = col->count * type_width(col->type);
+    char* encoded = NULL;
+    if (COMPRESS_COLUMNS) {
+        size_t encoded_length = encode_column(data.raw, col->count, col->type, &encoded);
+        if (encoded && encoded_length * 2 <= length) {
+            length = encoded_length;
+        }
+        else {
+            free(encoded);
+            encoded = NULL;
+        }
+    }
+
+    // What we write is exactly what is in memory. The batch frees the
+    // compressed copy once it is out.
+    stage_file(batch, fname, &col->dirty);
+    col->checksum = checksum((encoded) ? (void*) encoded : data.raw, length);
+    if (encoded && col->packed) {
+        free(data.raw);
+    }
+    stage_data(batch, (encoded) ? (void*) encoded : data.raw, length,
+        encoded != NULL || col->packed);
+    add_stale(stale, col->name, col->epoch, epoch, "data");
+
+    // The zones go in a file of their own next to the data.
+    if (col->zones) {
+        column_file(fname, col->name, epoch, "zones");
+        stage_file(batch, fname, &col->dirty);
+        stage_zones(col, batch);
+    }
+    add_stale(stale, col->name, col->epoch, epoch, "zones");
+    col->epoch = epoch;
+    col->length = length;
+    col->codec = (encoded) ? CODEC_BLOCKS : CODEC_NONE;
+    col->dirty = 0;
+    s.code = OK;
+    return s;
+}
+
+// Stages the index of col in batch as a new index file for epoch. A
+// clustered SortedIndex is the column itself, so it has no file of its own.
+status sync_column_index(table* tbl, column* col, uint64_t epoch, stale_files* stale,
+    file_batch* batch) {
+    char fname[DEFAULT_ARRAY_SIZE];
+    status s;
+    column_file(fname, col->name, epoch, "index");
+
+    column_index* index = col->index;
+    if (index->type == SORTED &&
+        ((SortedIndex*) index->index)->data == tbl->cluster_column) {
+        // Clean up the file of any index this column used to have.
+        add_stale(stale, col->name, index->epoch, epoch, "index");
+        index->length = 0;
+        index->checksum = checksum(NULL, 0);
+        index->epoch = epoch;
+        index->dirty = 0;
+        s.code = OK;
+        return s;
+    }
+
+    if (index->type == B_PLUS_TREE) {
+        // The tree is serialized page by page into memory, and that buffer
+        // is what we checksum and hand to the batch.
+        char* buf = NULL;
+        size_t length = 0;
+        FILE* fp = open_memstream(&buf, &length);
+        if (!fp) {
             s.code = ERROR;
-            s.error_message = "Could not write data to file!";
-            log_err("Could not write data to file!");
-            fclose(data);
+            s.error_message = "Low on memory.\n";
+            return s;
+        }
+        s = write_tree(fp, index->index);
+        fclose(fp);
+        if (s.code != OK) {
+            free(buf);
             return s;
         }
+        stage_file(batch, fname, &index->dirty);
+        stage_data(batch, buf, length, 1);
+        index->length = length;
+        index->checksum = checksum(buf, length);
+    }
+    else if (index->type == SORTED) {
+        // The sorted copy (padded) followed by the positions.
+        static const char zeros[sizeof(uint64_t)];
+        SortedIndex* idx = index->index;
+        size_t length = col->count * type_width(col->type);
+        size_t pad = sorted_pos_offset(col) - length;
+        size_t pos_length = col->count * type_width(idx->pos->type);
+        stage_file(batch, fname, &index->dirty);
+        stage_data(batch, idx->data->data.raw, length, 0);
+        stage_data(batch, zeros, pad, 0);
+        stage_data(batch, idx->pos->data.raw, pos_length, 0);
+        index->length = length + pad + pos_length;
+        index->checksum = checksum_extend(checksum(idx->data->data.raw, length),
+            zeros, pad);
+        index->checksum = checksum_extend(index->checksum, idx->pos->data.raw, pos_length);
+    }
+    else {
+        log_err("Unsupported index type for persistence.\n");
+        s.code = ERROR;
+        s.error_message = "Unsupported index type.";
+        return s;
+    }
 
-        // If we have an index, write it out!
-        if (tbl->col[i]->index) {
-            if (tbl->col[i]->index->type == B_PLUS_TREE) {
-                Node* idx = tbl->col[i]->index->index;
-                write_tree(data, idx);
+    add_stale(stale, col->name, index->epoch, epoch, "index");
+    index->epoch = epoch;
+    index->dirty = 0;
+    s.code = OK;
+    return s;
+}
 
-                free_btree(idx);
-            }
-            else if (tbl->col[i]->index->type == SORTED) {
-                // Write out the SortedIndex only if you're not clustered
-                SortedIndex* idx = tbl->col[i]->index->index;
-                if (idx->data != tbl->cluster_column) {
-
-                    if (tbl->col[i]->count != fwrite(idx->data, sizeof(Data), tbl->col[i]->count, data)) {
-                        s.code = ERROR;
-                        s.error_message = "Could not write data to file!";
-                        log_err("Could not write data to file!");
-                        fclose(data);
-                        return s;
-                    }
-
-                    if (tbl->col[i]->count != fwrite(idx->pos, sizeof(Data), tbl->col[i]->count, data)) {
-                        s.code = ERROR;
-                        s.error_message = "Could not write data to file!";
-                        log_err("Could not write data to file!");
-                        fclose(data);
-                        return s;
-                    }
-
-                    // Free the structure.
-                    free(idx->pos);
-                    free(idx->data);
-                }
+// Stages the dirty parts of a table as of epoch in batch, recording where
+// each column lives in entries (one per column, in table order). Clean
+// columns and indexes keep their existing files.
+status sync_table(table* tbl, catalog_column* entries, uint64_t epoch,
+    stale_files* stale, file_batch* batch) {
+    status s;
+    for (size_t i = 0; i < tbl->col_count; i++) {
+        column* col = tbl->col[i];
+        catalog_column* entry = &entries[i];
+        if (strlen(col->name) >= MAX_STRING_LENGTH) {
+            s.code = ERROR;
+            s.error_message = "Column name too long to persist.";
+            log_err("Column name %s is too long to persist.\n", col->name);
+            return s;
+        }
 
+        // A column we never loaded still lives where it did.
+        if (col->pending) {
+            *entry = col->pending->entry;
+            continue;
+        }
 
+        if (col->dirty) {
+            s = sync_column_data(col, epoch, stale, batch);
+            if (s.code != OK) {
+                return s;
             }
-            else {
-                log_err("Unsupported index type for permission");
+        }
+        if (col->index && col->index->dirty) {
+            s = sync_column_index(tbl, col, epoch, stale, batch);
+            if (s.code != OK) {
+                return s;
             }
-
-
-            free(tbl->col[i]->index);
         }
 
-        // Free the column.
-        free(tbl->col[i]->name);
-        free(tbl->col[i]->data);
-        free(tbl->col[i]);
-        fclose(data);
+        strcpy(entry->name, col->name);
+        entry->type = col->type;
+        entry->count = col->count;
+        entry->data_offset = 0;
+        entry->data_length = col->length;
+        entry->data_codec = col->codec;
+        entry->data_checksum = col->checksum;
+        entry->data_epoch = col->epoch;
+        entry->index = CATALOG_NO_INDEX;
+        entry->fanout = 0;
+        entry->index_offset = 0;
+        entry->index_length = 0;
+        entry->index_checksum = 0;
+        entry->index_epoch = 0;
+        if (col->index) {
+            entry->index = col->index->type;
+            entry->fanout = (col->index->type == B_PLUS_TREE) ? FANOUT : 0;
+            entry->index_length = col->index->length;
+            entry->index_checksum = col->index->checksum;
+            entry->index_epoch = col->index->epoch;
+        }
     }
 
     s.code = OK;
@@ -306,109 +824,146 @@ status sync_table(table* tbl){
 }
 
 status sync_db(db* db) {
-    // We need to create a metadata file with the information in the database
+    // We need to create a catalog with the information in the database
     char fname[DEFAULT_ARRAY_SIZE];
     status s;
-    sprintf(fname, "%s/%s.meta", DATA_FOLDER, db->name);
-    FILE* mfile = fopen(fname, "w");
-    if (!mfile) {
+    sprintf(fname, "%s/%s.catalog", DATA_FOLDER, db->name);
+
+    // Lay out one entry per table and one per column (contiguous per table).
+    size_t ncols = 0;
+    for (size_t i = 0; i < db->table_count; i++) {
+        ncols += db->tables[i]->col_count;
+    }
+    catalog_table* tables = calloc(db->table_count, sizeof(catalog_table));
+    catalog_column* columns = calloc(ncols, sizeof(catalog_column));
+
+    // Every column can replace at most its data, zones and index file.
+    stale_files stale;
+    stale.names = calloc(3 * ncols, sizeof(char*));
+    stale.count = 0;
+    file_batch batch;
+    memset(&batch, 0, sizeof(file_batch));
+    if ((db->table_count && !tables) || (ncols && (!columns || !stale.names))) {
         s.code = ERROR;
-        s.error_message = "Could not open file.\n";
-        log_err("Could not open file %s", fname);
+        s.error_message = "Low on memory.\n";
+        free(tables);
+        free(columns);
+        free(stale.names);
         return s;
     }
 
     // Iterate over the tables!
+    size_t first = 0;
+    s.code = OK;
     for (size_t i = 0; i < db->table_count; i++){
-        // Write out the table name and the column count
-        if (fprintf(mfile, "%s %zu ", db->tables[i]->name, db->tables[i]->col_count) < 0) {
-            log_err("Unable write to file %s\n", fname);
+        table* tbl = db->tables[i];
+        if (strlen(tbl->name) >= MAX_STRING_LENGTH) {
+            log_err("Table name %s is too long to persist.\n", tbl->name);
             s.code = ERROR;
-            s.error_message = "Unable to write to file";
-            fclose(mfile);
-            return s;
-        }
-        // Write out the name of the cluster column, if any
-        if (db->tables[i]->cluster_column) {
-            if (fprintf(mfile, "%s ", db->tables[i]->cluster_column->name) < 0) {
-                log_err("Unable write to file %s\n", fname);
-                s.code = ERROR;
-                s.error_message = "Unable to write to file";
-                fclose(mfile);
-                return s;
-            }
+            s.error_message = "Table name too long to persist.";
+            break;
         }
-        else {
-            if (fprintf(mfile, "%s ", "null") < 0) {
-                log_err("Unable write to file %s\n", fname);
-                s.code = ERROR;
-                s.error_message = "Unable to write to file";
-                fclose(mfile);
-                return s;
+        strcpy(tables[i].name, tbl->name);
+        tables[i].col_count = tbl->col_count;
+        tables[i].first_column = first;
+
+        // Record the offset of the cluster column, if any, and its delta
+        // (which goes out as it is).
+        tables[i].cluster_column = -1;
+        tables[i].delta = (tbl->cluster_column) ? tbl->cluster_column->delta : 0;
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            if (tbl->col[j] == tbl->cluster_column) {
+                tables[i].cluster_column = j;
             }
         }
 
-        // Write out the column names for the table
-        for(size_t j = 0; j < db->tables[i]->col_count - 1; j++) {
-            char* index;
-            if (!db->tables[i]->col[j]->index) {
-                index = "unsorted";
-            }
-            else {
-                if (db->tables[i]->col[j]->index->type == SORTED) {
-                    index = "sorted";
-                }
-                else if (db->tables[i]->col[j]->index->type == B_PLUS_TREE) {
-                    index = "btree";
-                }
-                else {
-                    log_err("Unsupported persistence type for index!.");
-                }
-            }
-            // Write out column_name size index
-            if (fprintf(mfile, "%s %zu %s ", db->tables[i]->col[j]->name,
-                db->tables[i]->col[j]->count, index) < 0) {
-                log_err("Unable to write to file %s\n", fname);
-                s.code = ERROR;
-                s.error_message = "Unable to write to file!\n";
-                fclose(mfile);
-                return s;
-            }
-        }
-        char* index = "";
-        if (!db->tables[i]->col[db->tables[i]->col_count - 1]->index) {
-            index = "unsorted";
+        // New files are named after the log position we sync up to.
+        s = sync_table(tbl, &columns[first], db->lsn, &stale, &batch);
+        if (s.code != OK) {
+            break;
         }
-        else {
-            if (db->tables[i]->col[db->tables[i]->col_count - 1]->index->type == SORTED) {
-                index = "sorted";
-            }
-            else if (db->tables[i]->col[db->tables[i]->col_count - 1]->index->type == B_PLUS_TREE) {
-                index = "btree";
-            }
-            else {
-                log_err("Unsupported persistence type for index!.");
-            }
+        first += tbl->col_count;
+    }
+
+    // Every column file goes out in one batch. The renames must be durable
+    // before the catalog can point at them, and the catalog goes out last,
+    // once every column file is in place.
+    if (s.code == OK) {
+        s = commit_files(&batch);
+    }
+    else {
+        abort_files(&batch);
+    }
+    if (s.code == OK) {
+        s = sync_dir(DATA_FOLDER);
+    }
+    if (s.code == OK) {
+        s = write_catalog(fname, db->lsn, NULL, 0, tables, db->table_count, columns, ncols);
+    }
+    if (s.code == OK) {
+        s = sync_dir(DATA_FOLDER);
+    }
+
+    // Nothing points at the replaced files anymore. (Columns still mapped
+    // from them keep their pages until they let go.)
+    for (size_t i = 0; i < stale.count; i++) {
+        if (s.code == OK) {
+            unlink(stale.names[i]);
         }
-        // Last one is written with a newline
-        if (fprintf(mfile, "%s %zu %s\n",
-            db->tables[i]->col[db->tables[i]->col_count - 1]->name,
-            db->tables[i]->col[db->tables[i]->col_count - 1]->count, index) < 0) {
-            log_err("Unable to write to file %s\n", fname);
-            s.error_message = "Unable to write to file";
-            s.code = ERROR;
-            fclose(mfile);
-            return s;
+        free(stale.names[i]);
+    }
+    free(stale.names);
+    free(tables);
+    free(columns);
+    return s;
+}
+
+// Frees an index along with whatever arrays it owns.
+void free_index(column* col) {
+    if (!col->index) {
+        return;
+    }
+    if (col->index->type == B_PLUS_TREE) {
+        free_btree(col->index->index);
+    }
+    else if (col->index->type == SORTED) {
+        SortedIndex* idx = col->index->index;
+        if (idx->pos) {
+            release_data(idx->pos);
+            release_data(idx->data);
+            free(idx->pos);
+            free(idx->data);
         }
-        s = sync_table(db->tables[i]);
+    }
+    if (col->index->map) {
+        release_mapping(col->index->map);
+    }
+    free(col->index->index);
+    free(col->index);
+    col->index = NULL;
+}
 
-        // Free what we can!
-        free(db->tables[i]->name);
-        free(db->tables[i]->col);
-        free(db->tables[i]);
+void free_db(db* db) {
+    for (size_t i = 0; i < db->table_count; i++) {
+        table* tbl = db->tables[i];
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            column* col = tbl->col[j];
+            detach_views(col);
+            free_packed(col->packed);
+            free_zones(col->zones);
+            free_index(col);
+            free(col->pending);
+            free(col->name);
+            release_data(col);
+            free(col);
+        }
+        free(tbl->name);
+        free(tbl->col);
+        free(tbl);
     }
-    fclose(mfile);
-    return s;
+    free(db->name);
+    free(db->tables);
+    free(db);
 }
 
 status create_table(db* db, const char* name, size_t num_columns, table** table)
@@ -542,9 +1097,15 @@ status create_column(table* table, const char* name, column** col)
     (*col)->type = INT;
 
     // TODO (data, index)
-    (*col)->data = NULL;
+    (*col)->data.raw = NULL;
     (*col)->index = NULL;
 
+    // There is no file for the column yet.
+    (*col)->dirty = 1;
+
+    // Inserts keep the zones up to date from here on.
+    create_zones(*col);
+
     s.code = OK;
     return s;
 }
@@ -565,9 +1126,12 @@ column* copycolumn(column* col) {
     column* res = calloc(1 ,sizeof(struct column));
     res->name = col->name;
     // Copy data (TODO- size or count)
-    res->data = calloc(col->count, sizeof(Data));
-    for (size_t i = 0; i < col->count; i++) {
-        res->data[i] = col->data[i];
+    res->data = alloc_values_uninit(col->type, col->count);
+    if (col->packed) {
+        unpack_values(col->packed, res->data);
+    }
+    else {
+        memcpy(res->data.raw, col->data.raw, col->count * type_width(col->type));
     }
     res->size = col->count;
     res->count = col->count;
@@ -587,19 +1151,28 @@ status recluster_col(column* col, IndexType newtype) {
             // Create the new SortedIndex
             SortedIndex* idx2 = calloc(1, sizeof(SortedIndex));
             idx2->data = calloc(1, sizeof(struct column));
-            idx2->data->data = calloc(col->count, sizeof(Data));
+            idx2->data->type = col->type;
+            idx2->data->count = idx2->data->size = col->count;
+            idx2->data->data = alloc_values_uninit(col->type, col->count);
             idx2->pos = calloc(1, sizeof(struct column));
-            idx2->pos->data = calloc(col->count, sizeof(Data));
+            idx2->pos->type = pos_type(col->count);
+            idx2->pos->count = idx2->pos->size = col->count;
+            idx2->pos->data = alloc_values_uninit(idx2->pos->type, col->count);
 
-            extract_data(idx, idx2->data->data, idx2->pos->data);
+            extract_data(idx, idx2->data->data.i, idx2->pos->data, idx2->pos->type);
 
             // Free the tree
             free_btree(idx);
             free(idx);
+            if (col->index->map) {
+                release_mapping(col->index->map);
+                col->index->map = NULL;
+            }
 
             // Set the new index
             col->index->index = idx2;
             col->index->type = SORTED;
+            col->index->dirty = 1;
 
             ret.code = OK;
             return ret;
@@ -609,17 +1182,23 @@ status recluster_col(column* col, IndexType newtype) {
 
             Node* root = calloc(1, sizeof(Node));
 
+            ret = unpack_column(idx->data);
+            if (ret.code != OK) {
+                return ret;
+            }
+
             // Especial case the cluster node. If pos is null, range it.
             if (!idx->pos) {
                 idx->pos = xrange(idx->data->count);
             }
-            bulk_load(idx->data->data, idx->pos->data, idx->data->count, root);
+            bulk_load(idx->data->data.i, idx->pos->data, idx->pos->type,
+                idx->data->count, root);
 
             // Free the results (don't free everything if we're a cluster!)
             if (idx->pos) {
-                free(idx->data->data);
+                release_data(idx->data);
                 // free(idx->data);
-                free(idx->pos->data);
+                release_data(idx->pos);
                 free(idx->pos);
             }
             free(idx);
@@ -627,6 +1206,7 @@ status recluster_col(column* col, IndexType newtype) {
             // Reset the parameters.
             col->index->index = root;
             col->index->type = B_PLUS_TREE;
+            col->index->dirty = 1;
             ret.code = OK;
             return ret;
         }
@@ -645,8 +1225,11 @@ status recluster_col(column* col, IndexType newtype) {
 // types.
 status recluster(table* tbl, IndexType newtype) {
     // Let's recluster only if the current type does not match the new type.
+    // The new index is built from the cluster column, so it must all be in
+    // order first.
     if (tbl->cluster_column->index->type != newtype) {
-        return recluster_col(tbl->cluster_column, newtype);
+        status s = merge_delta(tbl);
+        return (s.code == OK) ? recluster_col(tbl->cluster_column, newtype) : s;
     }
     status s;
     s.code = OK;
@@ -662,17 +1245,26 @@ status create_secondary_index(column* col, IndexType type) {
         return recluster_col(col, type);
     }
 
+    // Indexes are kept over the values of INT columns.
+    if (col->type != INT) {
+        log_err("Cannot index column %s, which is not of type INT.\n", col->name);
+        ret.code = ERROR;
+        ret.error_message = "Unsupported column type for index.";
+        return ret;
+    }
+
     // Allocate space for the index if non-existent
     if (!col->index) {
         col->index = calloc(1, sizeof(struct column_index));
     }
+    col->index->dirty = 1;
 
     // We create copies of the data
     column* pos = xrange(col->count);
     column* data = copycolumn(col);
 
     // Then we sort them!
-    mergesort(data->data, pos->data, 0, col->count - 1);
+    mergesort(data->data.i, pos->data.raw, type_width(pos->type), 0, col->count - 1);
 
     if (type == SORTED) {
         // An now we have an index!
@@ -689,13 +1281,13 @@ status create_secondary_index(column* col, IndexType type) {
         // And now we bulk load into a B_Tree!
         col->index->type = B_PLUS_TREE;
         Node* root = calloc(1, sizeof(Node));
-        bulk_load(data->data, pos->data, data->count, root);
+        bulk_load(data->data.i, pos->data, pos->type, data->count, root);
         col->index->index = root;
 
         // We can free because the data was copied into the btree
-        free(pos->data);
+        free(pos->data.raw);
         free(pos);
-        free(data->data);
+        free(data->data.raw);
         free(data);
 
         ret.code = OK;
@@ -709,26 +1301,26 @@ status create_secondary_index(column* col, IndexType type) {
     }
 }
 
-status cluster_table(table* tbl) {
+// Every column of tbl is about to be rewritten in place, so views of them
+// get their own copy and packed ones are unpacked.
+static status prepare_reorder(table* tbl) {
     status s;
-    if (!tbl) {
-        s.code = ERROR;
-        s.error_message = "Invalid table pointer!";
-        return s;
-    }
-
-    // A table with no clusters is already clustered
-    if (!tbl->cluster_column) {
-        s.code = OK;
-        return s;
+    s.code = OK;
+    for (size_t col = 0; col < tbl->col_count && s.code == OK; col++) {
+        s = detach_views(tbl->col[col]);
+        if (s.code == OK) {
+            s = unpack_column(tbl->col[col]);
+        }
     }
+    return s;
+}
 
-    // Now we need to cluster, so we first sort the cluster_column
+// Rewrites every column of tbl but the cluster column (which the caller has
+// already put in order) so that row i holds what row pos[i] did, and rebuilds
+// their indexes and zones. Frees pos.
+static status reorder_table(table* tbl, column* pos) {
+    status s;
     column* pcol = tbl->cluster_column;
-    column* pos = xrange(pcol->count);
-
-    // After this call, pos is sorted in the order specified by pcol.
-    mergesort(pcol->data, pos->data, 0, pcol->count - 1);
 
     // Now, for each column, we fetch based on positions.
     column* column;
@@ -736,14 +1328,16 @@ status cluster_table(table* tbl) {
     for (size_t col = 0; col < tbl->col_count; col++) {
         // Only the non-leading columns
         column = tbl->col[col];
+        column->dirty = 1;
         if (column != pcol) {
             if (fetch(column, pos, &r).code != OK) {
                 log_err("Failed to sort column %s\n", column->name);
             }
 
             // The results are stored in r.
-            free(column->data);
+            release_data(column);
             column->data = r->payload;
+            column->size = r->num_tuples;
             free(r);
             r = NULL;
         }
@@ -755,38 +1349,130 @@ status cluster_table(table* tbl) {
             if (column->index->type == SORTED) {
                 SortedIndex* idx = column->index->index;
                 if (idx->pos) {
-                    free(idx->data->data);
+                    release_data(idx->data);
                     free(idx->data);
-                    free(idx->pos->data);
+                    release_data(idx->pos);
                     free(idx->pos);
                 }
+
+                // Once in order, the cluster column is its own index.
+                if (column == pcol) {
+                    idx->data = pcol;
+                    idx->pos = NULL;
+                    column->index->dirty = 1;
+                    continue;
+                }
             }
             else if (column->index->type == B_PLUS_TREE) {
                 Node* idx = column->index->index;
                 free_btree(idx);
+                if (column->index->map) {
+                    release_mapping(column->index->map);
+                    column->index->map = NULL;
+                }
             }
             else {
                 log_err("Unsupported index type");
+                free(pos->data.raw);
                 free(pos);
                 s.code = ERROR;
                 return s;
             }
+            // The rebuilt index replaces the same file on the next sync.
+            column_index persisted = *column->index;
             free(column->index);
             column->index = NULL;
             s = create_secondary_index(column, type);
             if (s.code != OK) {
                 log_err("Could not create secondary index!");
+                free(pos->data.raw);
                 free(pos);
                 return s;
             }
+            column->index->length = persisted.length;
+            column->index->checksum = persisted.checksum;
+            column->index->epoch = persisted.epoch;
         }
     }
 
+    free(pos->data.raw);
     free(pos);
+
+    // Every block holds other rows now.
+    for (size_t col = 0; col < tbl->col_count; col++) {
+        if (tbl->col[col]->zones) {
+            build_zones(tbl->col[col]);
+        }
+    }
     s.code = OK;
     return s;
 }
 
+status cluster_table(table* tbl) {
+    status s;
+    if (!tbl) {
+        s.code = ERROR;
+        s.error_message = "Invalid table pointer!";
+        return s;
+    }
+
+    // A table with no clusters is already clustered
+    if (!tbl->cluster_column) {
+        s.code = OK;
+        return s;
+    }
+    s = prepare_reorder(tbl);
+    if (s.code != OK) {
+        return s;
+    }
+
+    // Now we need to cluster, so we first sort the cluster_column
+    column* pcol = tbl->cluster_column;
+    column* pos = xrange(pcol->count);
+
+    // After this call, pos is sorted in the order specified by pcol.
+    mergesort(pcol->data.i, pos->data.raw, type_width(pos->type), 0, pcol->count - 1);
+    pcol->delta = 0;
+    return reorder_table(tbl, pos);
+}
+
+status merge_delta(table* tbl) {
+    status s;
+    column* pcol = tbl->cluster_column;
+    if (!pcol || !pcol->delta) {
+        s.code = OK;
+        return s;
+    }
+    s = prepare_reorder(tbl);
+    if (s.code != OK) {
+        return s;
+    }
+
+    // Only the delta needs sorting. It is then merged with the rows before
+    // it, which are in order already.
+    size_t sorted = pcol->count - pcol->delta;
+    column* pos = xrange(pcol->count);
+    size_t width = type_width(pos->type);
+    mergesort(pcol->data.i, pos->data.raw, width, sorted, pcol->count - 1);
+    if (sorted > 0) {
+        merge(pcol->data.i, pos->data.raw, width, 0, sorted - 1, pcol->count - 1);
+    }
+    log_info("Merged %zu rows into table %s.\n", pcol->delta, tbl->name);
+    pcol->delta = 0;
+    return reorder_table(tbl, pos);
+}
+
+status add_to_delta(table* tbl) {
+    status s;
+    s.code = OK;
+    column* pcol = tbl->cluster_column;
+    pcol->delta++;
+    if (pcol->delta >= DELTA_MIN_ROWS && pcol->delta * DELTA_RATIO >= pcol->count) {
+        s = merge_delta(tbl);
+    }
+    return s;
+}
+
 // Find the position on which we insert the value. Column must be indexed.
 // Column is also expected to be the clustered index, so we return the
 // index for the clustered table!
@@ -797,13 +1483,17 @@ size_t find_pos(column* col, Data data) {
         return -1;
     }
     if (col->index->type == SORTED) {
+        // We are about to insert, which unpacks the column anyway.
         SortedIndex* idx = col->index->index;
-        return find_index(idx->data->data, 0, (col->count == 0) ? 0 : col->count - 1,
-            data, col->count - 1);
+        if (unpack_column(idx->data).code != OK) {
+            return -1;
+        }
+        return find_index(idx->data->data.i, 0, (col->count == 0) ? 0 : col->count - 1,
+            data.i, col->count - 1);
     }
     else if (col->index->type == B_PLUS_TREE) {
         Node* tmp;
-        return find_element_tree(data, col->index->index, &tmp);
+        return find_element_tree(data.i, col->index->index, &tmp);
     }
     else {
         log_err("Unsupported index type on cluster column.");
@@ -813,14 +1503,23 @@ size_t find_pos(column* col, Data data) {
 
 // Inserts datum into arr at the specified location. Returns size array.
 status insert_into_column(column* col, Data datum, size_t pos) {
-    status ret;
+    // Views of col must keep the values they were fetched with, and a
+    // packed column is changed as a plain array.
+    status ret = detach_views(col);
+    if (ret.code == OK) {
+        ret = unpack_column(col);
+    }
+    if (ret.code != OK) {
+        return ret;
+    }
+    size_t width = type_width(col->type);
     if (col->count >= col->size) {
         log_info("No space for data in column. Creating more space.\n", col->name);
         size_t newcount = 2 * col->count + 1;
         if (newcount == 1) {
             newcount = DEFAULT_ARRAY_SIZE;
-            col->data = calloc(sizeof(Data), newcount);
-            if (!col->data) {
+            col->data = alloc_values(col->type, newcount);
+            if (!col->data.raw) {
                 ret.code = ERROR;
                 ret.error_message = "Failed allocating space for data";
                 log_err(ret.error_message);
@@ -828,26 +1527,67 @@ status insert_into_column(column* col, Data datum, size_t pos) {
             }
         }
         else {
-            size_t newsize = newcount * sizeof(Data);
-            size_t oldsize = col->count * sizeof(Data);
-            void* tmp = resize(col->data, oldsize, newsize);
-            free(col->data);
-            col->data = tmp;
+            // A column of our own grows where it is (see column_grow). One
+            // still backed by its file is copied out of it.
+            size_t newsize = newcount * width;
+            size_t oldsize = col->count * width;
+            void* tmp = (col->map) ? column_resize(col->data.raw, oldsize, newsize) :
+                column_grow(col->data.raw, oldsize, newsize);
+            if (!tmp) {
+                ret.code = ERROR;
+                ret.error_message = "Failed allocating space for data";
+                log_err(ret.error_message);
+                return ret;
+            }
+            if (col->map) {
+                release_data(col);
+            }
+            col->data.raw = tmp;
         }
 
         // Update tables
         col->size = newcount;
     }
 
-    Data tmp;
-    while (pos < col->count) {
-        tmp = col->data[pos];
-        col->data[pos++] = datum;
-        datum = tmp;
+    // Shift everything from pos on up by one.
+    col->dirty = 1;
+    if (pos < col->count) {
+        char* at = (char*) col->data.raw + pos * width;
+        memmove(at + width, at, (col->count - pos) * width);
+    }
+    else {
+        pos = col->count;
     }
-    col->data[col->count++] = datum;
+    set_value(col->data, col->type, pos, datum);
+    col->count++;
+    update_zones(col, pos);
+
+    ret.code = OK;
+    return ret;
+}
 
+// Rewrites the positions in pos as POS64 once they no longer fit in POS32,
+// which is when pos is about to grow past pos_type's limit.
+static status widen_positions(column* pos) {
+    status ret;
     ret.code = OK;
+    if (pos->type == POS64 || pos_type(pos->count + 1) == POS32) {
+        return ret;
+    }
+    Values wide = alloc_values(POS64, pos->size);
+    if (!wide.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
+    }
+    for (size_t i = 0; i < pos->count; i++) {
+        wide.p64[i] = pos->data.p32[i];
+    }
+    release_data(pos);
+    pos->data = wide;
+    pos->type = POS64;
+    pos->dirty = 1;
     return ret;
 }
 
@@ -863,6 +1603,7 @@ status insert_pos(column *col, size_t pos, Data data) {
     // We've added a new element, now update the index if necessary
     // We have an index with allocated index space and we are not a cluster column.
     if (col->index && col->index->index) {
+        col->index->dirty = 1;
         if (col->index->type == SORTED) {
             SortedIndex* idx = (SortedIndex*) col->index->index;
             // If the index data is null and pos in null, we have a clustered column
@@ -876,9 +1617,9 @@ status insert_pos(column *col, size_t pos, Data data) {
             if (idx->data != col &&
                 idx->pos != NULL) {
                 // The first step is inserting the value into the sorted array.
-                size_t sorted_pos = find_index(idx->data->data, 0,
+                size_t sorted_pos = find_index(idx->data->data.i, 0,
                     (idx->data->count == 0) ? 0 : idx->data->count - 1,
-                    data, idx->data->count);
+                    data.i, idx->data->count);
                 ret = insert_into_column(idx->data, data, sorted_pos);
                 if (ret.code != OK) {
                     ret.error_message = "Failed to insert into sorted column index.";
@@ -887,8 +1628,11 @@ status insert_pos(column *col, size_t pos, Data data) {
                 }
                 // Insert the position into the pos array.
                 Data d;
-                d.i = pos;
-                ret = insert_into_column(idx->pos, d, sorted_pos);
+                d.li = pos;
+                ret = widen_positions(idx->pos);
+                if (ret.code == OK) {
+                    ret = insert_into_column(idx->pos, d, sorted_pos);
+                }
             }
         }
         else if (col->index->type == B_PLUS_TREE) {
@@ -896,9 +1640,10 @@ status insert_pos(column *col, size_t pos, Data data) {
             // TODO(luisperez): Be efficient and only keep one copy of the
             // data in the btree for the cluster column on the table.
             // However, we currently do not do this!
-            Data d;
-            d.i = pos;
-            insert_tree(idx, data, d);
+            if (pos_type(col->count) != tree_pos_type(idx)) {
+                widen_tree(idx);
+            }
+            insert_tree(idx, data.i, pos);
         }
         else {
             log_err("Index type is not supported! %s: line %d.\n",
@@ -932,62 +1677,9 @@ status update(column* col, int* pos, int new_val)
 }
 
 
-int check(comparator* f, int value){
-    comparator* cur = f;
-    int success = 1; // 1 is True
-    Junction mode = AND; // Start with True && ...
-    while (cur) {
-        if (mode == AND) {
-            if (cur->type == LESS_THAN) {
-                success = success && (value < cur->p_val);
-            }
-            else if (cur->type == GREATER_THAN) {
-                success = success && (value > cur->p_val);
-            }
-            else if (cur->type == EQUAL) {
-                success = success && (value == cur->p_val);
-            }
-            else if (cur->type == (EQUAL | LESS_THAN)) {
-                success = success && (value <= cur->p_val);
-            }
-            else if (cur->type == (EQUAL | GREATER_THAN)) {
-                success = success && (value >= cur->p_val);
-            }
-            else {
-                log_err("Unsupported comparator type!");
-                return 0;
-            }
-        }
-        else if (mode == OR) {
-            if (cur->type == LESS_THAN) {
-                success = success || (value < cur->p_val);
-            }
-            else if (cur->type == GREATER_THAN) {
-                success = success || (value > cur->p_val);
-            }
-            else if (cur->type == EQUAL) {
-                success = success || (value == cur->p_val);
-            }
-            else if (cur->type == (EQUAL | LESS_THAN)) {
-                success = success || (value <= cur->p_val);
-            }
-            else if (cur->type == (EQUAL | GREATER_THAN)) {
-                success = success || (value >= cur->p_val);
-            }
-            else {
-                log_err("Unsupported comparator type!");
-                return 0;
-            }
-        }
-        // We don't use j == NONE because we assume next_compartor is NULL.
-        mode = cur->mode;
-        cur = cur->next_comparator;
-    }
-    return success;
-}
-
 // Fetches the values specified by pos from col and stores in r. Allocates
-// space for r if not already existent.
+// space for r if not already existent. When pos is a range, r is a view of
+// col (see result).
 status fetch(column* col, column* pos,  result** r){
     status ret;
     if (!(*r)){
@@ -1000,13 +1692,34 @@ status fetch(column* col, column* pos,  result** r){
         }
     }
 
+    // A contiguous range of a column is already laid out as the result, so
+    // we hand back a view into the column instead of copying it.
+    (*r)->num_tuples = pos->count;
+    (*r)->type = col->type;
+    if (pos->type == POSRANGE && !col->base && !col->packed) {
+        (*r)->payload = values_at(col->data, col->type, pos->data.p64[0]);
+        (*r)->base = col;
+        col->views++;
+        ret.code = OK;
+        return ret;
+    }
+
     // Allocate space for result
-    (*r)->payload = calloc(pos->size, sizeof(Data));
-    (*r)->num_tuples = pos->size;
+    (*r)->base = NULL;
+    (*r)->payload = alloc_values_uninit(col->type, pos->count);
+    if (pos->count && !(*r)->payload.raw) {
+        log_err("Low on memory! Could not allocate more space.");
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        return ret;
+    }
 
     // Copy out to the results
-    for (size_t i = 0; i < pos->size; i++) {
-        (*r)->payload[i] = col->data[pos->data[i].i];
+    if (col->packed) {
+        gather_packed(col->packed, pos->data, pos->type, pos->count, (*r)->payload);
+    }
+    else {
+        gather_values(col->data, col->type, pos->data, pos->type, pos->count, (*r)->payload);
     }
 
     ret.code = OK;
@@ -1014,145 +1727,232 @@ status fetch(column* col, column* pos,  result** r){
 }
 
 // These functions are not exposed as they assume work from col_scan
-status index_scan(comparator* f, column* col, result** r, Data* pos)
+// pos (npos positions of type ptype) holds the positions to intersect with,
+// if any.
+status index_scan(comparator* f, const predicate* pred, column* col, result** r,
+    Values pos, DataType ptype, size_t npos)
 {
     // This function IS ONLY called from col_scan. Assume input parameters.
     status ret;
-    // size_t size = (*r)->num_tuples;
-    size_t res_pos = 0;
-    Data* new_pos = calloc(col->count, sizeof(Data));
+    // A clustered sorted column gives a range, other indexes an array.
+    DataType type = pos_type(col->count);
+    Values new_pos;
+    new_pos.raw = NULL;
     size_t new_pos_count = 0;
 
     // Sorted column so extract new_pos
     if (col->index->type == SORTED) {
-        // Extract the min/max from the operator, if possible, so we can find their indexes
-        size_t min_index = 0;
-        size_t max_index = col->count - 1;
+        // Extract the min/max from the operator, if possible, so we can find
+        // their indexes. Only the rows before the delta store (see
+        // merge_delta) are in order.
         SortedIndex* sorted = (SortedIndex*) col->index->index;
-
-        // We assume only the first two relevant matter.
-        while (f) {
-            if (f->type == LESS_THAN && max_index == col->count - 1) {
-                Data max;
-                max.i = f->p_val;
-                max_index = find_index(sorted->data->data, 0,
-                    (sorted->data->count == 0) ? 0 : sorted->data->count - 1,
-                    max, sorted->data->count);
-
-                // This is the index for the sorted data!
+        size_t rows = sorted->data->count - sorted->data->delta;
+        size_t min_index = 0;
+        size_t max_index = rows;
+        int has_min = 0;
+        int has_max = 0;
+
+        // We assume only the first two relevant matter. A packed cluster
+        // column is searched in place.
+        packed_column* packed = sorted->data->packed;
+        for (comparator* c = f; c && rows; c = c->next_comparator) {
+            if (c->type == LESS_THAN && !has_max) {
+                max_index = (packed) ? packed_lower_bound(packed, rows, c->p_val) :
+                    find_index(sorted->data->data.i, 0, rows - 1, c->p_val, rows);
+                has_max = 1;
             }
-            else if (f->type == (GREATER_THAN | EQUAL) && min_index == 0) {
-                Data min;
-                min.i = f->p_val;
-                min_index = find_index(sorted->data->data, 0,
-                    (sorted->data->count == 0) ? 0 : sorted->data->count - 1,
-                    min, sorted->data->count);
+            else if (c->type == (GREATER_THAN | EQUAL) && !has_min) {
+                min_index = (packed) ? packed_lower_bound(packed, rows, c->p_val) :
+                    find_index(sorted->data->data.i, 0, rows - 1, c->p_val, rows);
+                has_min = 1;
             }
-            f = f->next_comparator;
         }
+        size_t range = (max_index > min_index) ? max_index - min_index : 0;
 
         // Clustered.
-        if (!sorted->pos && sorted->data == col) {
-            // Special case when we are running a scan over the clustered column.
-            for(size_t i = min_index; i < max_index; i++) {
-                // Return the clustered position index.
-                new_pos[new_pos_count++].i = i;
+        if (!sorted->pos && sorted->data == col && !col->delta) {
+            // Special case when we are running a scan over the clustered
+            // column: the clustered positions are just the range.
+            type = POSRANGE;
+            new_pos = alloc_range(min_index);
+            new_pos_count = range;
+        }
+        else if (!sorted->pos && sorted->data == col) {
+            // The range, followed by whatever qualifies in the delta.
+            Values delta = alloc_range(rows);
+            new_pos = alloc_values(type, range + col->delta);
+            for (size_t i = 0; new_pos.raw && i < range; i++) {
+                set_pos(new_pos, type, new_pos_count++, min_index + i);
+            }
+            if (new_pos.raw && delta.raw && packed) {
+                new_pos_count += select_packed(pred, packed, delta, POSRANGE, col->delta,
+                    values_at(new_pos, type, range), type);
+            }
+            else if (new_pos.raw && delta.raw) {
+                Values none;
+                none.raw = NULL;
+                new_pos_count += select_values(pred, values_at(col->data, col->type, rows),
+                    none, type, rows, col->delta, 0, values_at(new_pos, type, range));
+            }
+            if (!delta.raw) {
+                free(new_pos.raw);
+                new_pos.raw = NULL;
             }
+            free(delta.raw);
         }
         // Secondary index!
         else {
-            for(size_t i = min_index; i < max_index; i++) {
+            new_pos = alloc_values(type, (max_index > min_index) ? max_index - min_index : 1);
+            for(size_t i = min_index; new_pos.raw && i < max_index; i++) {
                 // Return the clustered position index.
-                new_pos[new_pos_count++] = sorted->pos->data[i];
+                set_pos(new_pos, type, new_pos_count++,
+                    get_pos(sorted->pos->data, sorted->pos->type, i));
             }
         }
     }
     // TOOD(luisperez): Deal with btree scan to extract new_pos
     else if (col->index->type == B_PLUS_TREE) {
-
-        size_t min_index = 0;
-        size_t max_index = col->count - 1;
         Node* root = (Node*) col->index->index;
         Node* min_leaf = NULL;
         Node* max_leaf = NULL;
-
-        // We assume only the first two relevant matter.
+        size_t min_index = tree_begin(root, &min_leaf);
+        size_t max_index = tree_end(root, &max_leaf);
+
+        // We assume only the first two relevant matter. A missing bound, or
+        // one past every key, leaves the walk at that end of the tree.
+        int has_min = 0;
+        int has_max = 0;
+        Key min_key = 0;
+        Key max_key = 0;
         while (f) {
-            if (f->type == LESS_THAN && max_index == col->count - 1) {
-                Data max;
-                max.i = f->p_val;
-                max_index = find_element_tree(max, root, &max_leaf);
-
-                // This is the index for the sorted data!
+            if (f->type == LESS_THAN && !has_max) {
+                max_key = f->p_val;
+                max_index = lower_bound_tree(max_key, root, &max_leaf);
+                has_max = 1;
             }
-            else if (f->type == (GREATER_THAN | EQUAL) && min_index == 0) {
-                Data min;
-                min.i = f->p_val;
-                min_index = find_element_tree(min, root, &min_leaf);
+            else if (f->type == (GREATER_THAN | EQUAL) && !has_min) {
+                min_key = f->p_val;
+                min_index = lower_bound_tree(min_key, root, &min_leaf);
+                has_min = 1;
             }
             f = f->next_comparator;
         }
 
         // We don't differentiate between clustered and unclustered indexes?
-        while (min_leaf != max_leaf) {
-            while (min_index < min_leaf->count) {
-                new_pos[new_pos_count++] = min_leaf->children->keys[min_index++];
+        new_pos = alloc_values(type, (col->count) ? col->count : 1);
+
+        // Walk the leaves from the lower bound up to the upper one. An empty
+        // range would have the lower bound past the upper one.
+        if (has_min && has_max && min_key >= max_key) {
+            min_leaf = NULL;
+        }
+        while (new_pos.raw && min_leaf) {
+            Node* positions = min_leaf->children;
+            size_t end = (min_leaf == max_leaf) ? max_index : min_leaf->count;
+            while (min_index < end) {
+                set_pos(new_pos, type, new_pos_count++,
+                    get_pos(positions->values, positions->pos_type, min_index++));
+            }
+            if (min_leaf == max_leaf) {
+                break;
             }
             min_leaf = min_leaf->next_link;
             min_index = 0;
         }
-
-        // We reached the final node!
-        while (min_index < max_index) {
-            new_pos[new_pos_count++] = min_leaf->children->keys[min_index++];
-        }
-
     }
     else {
         log_err("Index type not supported.");
+        free(new_pos.raw);
         ret.code = ERROR;
         ret.error_message = "Do not support requested index.";
         return ret;
     }
 
-    // We need to intersect the results because we've achieved good results.
-    if (pos) {
-        // Mergesort with respect to the other
-        mergesort(pos, NULL, 0, (*r)->num_tuples - 1);
-        mergesort(new_pos, NULL, 0, new_pos_count - 1);
-
-        // Now we can run a modified version of merge!
-        size_t i = 0;
-        size_t j = 0;
-        while (i < (*r)->num_tuples && j < new_pos_count) {
-            if (pos[i].i > new_pos[j].i) {
-                j++;
-            }
-            else if (pos[i].i < new_pos[j].i) {
-                i++;
-            }
-            else {
-                (*r)->payload[res_pos++] = pos[i];
-                i++;
-                j++;
-            }
-        }
-        // We ran out of one so we're out!
-    }
-    // We just copy newpos over the payload!
-    else {
-        for(size_t i = 0; i < new_pos_count; i++) {
-            (*r)->payload[res_pos++] = new_pos[i];
-        }
+    if (!new_pos.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
     }
 
+    // We need to intersect the results because we've achieved good results.
+    if (pos.raw) {
+        ret = intersect_positions(pos, ptype, npos, new_pos, type, new_pos_count,
+            col->count, *r);
+        free(new_pos.raw);
+        return ret;
+    }
 
-    (*r)->num_tuples = res_pos;
+    // We just hand over new_pos!
+    (*r)->payload = new_pos;
+    (*r)->type = type;
+    (*r)->num_tuples = new_pos_count;
     ret.code = OK;
     return ret;
 
 }
 
+#if MORSEL_ROWS % ZONE_ROWS
+#error "MORSEL_ROWS must be a multiple of ZONE_ROWS"
+#endif
+
+// A full scan of a column (or a refinement of a bitmap over a packed one),
+// spread over morsels. Morsel m leaves how many of its rows qualified in
+// counts[m].
+typedef struct scan_job {
+    const predicate* pred;
+    column* col;
+    uint64_t* bits;
+    int refine;
+    size_t* counts;
+} scan_job;
+
+// Sets the bits of the n rows of col from start on that satisfy pred, bit i
+// of words standing for row start + i. Returns how many did.
+static size_t scan_column_rows(const predicate* pred, column* col, size_t start, size_t n,
+    uint64_t* words) {
+    size_t count;
+    if (zone_scan(pred, col, start, n, words, &count)) {
+        return count;
+    }
+    return (col->packed) ? scan_packed(pred, col->packed, start, n, words) :
+        scan_bitmap(pred, values_at(col->data, col->type, start), n, words);
+}
+
+static void scan_morsel(void* arg, size_t m, size_t start, size_t end) {
+    scan_job* job = arg;
+    column* col = job->col;
+    uint64_t* words = job->bits + start / 64;
+    size_t n = end - start;
+    job->counts[m] = (job->refine) ? refine_packed(job->pred, col->packed, start, n, words) :
+        scan_column_rows(job->pred, col, start, n, words);
+}
+
+// Sets the bits of the rows rows of col that satisfy pred or, with refine
+// set, clears those of the rows set in bits that do not (col must then be
+// packed). Returns how many are left.
+static size_t scan_morsels(const predicate* pred, column* col, uint64_t* bits,
+    size_t rows, int refine) {
+    scan_job job;
+    size_t count = 0;
+    job.pred = pred;
+    job.col = col;
+    job.bits = bits;
+    job.refine = refine;
+    job.counts = (parallel_rows(rows)) ? malloc(MORSELS(rows) * sizeof(size_t)) : NULL;
+    if (!job.counts) {
+        job.counts = &count;
+        scan_morsel(&job, 0, 0, rows);
+        return count;
+    }
+    run_morsels(scan_morsel, &job, rows);
+    for (size_t m = 0; m < MORSELS(rows); m++) {
+        count += job.counts[m];
+    }
+    free(job.counts);
+    return count;
+}
+
 status col_scan(comparator* f, column* col, result** r)
 {
     // The positions we need to scan are stored in *r->payload.
@@ -1164,52 +1964,174 @@ status col_scan(comparator* f, column* col, result** r)
         return ret;
     }
 
-    Data* pos = (*r)->payload;
-    size_t size = (*r)->num_tuples;
-    size_t res_pos = 0;
-
-    // We override with a new array because this data will be saved too!
-    (*r)->payload = calloc(size, sizeof(Data));
+    // The positions (if any) belong to a variable, so we leave them be and
+    // produce new ones.
+    Values pos = (*r)->payload;
+    DataType ptype = (*r)->type;
+    size_t npos = (*r)->num_tuples;
+    int gather = col->name != NULL;
 
+    // The comparators are compiled once, not walked for every value.
+    predicate pred;
+    compile_predicate(f, col->type, &pred);
 
     // Check if we have an index on this column.
     // TODO(we are only dealing with full column scans!)
     if (col->index && col->index->index) {
-        return index_scan(f, col, r, pos);
+        return index_scan(f, &pred, col, r, pos, ptype, npos);
     }
 
-    // Otherwise do a dumb scan on the data.
-    // This is a full column scan.
-    if (!pos){
-        for(size_t i = 0; i < col->count; i++) {
-            if (check(f, col->data[i].i)) {
-                (*r)->payload[res_pos++].i = i;
+    // Otherwise do a dumb scan on the data. A variable (no name) holds the
+    // values of the positions, otherwise we use the positions to access the
+    // column.
+    if (!pos.raw || ptype == POSBITMAP) {
+        // Full scans (and refining a bitmap) go through a bitmap, which we
+        // then compact into whichever form suits what qualified.
+        size_t rows = (pos.raw) ? bitmap_rows(pos) : col->count;
+        (*r)->payload = alloc_bitmap(rows);
+        (*r)->type = POSBITMAP;
+        if ((*r)->payload.raw) {
+            uint64_t* bits = bitmap_words((*r)->payload);
+            if (pos.raw) {
+                memcpy(bits, bitmap_words(pos), BITMAP_WORDS(rows) * sizeof(uint64_t));
             }
+            (*r)->num_tuples = (pos.raw && !col->packed) ?
+                refine_bitmap(&pred, col->data, bits, rows, gather) :
+                scan_morsels(&pred, col, bits, rows, pos.raw != NULL);
+            compact_bitmap(&(*r)->payload, &(*r)->type, (*r)->num_tuples);
         }
     }
-    // We're note accessing a column directly!
-    else if (!col->name) {
-        for(size_t ii = 0; ii < (*r)->num_tuples; ii++) {
-            if (check(f, col->data[ii].i)) {
-                (*r)->payload[res_pos++] = pos[ii];
-            }
+    else if (ptype == POSRANGE) {
+        // Value k is at position start + k.
+        size_t start = pos.p64[0];
+        Values v = (gather) ? values_at(col->data, col->type, start) : col->data;
+        Values none;
+        none.raw = NULL;
+        (*r)->type = pos_type(start + npos);
+        (*r)->payload = alloc_values_uninit((*r)->type, (npos) ? npos : 1);
+        if ((*r)->payload.raw && col->packed) {
+            (*r)->num_tuples = select_packed(&pred, col->packed, pos, ptype, npos,
+                (*r)->payload, (*r)->type);
+        }
+        else if ((*r)->payload.raw) {
+            (*r)->num_tuples = select_values(&pred, v, none, (*r)->type, start, npos, 0,
+                (*r)->payload);
         }
     }
-
-    // We use the pos indicated in the res to access the column.
     else {
-        for(size_t ii = 0; ii < (*r)->num_tuples; ii++) {
-            if (check(f, col->data[pos[ii].i].i)) {
-                (*r)->payload[res_pos++] = pos[ii];
-            }
+        (*r)->payload = alloc_values_uninit(ptype, (npos) ? npos : 1);
+        if ((*r)->payload.raw && col->packed) {
+            (*r)->num_tuples = select_packed(&pred, col->packed, pos, ptype, npos,
+                (*r)->payload, ptype);
         }
+        else if ((*r)->payload.raw) {
+            (*r)->num_tuples = select_values(&pred, col->data, pos, ptype, 0, npos,
+                gather, (*r)->payload);
+        }
+    }
+
+    if (!(*r)->payload.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
     }
-    (*r)->num_tuples = res_pos;
     ret.code = OK;
     return ret;
 }
 
 
+// A shared scan of a column for many predicates. Each morsel goes over its
+// rows a block of ZONE_ROWS at a time, and every predicate is run on a block
+// while it is still in cache, so the column is read from memory only once.
+// Morsel m leaves how many of its rows satisfied predicate q in
+// counts[m * n + q].
+typedef struct batch_job {
+    const predicate* preds;
+    size_t n;
+    column* col;
+    uint64_t** bits;
+    size_t* counts;
+} batch_job;
+
+static void batch_morsel(void* arg, size_t m, size_t start, size_t end) {
+    batch_job* job = arg;
+    size_t* counts = job->counts + m * job->n;
+    memset(counts, 0, job->n * sizeof(size_t));
+    for (size_t first = start; first < end; first += ZONE_ROWS) {
+        size_t rows = (end - first < ZONE_ROWS) ? end - first : ZONE_ROWS;
+        for (size_t q = 0; q < job->n; q++) {
+            counts[q] += scan_column_rows(&job->preds[q], job->col, first, rows,
+                job->bits[q] + first / 64);
+        }
+    }
+}
+
+status batch_scan(comparator** f, size_t n, column* col, result** r)
+{
+    status ret;
+    ret.code = OK;
+
+    // An index answers each select without reading the column at all.
+    if (col->index && col->index->index) {
+        for (size_t q = 0; q < n && ret.code == OK; q++) {
+            ret = col_scan(f[q], col, &r[q]);
+        }
+        return ret;
+    }
+
+    size_t rows = col->count;
+    size_t morsels = (MORSELS(rows)) ? MORSELS(rows) : 1;
+    batch_job job;
+    predicate* preds = malloc(n * sizeof(predicate));
+    uint64_t** bits = calloc(n, sizeof(uint64_t*));
+    size_t* counts = malloc(morsels * n * sizeof(size_t));
+    for (size_t q = 0; q < n; q++) {
+        r[q]->payload.raw = NULL;
+        r[q]->num_tuples = 0;
+    }
+    int failed = !preds || !bits || !counts;
+    for (size_t q = 0; q < n && !failed; q++) {
+        compile_predicate(f[q], col->type, &preds[q]);
+        r[q]->payload = alloc_bitmap(rows);
+        r[q]->type = POSBITMAP;
+        failed = !r[q]->payload.raw;
+        bits[q] = (failed) ? NULL : bitmap_words(r[q]->payload);
+    }
+    if (failed) {
+        for (size_t q = 0; q < n; q++) {
+            free(r[q]->payload.raw);
+            r[q]->payload.raw = NULL;
+        }
+        free(preds);
+        free(bits);
+        free(counts);
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
+    }
+
+    job.preds = preds;
+    job.n = n;
+    job.col = col;
+    job.bits = bits;
+    job.counts = counts;
+    run_morsels(batch_morsel, &job, rows);
+
+    // Each select then ends up in whichever form suits what qualified.
+    for (size_t q = 0; q < n; q++) {
+        for (size_t m = 0; m < MORSELS(rows); m++) {
+            r[q]->num_tuples += counts[m * n + q];
+        }
+        compact_bitmap(&r[q]->payload, &r[q]->type, r[q]->num_tuples);
+    }
+    free(preds);
+    free(bits);
+    free(counts);
+    return ret;
+}
+
 // TODO(luisperez): Figure out what to do with these!
 status query_prepare(const char* query, db_operator** op)
 {
@@ -12,4 +12,19 @@
 status recluster(table* tbl, IndexType type);
 status recluster_col(column* col, IndexType type);
 
+// Frees the index of col along with whatever arrays it owns.
+void free_index(column* col);
+
+// Starts loading the columns (or tables) listed one per line in
+// DATA_FOLDER/WARMUP_FILE in the background, if there is such a file.
+// Each one is loaded between statements, under execution_lock.
+status start_warmup(void);
+
+// Stops loading the warm-up list. Must be called with execution_lock held.
+void stop_warmup(void);
+
+// Frees a database along with all of its tables, columns and indexes. This
+// does not touch the disk, so sync_db first to keep any changes.
+void free_db(db* db);
+
 #endif // DB_H__
@@ -50,6 +50,16 @@ const char* load_command = "^load\\(\\\"[a-zA-Z0-9_\\.\\/]+\\\"\\)";
 // Matches shutdown
 const char* shutdown_command = "^shutdown";
 
+// Matches: batch_queries(), after which selects are queued
+const char* batch_queries_command = "^batch_queries\\(\\)";
+
+// Matches: batch_execute(), which runs the queued selects together
+const char* batch_execute_command = "^batch_execute\\(\\)";
+
+// Matches: select_stats(), which replies with how many blocks of positions
+// selects have stored with each kernel: <branching>,<branch_free>
+const char* select_stats_command = "^select_stats\\(\\)";
+
 // TODO(USER): You will need to update the commands here for every single command you add.
 dsl** dsl_commands_init(void)
 {
@@ -108,5 +118,14 @@ dsl** dsl_commands_init(void)
     commands[15]->c = create_index_command;
     commands[15]->g = CREATE_INDEX;
 
+    commands[16]->c = batch_queries_command;
+    commands[16]->g = BATCH_QUERIES_COMMAND;
+
+    commands[17]->c = batch_execute_command;
+    commands[17]->g = BATCH_EXECUTE_COMMAND;
+
+    commands[18]->c = select_stats_command;
+    commands[18]->g = SELECT_STATS_COMMAND;
+
     return commands;
 }
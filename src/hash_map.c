@@ -76,6 +76,25 @@ void* find_in_map(hash_map* map, const char* key)
     return (el) ? el->value : el;
 }
 
+void* remove_from_map(hash_map* map, const char* key)
+{
+    // Find the link holding the key.
+    cont_node* node = map->buckets[hash_function(key) % BUCKETS];
+    for (; node; node = node->next) {
+        for (size_t i = 0; i < node->count; i++) {
+            if (strcmp(node->link[i].key, key) == 0) {
+                void* value = node->link[i].value;
+                free(node->link[i].key);
+
+                // Fill the gap with the last pair of the link.
+                node->link[i] = node->link[--node->count];
+                return value;
+            }
+        }
+    }
+    return NULL;
+}
+
 // Frees the linked list starting at head.
 void clear_element(cont_node* head) {
     column* c;
@@ -87,8 +106,13 @@ void clear_element(cont_node* head) {
             c = (column *) head->link[i].value;
             if (!c->name) {
                 // We also assume it is a column type, as all of our variables
-                // are stored as columns.
-                free(c->data);
+                // are stored as columns. Views only give back their reference.
+                if (c->base) {
+                    c->base->views--;
+                }
+                else {
+                    free(c->data.raw);
+                }
             }
 
             free(head->link[i].value);
@@ -101,6 +125,16 @@ void clear_element(cont_node* head) {
     }
 }
 
+void for_each_in_map(hash_map* map, void (*visit)(void* value, void* arg), void* arg) {
+    for (int i = 0; i < BUCKETS; i++) {
+        for (cont_node* node = map->buckets[i]; node; node = node->next) {
+            for (size_t j = 0; j < node->count; j++) {
+                visit(node->link[j].value, arg);
+            }
+        }
+    }
+}
+
 void clear_map(hash_map* map) {
     for (int i = 0; i < BUCKETS; i++) {
         clear_element(map->buckets[i]);
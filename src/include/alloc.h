@@ -0,0 +1,75 @@
+// alloc.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Allocator for column arrays: the values of columns and results, packed
+// codes and the key and position arrays of B+tree nodes. Arrays start on a
+// COLUMN_ALIGNMENT boundary, so kernels can rely on whole cache lines (and
+// aligned vector loads) from the first value. Arrays of at least
+// HUGE_PAGE_SIZE bytes start on a huge page and, with HUGE_PAGES, are
+// advised to be backed by transparent huge pages, so a full scan of a large
+// column touches few TLB entries.
+//
+// Everything handed out here is released with free(), like any other heap
+// array, so the arrays can change hands freely. Arrays of at least a huge
+// page are mapped on their own (on glibc, by fixing malloc's mmap threshold)
+// so that column_grow can move them without copying.
+
+#ifndef SRC_INCLUDE_ALLOC_H_
+#define SRC_INCLUDE_ALLOC_H_
+
+#include <stdlib.h>
+
+// The alignment of every array (a cache line).
+#define COLUMN_ALIGNMENT 64
+
+// The size (and alignment) of a transparent huge page.
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/**
+ * alloc_stats
+ * - allocations/bytes, the arrays handed out and their total size.
+ * - huge_allocations/huge_bytes, those of them advised to use huge pages.
+ * - failures, the allocations we could not satisfy.
+ * - grows, the arrays column_grow grew where they were (by remapping their
+ *       pages, for large ones) rather than by copying them.
+ * They only ever grow: arrays are released with free(), which we do not see.
+ **/
+typedef struct alloc_stats {
+    size_t allocations;
+    size_t bytes;
+    size_t huge_allocations;
+    size_t huge_bytes;
+    size_t failures;
+    size_t grows;
+} alloc_stats;
+
+// Allocates n zeroed elements of width bytes each, aligned as above.
+// Returns NULL if out of memory.
+void* column_alloc(size_t n, size_t width);
+
+// Like column_alloc, but leaves the elements as they are. For arrays the
+// caller fills completely: zeroing a large one would fault in and write
+// every page once more.
+void* column_alloc_uninit(size_t n, size_t width);
+
+// Returns a new array of nsize bytes holding the osize bytes at data followed
+// by zeros, like resize (see utils.h). The caller still owns data.
+void* column_resize(const void* data, size_t osize, size_t nsize);
+
+// Grows the array at data (from column_alloc) from osize to nsize bytes,
+// and returns where it now lives (or NULL, leaving data as it was, if
+// out of memory). The bytes past osize are not zeroed. Arrays of at least
+// HUGE_PAGE_SIZE have pages of their own, and growing them only remaps those
+// pages rather than copying what they hold, so appending to a large column
+// never copies it. A remapped array is only aligned to a page (and so to
+// COLUMN_ALIGNMENT), not to a huge page: its first and last stretch of less
+// than a huge page may stay in small pages, while the huge pages in between
+// are advised again.
+void* column_grow(void* data, size_t osize, size_t nsize);
+
+// The usage of the allocator since the process started.
+alloc_stats get_alloc_stats(void);
+
+#endif  // SRC_INCLUDE_ALLOC_H_
@@ -9,6 +9,7 @@
 #ifndef SRC_INCLUDE_B_TREE_H_
 #define SRC_INCLUDE_B_TREE_H_
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -45,8 +46,8 @@
     L3 cache:              4096K
     NUMA node0 CPU(s):     0-3
 **/
-// With the above, and given that Data type is of size 64 bits (8 bytes),
-// the size of a node is going to be FANOUT * 8 + 4*8 (upper estimate)
+// With the above, and given that Key type is of size 32 bits (4 bytes),
+// the size of a node is going to be FANOUT * 4 + 4*8 (upper estimate)
 // This gives an optimal FANOUT of
 // So we can fit it into L1 cash.
 #define FANOUT 4 * 1023
@@ -54,6 +55,17 @@
 // The load capacity ratio for each node in the tree.
 #define CAPACITY 0.8
 
+// On disk, every node starts on a page boundary so the file can be mapped
+// and each node read in place.
+#define BTREE_PAGE_SIZE 4096
+
+// Identifies an index file holding a paged tree ("BTRE").
+#define BTREE_MAGIC 0x45525442
+#define BTREE_VERSION 3
+
+// Keys are stored at the width of the INT columns we index.
+typedef int Key;
+
 typedef enum NodeType {
   Internal,
   Leaf,
@@ -62,7 +74,7 @@ typedef enum NodeType {
 
 /**
  * A Node for A B+ tree
- * Data keys[NODE_SIZE] is just an array of keys used for searching.
+ * Key keys[NODE_SIZE] is just an array of keys used for searching.
  * size_t count is the current number of keys in the array.
  * NodeType type is the NodeType of this node.
  * Node* children points to
@@ -71,63 +83,124 @@ typedef enum NodeType {
  * Node* next_link points to:
  *  : NULL if the node is an internal type (we link at every level)
  *  : Link to the next node if a leave node (we're at the leave level)
+ * int mapped is set when keys (or values) points straight into a mapped index
+ * file rather than to FANOUT slots we own. We copy them out before modifying.
+ * Values values holds the positions of a Position node, which are of type
+ * pos_type (POS32, or POS64 for a tree over more rows than that can address).
+ * A Position node has no keys.
 
 **/
 
 typedef struct Node {
-  Data keys[FANOUT];
+  Key* keys;
   size_t count;
   NodeType type;
+  int mapped;
+  Values values;
+  DataType pos_type;
   struct Node* children;
   struct Node* next_link;
 } Node;
 
+/**
+ * The on-disk layout of a tree. The first page holds a btree_header. Each
+ * node follows on its own run of pages, starting with a btree_page and then
+ *  : keys[count], values[count] for a leaf
+ *  : keys[count], child page numbers[count] for an internal node.
+ * The keys are padded to a multiple of 8 bytes. Values are pos_width bytes
+ * each.
+ * Only the used key slots are stored. Children are written before their
+ * parent, so the root comes last and page numbers only ever point back.
+ **/
+typedef struct btree_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t fanout;
+  uint32_t pos_width;
+  uint32_t padding;
+  uint64_t page_count;
+  uint64_t root;
+} btree_header;
+
+typedef struct btree_page {
+  uint32_t type;
+  uint32_t pages;  // Number of pages the node spans.
+  uint64_t count;
+} btree_page;
+
 // Stores a pointer to the leaf node containing the
 // desired element in node. If the element if not found, we find the
 // element <= to it that is in the tree.
 // The function returns the index of the retrieved element in the stored node.
 // Root is the root of the binary tree we're searching for.
-size_t find_element_tree(Data el, Node* root, Node** node);
+size_t find_element_tree(Key el, Node* root, Node** node);
+
 
+// Makes root (already allocated) an empty tree.
+void init_tree(Node* root);
 
 // Bulk load.
-// Given a sorted Data array and corresponding pos array and a size of the array,
-// bulk loads it into a B+ tree. We assume that root points to the root of
-// the tree into which we want to load the data! It creates copies of the input data,
-// so the given arrays can be freed after use.
+// Given a sorted Key array and corresponding pos array (of type pos_type) and a
+// size of the array, bulk loads it into a B+ tree. We assume that root points to
+// the root of the tree into which we want to load the data! It creates copies of
+// the input data, so the given arrays can be freed after use.
 // The tree is rooted at the location pointed to by root, which we
 // assume is already allocated. No error checking is performed.
-void bulk_load(Data* data, Data* pos, size_t n, Node* root);
+void bulk_load(Key* data, Values pos, DataType pos_type, size_t n, Node* root);
 
+// The type of the positions held by the tree.
+DataType tree_pos_type(Node* root);
+
+
+// Finds the first key in the tree no less than el. Sets *leaf to the leaf
+// holding it and returns its index there. If every key is smaller, that is the
+// count of the last leaf, so bounds found this way can always be walked along
+// the leaves (next_link) from the lower to the upper one.
+size_t lower_bound_tree(Key el, Node* root, Node** leaf);
+
+// The first and one past the last key in the tree, as for lower_bound_tree.
+size_t tree_begin(Node* root, Node** leaf);
+size_t tree_end(Node* root, Node** leaf);
 
 // Return the minumum key in the tree.
-Data get_min_key(Node* root);
+Key get_min_key(Node* root);
 
 // Returns the maximum key in the tree.
-Data get_max_key(Node* root);
+Key get_max_key(Node* root);
 
 // Return the minumum value in the tree.
-Data get_min_value(Node* root);
+size_t get_min_value(Node* root);
 
 // Returns the maximum value in the tree.
-Data get_max_value(Node* root);
+size_t get_max_value(Node* root);
 
 // Extract the data from the btree -- they keys are placed in the
-// array pointed to by keys and the values into that pointed to
-// by values! Note that keys and values are assumed to be pre-allocated
-// arrays with enough space to fit the data.
-void extract_data(Node* root, Data* keys, Data* values);
+// array pointed to by keys and the values (as positions of type pos_type) into
+// that pointed to by values! Note that keys and values are assumed to be
+// pre-allocated arrays with enough space to fit the data.
+void extract_data(Node* root, Key* keys, Values values, DataType pos_type);
 
 // Frees a btree!
 void free_btree(Node* root);
 
 // Insert a key-value pair into a b-tree. Try to keep it balanced!
-void insert_tree(Node* root, Data key, Data value);
-
-// Writes a tree to disk.
-void write_tree(FILE* fp, Node* root);
-
-// Reads a tree from disk. Stores the root node in the node pointed to by root.
-void read_tree(FILE* fp, Node* root);
+// The tree must be able to hold value (see tree_pos_type and widen_tree).
+void insert_tree(Node* root, Key key, size_t value);
+
+// Switches the positions of the tree over to POS64, for when it outgrows
+// POS32.
+void widen_tree(Node* root);
+
+// Writes a tree to disk in the paged format above, starting at the current
+// (page aligned) position of fp.
+status write_tree(FILE* fp, Node* root);
+
+// Reads a tree from the length bytes at buf, as written by write_tree.
+// Stores the root node in the node pointed to by root. If mapped is set, buf
+// is a file mapping which must outlive the tree: the keys and values are
+// used in place and only the node headers are allocated. Otherwise they are
+// copied out and buf can be freed.
+status read_tree(const char* buf, size_t length, Node* root, int mapped);
 
 #endif  // SRC_INCLUDE_B_TREE_H_
\ No newline at end of file
@@ -0,0 +1,128 @@
+// catalog.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Versioned binary catalog replacing the old fscanf-parsed .meta files.
+// A catalog file is a header followed by fixed-size entries:
+//
+//   catalog_header | catalog_db[db_count] | catalog_table[table_count] |
+//   catalog_column[column_count]
+//
+// The server catalog only lists databases and each database catalog only
+// lists tables and columns. Catalogs are written once per sync and read back
+// with a single mmap, so every column's bytes can be located directly from
+// its entry without parsing anything.
+
+#ifndef SRC_INCLUDE_CATALOG_H_
+#define SRC_INCLUDE_CATALOG_H_
+
+#include <stdint.h>
+
+#include "cs165_api.h"
+#include "hash_map.h"
+#include "storage.h"
+
+#define CATALOG_MAGIC 0x4C544143  // "CATL"
+#define CATALOG_VERSION 7
+
+#define CATALOG_NO_INDEX -1  // Index type for columns without an index.
+
+typedef struct catalog_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t db_count;
+    uint64_t table_count;
+    uint64_t column_count;
+    uint64_t lsn;       // Log position the catalog's contents reflect.
+    uint64_t checksum;  // Checksum of every entry following the header.
+} catalog_header;
+
+typedef struct catalog_db {
+    char name[MAX_STRING_LENGTH];
+    uint64_t table_count;
+} catalog_db;
+
+/**
+ * catalog_table
+ * - first_column, the position of the table's first column entry; its
+ *       columns are stored contiguously and in table order.
+ * - cluster_column, the offset of the clustering column within the table or
+ *       -1 if the table is not clustered.
+ * - delta, the number of rows at the end of the table that are not yet in
+ *       cluster order (see merge_delta).
+ **/
+typedef struct catalog_table {
+    char name[MAX_STRING_LENGTH];
+    uint64_t col_count;
+    uint64_t first_column;
+    int64_t cluster_column;
+    uint64_t delta;
+} catalog_table;
+
+/**
+ * catalog_column
+ * Everything needed to find and validate a column's bytes. The values live
+ * in <col>.<epoch>.data and the index (if it has its own storage) in
+ * <col>.<epoch>.index. A sync never overwrites a file an existing catalog
+ * points to; it writes a new epoch and the old file goes once the new
+ * catalog is in place.
+ * - type, the DataType of the values.
+ * - index, the IndexType of the column index, or CATALOG_NO_INDEX.
+ * - fanout, the B+ tree fanout the index was written with (0 otherwise).
+ * - data_codec, how the values are stored in <col>.data (see codec.h).
+ * - data_offset/data_length, the byte range of the values in <col>.data.
+ * - index_offset/index_length, the byte range of the index in <col>.index
+ *       (0 length if the index has no storage of its own).
+ * - data_checksum/index_checksum, checksums over the two files.
+ * - data_epoch/index_epoch, the epoch in the names of the two files.
+ **/
+typedef struct catalog_column {
+    char name[MAX_STRING_LENGTH];
+    uint32_t type;
+    int32_t index;
+    uint32_t fanout;
+    uint32_t data_codec;
+    uint64_t count;
+    uint64_t data_offset;
+    uint64_t data_length;
+    uint64_t index_offset;
+    uint64_t index_length;
+    uint64_t data_checksum;
+    uint64_t index_checksum;
+    uint64_t data_epoch;
+    uint64_t index_epoch;
+} catalog_column;
+
+// A catalog mapped into memory. The entry pointers point into the mapping.
+typedef struct catalog {
+    mapping* map;
+    catalog_header* header;
+    catalog_db* dbs;
+    catalog_table* tables;
+    catalog_column* columns;
+} catalog;
+
+// Computes a 64-bit checksum of n bytes starting at data.
+uint64_t checksum(const void* data, size_t n);
+
+// Continues the checksum hash (of a multiple of 8 bytes) over n more bytes
+// at data, as if they had been checksummed together.
+uint64_t checksum_extend(uint64_t hash, const void* data, size_t n);
+
+// Computes the checksum of the entire file fname and stores it in sum.
+status checksum_file(const char* fname, uint64_t* sum);
+
+// Maps the catalog at fname and validates its header and checksum.
+status open_catalog(const char* fname, catalog* cat);
+
+// Unmaps a catalog opened with open_catalog.
+void close_catalog(catalog* cat);
+
+// Writes a catalog with the given entries to fname. lsn is the position in
+// the write-ahead log up to which the entries (and their files) are current.
+status write_catalog(const char* fname, uint64_t lsn, catalog_db* dbs, size_t db_count,
+    catalog_table* tables, size_t table_count,
+    catalog_column* columns, size_t column_count);
+
+#endif  // SRC_INCLUDE_CATALOG_H_
@@ -0,0 +1,42 @@
+// checkpoint.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Persists every database to DATA_FOLDER. Shutdown does so synchronously;
+// while serving, a background thread checkpoints every CHECKPOINT_INTERVAL
+// seconds so a crash only has to replay the log written since.
+//
+// Background checkpoints snapshot the databases by forking: the child gets
+// a copy-on-write image of every column and index as of a statement
+// boundary and writes out the dirty ones, while the server keeps executing
+// statements against its own copy. The child reports back which files it
+// wrote so the server knows what its catalogs point to.
+
+#ifndef SRC_INCLUDE_CHECKPOINT_H_
+#define SRC_INCLUDE_CHECKPOINT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cs165_api.h"
+
+// Held while executing a statement. Checkpoints take it so their snapshot
+// never sees a statement half applied.
+extern pthread_mutex_t execution_lock;
+
+// Writes the server catalog listing every database, current up to lsn.
+status write_server_catalog(uint64_t lsn);
+
+// Syncs every database up to lsn and then writes the server catalog.
+status sync_databases(uint64_t lsn);
+
+// Starts the background checkpoint thread (unless CHECKPOINT_INTERVAL is 0).
+// Must run once the persisted data and the log have been recovered.
+status start_checkpointer(void);
+
+// Stops the background checkpoint thread, waiting for any checkpoint in
+// progress to finish. Must be called with execution_lock held.
+void stop_checkpointer(void);
+
+#endif  // SRC_INCLUDE_CHECKPOINT_H_
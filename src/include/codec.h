@@ -0,0 +1,70 @@
+// codec.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Lightweight compression for column files. Integer columns are cut into
+// blocks of CODEC_BLOCK_SIZE values and each block is stored with whichever
+// of the schemes below is smallest for it:
+//
+//   BLOCK_RAW    the values as 8-byte integers.
+//   BLOCK_FOR    frame of reference: the minimum, then every value minus the
+//                minimum bit-packed with just enough bits for the range.
+//   BLOCK_DELTA  the first value and the minimum difference between
+//                neighbours, then every difference minus that bit-packed.
+//                Sorted columns end up with a handful of bits per value.
+//   BLOCK_RLE    (value, run length) pairs.
+//
+// A compressed file is just the blocks back to back, each a codec_block
+// header followed by its payload.
+
+#ifndef SRC_INCLUDE_CODEC_H_
+#define SRC_INCLUDE_CODEC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+// How a column file is stored, as recorded in its catalog entry.
+#define CODEC_NONE 0    // A plain array of Data.
+#define CODEC_BLOCKS 1  // Compressed blocks.
+
+#define CODEC_BLOCK_SIZE 4096  // Values per block.
+
+typedef enum BlockScheme {
+    BLOCK_RAW,
+    BLOCK_FOR,
+    BLOCK_DELTA,
+    BLOCK_RLE
+} BlockScheme;
+
+/**
+ * codec_block
+ * - scheme, the BlockScheme of the payload.
+ * - bits, the width of each packed value (BLOCK_FOR and BLOCK_DELTA).
+ * - count, the number of values in the block.
+ * - length, the bytes of payload following the header (a multiple of 8).
+ * - base, the minimum value (BLOCK_FOR) or the first value (BLOCK_DELTA).
+ * - step, the minimum difference between neighbours (BLOCK_DELTA).
+ **/
+typedef struct codec_block {
+    uint32_t scheme;
+    uint32_t bits;
+    uint32_t count;
+    uint32_t length;
+    int64_t base;
+    int64_t step;
+} codec_block;
+
+// Compresses count values of the given type. Stores a newly allocated buffer
+// with the blocks in out and returns its length. Returns 0 (and sets out to
+// NULL) if the column cannot be compressed, as for DOUBLE columns.
+size_t encode_column(const void* data, size_t count, DataType type, char** out);
+
+// Decompresses the length bytes at buf, written by encode_column, into the
+// count values of the given type at data.
+status decode_column(const char* buf, size_t length, void* data, size_t count,
+    DataType type);
+
+#endif  // SRC_INCLUDE_CODEC_H_
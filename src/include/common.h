@@ -9,6 +9,104 @@
 #define DATA_FOLDER "../data"  // Storage locations for db persistence
 #define SYSTEM_META_FILE "server"  // Main system meta storage location
 
+// When set, column files are mapped copy-on-write at startup instead of being
+// read into freshly allocated arrays. Build with -DMMAP_COLUMNS=0 to disable.
+#ifndef MMAP_COLUMNS
+#define MMAP_COLUMNS 1
+#endif
+
+// When set, integer columns that compress to at most half their size are
+// written compressed (see codec.h) and decoded on load rather than mapped.
+// Build with -DCOMPRESS_COLUMNS=0 to always write plain arrays.
+#ifndef COMPRESS_COLUMNS
+#define COMPRESS_COLUMNS 1
+#endif
+
+// When set, integer columns are kept in memory compressed (see packed.h)
+// once loaded, and scanned without decompressing them. Build with
+// -DPACK_COLUMNS=0 to keep plain arrays.
+#ifndef PACK_COLUMNS
+#define PACK_COLUMNS 1
+#endif
+
+// When set, inserts into a clustered table are appended to its delta store
+// (the end of its columns, left unsorted) and merged into cluster order once
+// the delta holds 1/DELTA_RATIO of the table and at least DELTA_MIN_ROWS
+// rows. Build with -DDELTA_STORE=0 to insert each row in cluster order.
+#ifndef DELTA_STORE
+#define DELTA_STORE 1
+#endif
+#define DELTA_RATIO 16
+#define DELTA_MIN_ROWS 4096
+
+// When set, column arrays of at least a huge page are advised to be backed
+// by transparent huge pages (see alloc.h). Build with -DHUGE_PAGES=0 to
+// leave them to the kernel's default.
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 1
+#endif
+
+// When set, selects of a range of integers run vectorized on CPUs with AVX2
+// (see kernels.c). Build with -DSIMD_SCANS=0 to always use the portable
+// kernels.
+#ifndef SIMD_SCANS
+#define SIMD_SCANS 1
+#endif
+
+// When set, selects that store positions pick, block by block, between a
+// branching and a branch-free kernel by how many rows have been qualifying
+// (see select_rows in kernels.c). Build with -DADAPTIVE_SELECTS=0 to always
+// use the branch-free one.
+#ifndef ADAPTIVE_SELECTS
+#define ADAPTIVE_SELECTS 1
+#endif
+
+// Batched file I/O (see io.h) goes through io_uring when the kernel allows
+// it. Build with -DUSE_IO_URING=0 to always use a pool of threads instead.
+#ifndef USE_IO_URING
+#ifdef __linux__
+#define USE_IO_URING 1
+#else
+#define USE_IO_URING 0
+#endif
+#endif
+
+// When set, column and index files are written with O_DIRECT from aligned
+// buffers so a sync does not also fill the page cache with them.
+#ifndef IO_DIRECT
+#define IO_DIRECT 0
+#endif
+
+// Seconds between background checkpoints of every database to DATA_FOLDER,
+// which bounds how much of the log a restart has to replay. 0 disables them.
+#ifndef CHECKPOINT_INTERVAL
+#define CHECKPOINT_INTERVAL 30
+#endif
+
+// When set, startup only reads the catalogs and each column is loaded the
+// first time it is used. Build with -DLAZY_LOAD=0 to load everything upfront.
+#ifndef LAZY_LOAD
+#define LAZY_LOAD 1
+#endif
+
+// Threads used to load the columns of a table (or, without LAZY_LOAD, of a
+// whole database) in parallel.
+#ifndef LOAD_THREADS
+#define LOAD_THREADS 8
+#endif
+
+// Threads that scans, fetches, aggregates and vector operations over large
+// columns are spread over (see morsels.h), the one running the query
+// included. 0 means one per online CPU. Build with -DSCAN_THREADS=1 to run
+// them all on the query's thread.
+#ifndef SCAN_THREADS
+#define SCAN_THREADS 0
+#endif
+
+// Lists the columns (db.tbl.col) or whole tables (db.tbl) to load in the
+// background at startup, one per line, rather than on first use.
+#define WARMUP_FILE "warmup"
+
 #define MAX_INT_LENGTH 20
 
 #endif  // COMMON_H__
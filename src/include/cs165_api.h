@@ -35,7 +35,13 @@ typedef enum DataType {
      INT,
      LONGINT,
      DOUBLE,
-     // Others??
+     // Row positions, 32 bits wide unless the table is too long for them
+     // (see pos_type).
+     POS32,
+     POS64,
+     // Row positions as a contiguous range or a bitmap (see positions.h).
+     POSRANGE,
+     POSBITMAP,
 } DataType;
 
 
@@ -66,10 +72,19 @@ typedef enum IndexType {
  *       start of the sorted array. For B+Tree, this points to the root node.
  *       You will need to cast this from void* to the appropriate type when
  *       working with the index.
+ * - dirty, set whenever the index changes in memory and cleared once it has
+ *       been written out, so a sync can skip indexes that are already on disk.
+ * - length/checksum/epoch, the size, checksum and epoch of the index file
+ *       written by the last sync.
  **/
 typedef struct column_index {
     IndexType type;
     void* index;
+    struct mapping* map;  // The index file a B_PLUS_TREE points into, if any.
+    int dirty;
+    size_t length;
+    uint64_t checksum;
+    uint64_t epoch;
 } column_index;
 
 /**
@@ -80,10 +95,28 @@ typedef struct column_index {
  *       within a table, but columns from different tables can have the same
  *       name.
  * - data, this is the raw data for the column. Operations on the data should
- *       be persistent.
+ *       be persistent. Values are stored at the width of the column type.
  * - index, this is an [opt] index built on top of the column's data.
  * - count, this stores the number of elements currently stored in data
  * - size, The current size of the data array
+ * - map, the file mapping backing data when the column was loaded with
+ *       MMAP_COLUMNS (NULL when data is heap allocated).
+ * - dirty, set whenever data changes and cleared once it has been synced.
+ * - checksum/epoch/length/codec, the checksum, epoch, size and encoding of
+ *       the data file written by the last sync.
+ * - pending, where to load data and index from on first use (NULL once the
+ *       column is in memory).
+ * - packed, the compressed form of data while the column is held packed
+ *       (see packed.h), in which case data is NULL.
+ * - zones, the bounds of the values in each block of rows (see zones.h), or
+ *       NULL for columns without them.
+ * - delta, for the cluster column of a table, how many of its last rows are
+ *       the table's delta store: rows appended since the table was last
+ *       clustered, not yet in order (see merge_delta).
+ * - base, for a view (see fetch), the column whose data this one points
+ *       into. A view owns no data of its own.
+ * - views, the number of views pointing into data. They are copied out
+ *       before data changes or goes away (see detach_views).
  *
  * NOTE: We do not track the column length in the column struct since all
  * columns in a table should share the same length. Instead, this is
@@ -95,13 +128,40 @@ typedef struct column_index {
     long int li;
  } Data;
 
+/**
+ * Values
+ * An array of values stored at their native width: int for INT, long int for
+ * LONGINT, double for DOUBLE and uint32_t/uint64_t for POS32/POS64. Which
+ * member to use is given by the type of the column (or result) holding it.
+ **/
+typedef union Values {
+    int* i;
+    long int* li;
+    double* f;
+    uint32_t* p32;
+    uint64_t* p64;
+    void* raw;
+} Values;
+
 typedef struct column {
     char* name;
-    Data* data;
+    Values data;
     size_t size;
     size_t count;
     column_index* index;
     DataType type;  // Stores the type of the column
+    struct mapping* map;
+    int dirty;
+    uint64_t checksum;
+    uint64_t epoch;
+    size_t length;
+    uint32_t codec;
+    struct pending_column* pending;
+    struct packed_column* packed;
+    struct zone_map* zones;
+    size_t delta;
+    struct column* base;
+    size_t views;
 } column;
 
 /**
@@ -148,12 +208,15 @@ typedef struct table {
  * - name: the name of the associated database.
  * - table_count: the number of tables in the database.
  * - tables: the pointer to the array of tables contained in the db.
+ * - lsn: the write-ahead log position the persisted db reflects. Log records
+ *       up to it are already in the db files and are not replayed.
  **/
 typedef struct db {
     char* name;
     size_t table_count;
     size_t tables_available;
     table** tables;
+    uint64_t lsn;
 } db;
 
 /**
@@ -231,10 +294,13 @@ typedef struct comparator {
     Junction mode;
 } comparator;
 
+// A result whose base is set is a view: its payload points into the data of
+// base and must not be freed (see fetch).
 typedef struct result {
     size_t num_tuples;
-    Data* payload;
+    Values payload;
     DataType type;
+    column* base;
 } result;
 
 typedef enum Aggr {
@@ -256,6 +322,9 @@ typedef enum OperatorType {
     PRINT,
     LOADFILE,
     SHUTDOWN,
+    BATCH_QUERIES,
+    BATCH_EXECUTE,
+    SELECT_STATS,
     NOTAVAILABLE
 } OperatorType;
 
@@ -300,11 +369,11 @@ typedef struct db_operator {
     column** columns;
 
     // Internmediaties used for PROJECT, DELETE, HASH_JOIN
-    Data* pos1;
+    Values pos1;
     DataType pos1type;
 
     // Needed for HASH_JOIN
-    Data* pos2;
+    Values pos2;
     DataType pos2type;
 
     // For insert/delete operations, we only use value1;
@@ -318,6 +387,9 @@ typedef struct db_operator {
     Aggr agg;
     comparator* c;
 
+    // Whether the statement changes the database, so that it goes in the
+    // write-ahead log once it has run successfully.
+    int logged;
 } db_operator;
 
 typedef enum OpenFlags {
@@ -455,6 +527,17 @@ status create_secondary_index(column* col, IndexType type);
 **/
 status cluster_table(table* tbl);
 
+/**
+ * add_to_delta(tbl) / merge_delta(tbl)
+ * With DELTA_STORE, an insert into a clustered table appends its row to
+ * every column, which leaves it in the table's delta store. add_to_delta
+ * counts such a row and merges the delta once it is large enough.
+ * merge_delta sorts the delta into cluster order along with the rows
+ * before it, which only needs the delta itself sorted.
+ **/
+status add_to_delta(table* tbl);
+status merge_delta(table* tbl);
+
 status insert(column *col, Data data);
 status insert_pos(column* col, size_t pos, Data data);
 size_t find_pos(column* col, Data data);
@@ -462,6 +545,9 @@ status delete(column *col, int *pos);
 status update(column *col, int *pos, int new_val);
 status fetch(column *col, column *pos, result **r);
 status col_scan(comparator *f, column *col, result **r);
+// Like col_scan on all of col for each of the n comparators f[i], into r[i],
+// but reading col once for all of them.
+status batch_scan(comparator** f, size_t n, column* col, result** r);
 
 /* Query API */
 status query_prepare(const char* query, db_operator** op);
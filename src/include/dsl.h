@@ -13,7 +13,7 @@
 
 // Currently we have 4 DSL commands to parse.
 // TODO(USER): you will need to increase this to track the commands you support.
-#define NUM_DSL_COMMANDS (16)
+#define NUM_DSL_COMMANDS (19)
 
 // This helps group similar DSL commands together.
 // For example, some queries can be parsed together:
@@ -41,6 +41,9 @@ typedef enum DSLGroup {
     SHUTDOWNCOMMAND,
     LOADCOMMAND,
     CREATE_INDEX,
+    BATCH_QUERIES_COMMAND,
+    BATCH_EXECUTE_COMMAND,
+    SELECT_STATS_COMMAND,
     // TODO(USER): Add more here...
 } DSLGroup;
 
@@ -71,5 +74,8 @@ extern const char* vect_operation_command;
 extern const char* tuple_command;
 extern const char* load_command;
 extern const char* shutdown_command;
+extern const char* batch_queries_command;
+extern const char* batch_execute_command;
+extern const char* select_stats_command;
 
 #endif // DSL_H__
@@ -58,6 +58,18 @@ bool insert_into_map(hash_map* map, const char* key, void* value);
 */
 void* find_in_map(hash_map* map, const char* key);
 
+/**
+* Given a map and a key, removes the key from the map and returns the value it
+* was associated with (which is not freed). Returns null if not found.
+*/
+void* remove_from_map(hash_map* map, const char* key);
+
+/**
+* Given a map, calls visit on each value in it (in no particular order),
+* passing arg along.
+**/
+void for_each_in_map(hash_map* map, void (*visit)(void* value, void* arg), void* arg);
+
 /**
 * Given  a map, attempts to clear it of all contents (also attempts to free memory therein)
 **/
@@ -0,0 +1,68 @@
+// io.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Batched file I/O. A batch of reads, writes and fsyncs is handed over at
+// once and we keep many of them in flight, so persisting or loading a
+// database is bound by the device rather than by one syscall at a time.
+//
+// With USE_IO_URING (Linux only), the batch is submitted through an io_uring
+// set up with the raw system calls. If the kernel does not let us create
+// one, we fall back to a pool of threads doing pread/pwrite/fsync.
+
+#ifndef SRC_INCLUDE_IO_H_
+#define SRC_INCLUDE_IO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+// Reads and writes are split into chunks of this many bytes, so a single
+// large file also keeps several requests in flight.
+#define IO_CHUNK_SIZE (1 << 20)
+
+// The most requests we keep in flight at once.
+#define IO_QUEUE_DEPTH 64
+
+// Threads used when io_uring is not available.
+#define IO_THREADS 8
+
+// Alignment of buffers (and lengths) for O_DIRECT.
+#define IO_ALIGNMENT 4096
+
+typedef enum IoOp {
+    IO_READ,
+    IO_WRITE,
+    IO_FSYNC
+} IoOp;
+
+/**
+ * io_request
+ * - op, what to do with fd.
+ * - buf/length/offset, the bytes to transfer and where in the file (unused
+ *       for IO_FSYNC).
+ **/
+typedef struct io_request {
+    IoOp op;
+    int fd;
+    void* buf;
+    size_t length;
+    uint64_t offset;
+} io_request;
+
+// Performs every one of the n requests in no particular order, returning
+// once they are all done. Short transfers are carried on to completion.
+// Fails if any request fails.
+status io_run(io_request* reqs, size_t n);
+
+// Creates (or truncates) fname for writing. If *direct is set we open it
+// with O_DIRECT, clearing *direct if the file system does not support that.
+// Returns the file descriptor, or -1 on failure.
+int io_create(const char* fname, int* direct);
+
+// The backend io_run is using: "io_uring" or "threads".
+const char* io_backend(void);
+
+#endif  // SRC_INCLUDE_IO_H_
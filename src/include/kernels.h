@@ -0,0 +1,141 @@
+// kernels.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Loops over the values of a column. Columns hold their values at the native
+// width of their DataType (see Values), so every kernel is generated once per
+// type and the functions below dispatch on the type of the column.
+//
+// Selects do not walk their comparators for each value: the chain is first
+// compiled into a predicate (see compile_predicate), whose kernels test
+// ranges of values without branching, vectorized with AVX2 on CPUs that have
+// it (see SIMD_SCANS). Storing the positions that qualified adapts to how
+// many do (see ADAPTIVE_SELECTS).
+
+#ifndef SRC_INCLUDE_KERNELS_H_
+#define SRC_INCLUDE_KERNELS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+// The number of bytes one value of type takes in a column.
+size_t type_width(DataType type);
+
+// The narrowest position type that can address rows rows: POS32 unless the
+// table is longer than a uint32_t can count.
+DataType pos_type(size_t rows);
+
+// Allocates n zeroed values of type. Returns NULL values if out of memory.
+Values alloc_values(DataType type, size_t n);
+
+// Like alloc_values, without zeroing (see column_alloc_uninit).
+Values alloc_values_uninit(DataType type, size_t n);
+
+// The values of v from slot i on.
+Values values_at(Values v, DataType type, size_t i);
+
+// Reads value i of v, which holds values of type.
+Data get_value(Values v, DataType type, size_t i);
+
+// Stores value in slot i of v, which holds values of type. Positions are read
+// and stored through li.
+void set_value(Values v, DataType type, size_t i, Data value);
+
+// Reads position i of v, which holds positions of type (POS32, POS64 or
+// POSRANGE, see positions.h), or stores it (POS32 or POS64 only).
+size_t get_pos(Values v, DataType type, size_t i);
+void set_pos(Values v, DataType type, size_t i, size_t pos);
+
+// Copies the values of src at each of the n positions in pos, which have
+// type ptype (any of the forms in positions.h), into dst in order.
+void gather_values(Values src, DataType type, Values pos, DataType ptype,
+    size_t n, Values dst);
+
+// The most ranges a predicate holds. Chains that need more (which no select
+// builds) are evaluated comparator by comparator.
+#define PREDICATE_RANGES 8
+
+/**
+ * predicate
+ * A chain of comparators compiled for values of one type: the values it
+ * accepts, as disjoint ranges, and the kernel that tests values against them.
+ * - type, the type of the values (INT, LONGINT or DOUBLE).
+ * - f, the chain it was compiled from.
+ * - interpret, set if the chain did not compile, and match evaluates f.
+ * - ranges, the number of ranges (0 if no value qualifies).
+ * - lo/span, the first value of each range and how many follow it, as
+ *       unsigned integers (INT and LONGINT).
+ * - low/high, the bounds of each range (DOUBLE).
+ * - match, the bits of the n (at most 64) values from v on that qualify.
+ **/
+typedef struct predicate {
+    DataType type;
+    comparator* f;
+    int interpret;
+    size_t ranges;
+    uint64_t lo[PREDICATE_RANGES];
+    uint64_t span[PREDICATE_RANGES];
+    double low[PREDICATE_RANGES];
+    double high[PREDICATE_RANGES];
+    uint64_t (*match)(const struct predicate* p, const void* v, size_t n);
+} predicate;
+
+// Compiles f for values of type into p, which lives as long as f does. A
+// select compiles its chain once, then runs the kernels below with it.
+void compile_predicate(comparator* f, DataType type, predicate* p);
+
+// Whether value satisfies p, an INT or LONGINT predicate.
+int predicate_value(const predicate* p, long int value);
+
+// Whether every value in [min, max] satisfies p (1), none does (-1), or it
+// takes looking at them (0). p is an INT or LONGINT predicate.
+int predicate_covers(const predicate* p, long int min, long int max);
+
+// Evaluates p on n values and stores the positions of those that qualify in
+// out, returning how many did. Each block of values is stored with a
+// branching or a branch-free kernel, whichever the share of values that
+// qualified so far favours (see ADAPTIVE_SELECTS). Value k is v[k], or v[pos[k]] if gather is
+// set. Its position is pos[k] (or base + k when pos.raw is NULL). Both pos
+// and out hold positions of type ptype (POS32 or POS64).
+size_t select_values(const predicate* p, Values v, Values pos, DataType ptype,
+    size_t base, size_t n, int gather, Values out);
+
+/**
+ * select_stats
+ * - branching/branch_free, the blocks of rows select_values stored the
+ *       positions of with either kernel.
+ * They only ever grow.
+ **/
+typedef struct select_stats {
+    size_t branching;
+    size_t branch_free;
+} select_stats;
+
+// The blocks select_values has stored so far with each kernel.
+select_stats get_select_stats(void);
+
+// Evaluates p on the n values of v, setting bit k of bits (which has room for
+// n) for each value k that qualifies. Returns how many did.
+size_t scan_bitmap(const predicate* p, Values v, size_t n, uint64_t* bits);
+
+// Evaluates p on the positions set in bits (over rows rows), clearing those
+// that do not qualify. The value of position q is v[q] if gather is set, and
+// otherwise the next one of v (which holds one value per position). Returns
+// how many bits are left.
+size_t refine_bitmap(const predicate* p, Values v, uint64_t* bits, size_t rows,
+    int gather);
+
+// Returns the index of the first smallest (or, with max set, the first
+// largest) of the n values in v. n must be positive.
+size_t extreme_values(Values v, DataType type, size_t n, int max);
+
+// Sums the n values in v, into li for integer types and f for DOUBLE.
+Data sum_values(Values v, DataType type, size_t n);
+
+// Adds sign times each of the n values in v to out.
+void accumulate_values(Values v, DataType type, size_t n, int sign, long int* out);
+
+#endif  // SRC_INCLUDE_KERNELS_H_
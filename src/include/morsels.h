@@ -0,0 +1,48 @@
+// morsels.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Morsel-driven parallelism. Scans, fetches, aggregates and vector operations
+// over many rows split them into morsels of MORSEL_ROWS rows, small enough
+// for a morsel's values to stay in cache while it is worked on, and run them
+// on a persistent pool of worker threads. Each thread (the calling one
+// included) takes the next morsel until there are none left, so a thread
+// that falls behind simply takes fewer.
+//
+// Every morsel knows its place, so its results go to their own slot and are
+// put together in morsel order: what comes out is exactly what a serial scan
+// would produce.
+
+#ifndef SRC_INCLUDE_MORSELS_H_
+#define SRC_INCLUDE_MORSELS_H_
+
+#include <stdlib.h>
+
+// Rows per morsel. A multiple of 64 (so each morsel starts on a bitmap word)
+// and of ZONE_ROWS (so it starts on a zone).
+#ifndef MORSEL_ROWS
+#define MORSEL_ROWS (1 << 16)
+#endif
+
+// The number of morsels covering n rows.
+#define MORSELS(n) (((n) + MORSEL_ROWS - 1) / MORSEL_ROWS)
+
+// Works on rows [start, end), the morsel-th morsel.
+typedef void (*morsel_fn)(void* arg, size_t morsel, size_t start, size_t end);
+
+// Whether run_morsels would spread n rows over several threads. Callers
+// that need per-morsel state check this first and otherwise do the work
+// themselves in one go.
+int parallel_rows(size_t n);
+
+// Calls fn on every morsel of n rows, on the worker threads and the calling
+// one, and returns once they are all done. Runs them all on the calling
+// thread if parallel_rows(n) does not hold, or if the workers are busy (with
+// another caller, or with the morsels that called us).
+void run_morsels(morsel_fn fn, void* arg, size_t n);
+
+// Stops the worker threads, which the first run_morsels to need them started.
+void stop_workers(void);
+
+#endif  // SRC_INCLUDE_MORSELS_H_
@@ -0,0 +1,104 @@
+// packed.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Integer columns held in memory compressed. A packed column keeps its values
+// in whichever of these is smallest:
+//
+//   PACK_DICT  a sorted dictionary of the distinct values, and for each row
+//              the index of its value in the dictionary, bit-packed. Used for
+//              columns with few distinct values.
+//   PACK_RLE   runs of equal values, each a value and the row after its last.
+//              Used for sorted columns such as the cluster column.
+//   PACK_FOR   frame of reference: the minimum, and for each row its value
+//              minus the minimum, bit-packed.
+//
+// Selects and aggregates run straight on the packed form: a predicate is
+// evaluated once per dictionary entry or run, or turned into a range of
+// codes, so a scan only unpacks and compares bits. Anything that changes a
+// column unpacks it first (see unpack_column).
+
+#ifndef SRC_INCLUDE_PACKED_H_
+#define SRC_INCLUDE_PACKED_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+#include "kernels.h"
+
+// The most distinct values a dictionary is built for.
+#define PACK_DICT_LIMIT (1 << 16)
+
+typedef enum PackScheme {
+    PACK_DICT = 1,
+    PACK_RLE,
+    PACK_FOR
+} PackScheme;
+
+/**
+ * packed_column
+ * - scheme, the PackScheme in use.
+ * - type, the type of the values (INT or LONGINT).
+ * - count, the number of values.
+ * - bits, the width of each code (PACK_DICT and PACK_FOR).
+ * - base, the minimum value (PACK_FOR).
+ * - entries, the number of dictionary values (PACK_DICT) or runs (PACK_RLE).
+ * - values, the dictionary in increasing order, or the value of each run.
+ * - ends, the row after the last of each run (PACK_RLE).
+ * - codes, count codes of bits bits each, code i starting at bit i * bits.
+ **/
+typedef struct packed_column {
+    PackScheme scheme;
+    DataType type;
+    size_t count;
+    uint32_t bits;
+    int64_t base;
+    size_t entries;
+    int64_t* values;
+    uint64_t* ends;
+    uint64_t* codes;
+} packed_column;
+
+// Replaces the data of col by its packed form if that takes at most half the
+// space. Only INT and LONGINT columns are packed; anything else is left as is.
+status pack_column(column* col);
+
+// Gives col back its data as a plain array. Does nothing to unpacked columns.
+status unpack_column(column* col);
+
+// Decodes the values of p into data, which has room for all of them.
+void unpack_values(packed_column* p, Values data);
+
+// Frees p and what it owns.
+void free_packed(packed_column* p);
+
+// The bytes p takes in memory.
+size_t packed_size(packed_column* p);
+
+// Value i of p.
+Data packed_value(packed_column* p, size_t i);
+
+// The first of the first n rows of p, which are in sorted order, whose value
+// is at least value (or n if there is none).
+size_t packed_lower_bound(packed_column* p, size_t n, long int value);
+
+// Like scan_bitmap, refine_bitmap (with gather), select_values (with gather)
+// and gather_values (see kernels.h), over the values of p. scan_packed and
+// refine_packed look at the n rows from start on, bit i of bits standing for
+// row start + i.
+size_t scan_packed(const predicate* pred, packed_column* p, size_t start, size_t n,
+    uint64_t* bits);
+size_t refine_packed(const predicate* pred, packed_column* p, size_t start, size_t n,
+    uint64_t* bits);
+size_t select_packed(const predicate* pred, packed_column* p, Values pos,
+    DataType ptype, size_t n, Values out, DataType out_type);
+void gather_packed(packed_column* p, Values pos, DataType ptype, size_t n, Values dst);
+
+// The smallest (or, with max set, largest) value of p, and the sum of its
+// values into li. p must not be empty.
+Data packed_extreme(packed_column* p, int max);
+Data packed_sum(packed_column* p);
+
+#endif  // SRC_INCLUDE_PACKED_H_
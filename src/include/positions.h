@@ -0,0 +1,56 @@
+// positions.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Position vectors (the results of selects) come in three forms, told apart
+// by the type of the column or result holding them:
+//  : POS32/POS64, an array of count positions, in any order.
+//  : POSRANGE, the count positions starting at data.p64[0]. Selects over a
+//    clustered column produce these in constant space.
+//  : POSBITMAP, one bit for each of the data.p64[0] rows of the table, in
+//    words starting at data.p64[1]. Position p is in the vector if bit p % 64
+//    of word p / 64 is set, and count is the number of bits set. Selects that
+//    keep much of a table are smaller this way.
+// Ranges and bitmaps are always in increasing order.
+
+#ifndef SRC_INCLUDE_POSITIONS_H_
+#define SRC_INCLUDE_POSITIONS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+// Number of 64-bit words in a bitmap over n rows.
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+// Whether type is one of the position vector forms above.
+int is_positions(DataType type);
+
+// Allocates a range starting at start (the caller sets count).
+Values alloc_range(size_t start);
+
+// Allocates an empty bitmap over rows rows.
+Values alloc_bitmap(size_t rows);
+
+// The number of rows and the words of bitmap v.
+size_t bitmap_rows(Values v);
+uint64_t* bitmap_words(Values v);
+
+// Replaces the bitmap *v, which has count bits set, by whichever form holds
+// them best: a range if they are contiguous, an array if that is smaller,
+// otherwise the bitmap itself. Updates *type to match.
+void compact_bitmap(Values* v, DataType* type, size_t count);
+
+// Turns the position vector col into an array, for the code that needs to
+// get at its positions one by one (see get_pos). Does nothing to arrays.
+status expand_positions(column* col);
+
+// Stores in out the positions both in a (an positions of type at) and b (bn
+// positions of type bt), in increasing order. Positions are rows of a table
+// of rows rows. Neither a nor b is modified.
+status intersect_positions(Values a, DataType at, size_t an, Values b, DataType bt,
+    size_t bn, size_t rows, result* out);
+
+#endif  // SRC_INCLUDE_POSITIONS_H_
@@ -0,0 +1,109 @@
+// storage.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Backs column arrays with memory-mapped files from DATA_FOLDER. Files are
+// mapped privately, so pages fault in on first touch and any modification
+// stays copy-on-write in memory until the column is synced back to disk.
+
+#ifndef SRC_INCLUDE_STORAGE_H_
+#define SRC_INCLUDE_STORAGE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+/**
+ * A mapping is a whole file mapped into memory. Several columns can point
+ * into the same mapping (a column and its SortedIndex share a file), so we
+ * reference count it and only unmap once the last column lets go.
+ **/
+typedef struct mapping {
+    void* addr;
+    size_t length;
+    size_t refs;
+} mapping;
+
+// Maps the file fname copy-on-write into memory. Returns NULL if the file
+// cannot be mapped (missing, empty or mmap failure) in which case the caller
+// should fall back to reading the file. The caller holds one reference.
+mapping* map_file(const char* fname);
+
+// Drops a reference to m, unmapping the file once nobody points into it.
+void release_mapping(mapping* m);
+
+// Points col->data offset bytes into the mapping m. The column does not own
+// the memory, so it must be released with release_data.
+void attach_mapping(column* col, mapping* m, size_t offset);
+
+// Releases the storage behind col->data, unmapping or freeing as needed.
+// Leaves col->data NULL.
+void release_data(column* col);
+
+// Opens a temporary file next to fname to stage its new contents. The name of
+// the temporary file is written to tmpname (at least strlen(fname) + 5 bytes).
+// Returns NULL on failure.
+FILE* begin_write(const char* fname, char* tmpname);
+
+// Flushes and fsyncs the staged file fp, closes it and atomically renames it
+// over fname. Readers (and existing mappings) see either the old or the new
+// file, never a partially written one. On failure the staged file is removed.
+status commit_write(FILE* fp, const char* tmpname, const char* fname);
+
+// Discards a staged file without touching fname.
+void abort_write(FILE* fp, const char* tmpname);
+
+// Fsyncs the directory dir so that renames into it are durable.
+status sync_dir(const char* dir);
+
+// Reads length bytes at offset of the open file fp into buf through io_run,
+// so a large read has several requests in flight.
+status read_file_range(FILE* fp, void* buf, size_t length, uint64_t offset);
+
+// A piece of the contents of a staged file.
+typedef struct staged_segment {
+    const void* buf;
+    size_t length;
+    int owned;  // Whether buf is freed once written.
+} staged_segment;
+
+/**
+ * A file to be written by commit_files.
+ * - dirty, if set, points to the dirty flag of whatever the file holds. We
+ *       raise it again if the file does not make it to disk.
+ * - length, the total length of the segments.
+ **/
+typedef struct staged_file {
+    char* fname;
+    int* dirty;
+    staged_segment* segments;
+    size_t nsegments;
+    size_t length;
+} staged_file;
+
+// Files that are written out together. Starts out zeroed.
+typedef struct file_batch {
+    staged_file* files;
+    size_t count;
+    size_t size;
+} file_batch;
+
+// Starts staging new contents for fname in batch.
+void stage_file(file_batch* batch, const char* fname, int* dirty);
+
+// Appends length bytes at buf to the file staged last. buf must stay valid
+// until the batch is committed or aborted, which free it if owned.
+void stage_data(file_batch* batch, const void* buf, size_t length, int owned);
+
+// Writes every staged file to a temporary next to it, all in one io_run
+// (with O_DIRECT from aligned copies under IO_DIRECT), fsyncs them all and
+// renames each into place. Readers see either the old or the new file.
+// The batch is emptied either way; on failure, as with abort_files.
+status commit_files(file_batch* batch);
+
+// Drops everything staged in batch, raising the dirty flags again.
+void abort_files(file_batch* batch);
+
+#endif  // SRC_INCLUDE_STORAGE_H_
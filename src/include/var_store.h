@@ -7,16 +7,32 @@
 #ifndef SRC_INCLUDE_VAR_STORE_H_
 #define SRC_INCLUDE_VAR_STORE_H_
 
+#include "cs165_api.h"
+
+// Fills in the contents of a lazy resource.
+typedef status (*resource_loader)(void* value);
+
 // Looks up the pointer to the value for var. Returns NULL if not set.
+// A lazy resource is loaded the first time it is looked up; if that fails
+// we return NULL and try again on the next lookup.
 void* get_resource(const char* var);
 
 // Sets the var to the pointer for value. Failures occur only catastrophically.
 void set_resource(const char* var, void* value);
 
+// Sets the var to the pointer for value, whose contents are only filled in
+// by load the first time var is looked up.
+void set_lazy_resource(const char* var, void* value, resource_loader load);
+
 // Uses a separate pool to store user variables.
 void* get_var(const char* var);
 void set_var(const char* var, void* value);
 
+// Gives every user variable that is a view of base (see fetch) its own copy
+// of the values, so base can change or be freed. Does nothing if base has no
+// views.
+status detach_views(column* base);
+
 // Frees the user variable pool (used after a client disconnects)
 void clear_vars(void);
 void clear_resources(void);
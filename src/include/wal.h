@@ -0,0 +1,109 @@
+// wal.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Append-only write-ahead log for the statements that modify data (create,
+// relational_insert, load and index creation). Without it, everything since
+// the last shutdown is lost on a crash. A statement is logged once it has
+// run without error, in the order statements run, so replay never repeats
+// one that failed.
+//
+// The log is a sequence of segment files, DATA_FOLDER/<name>.<base_lsn>.wal,
+// each a wal_file_header followed by records:
+//
+//   wal_record_header | payload[length]
+//
+// Records are appended to an in-memory buffer and written out by a single
+// flusher thread. A statement is only acknowledged once wal_commit returns.
+// The server runs one statement of one client at a time, so each insert
+// waits for its own write + fdatasync; the flusher only lets a load keep
+// parsing rows while the ones before them are written out.
+//
+// Positions in the log are log sequence numbers (LSNs): the number of bytes
+// ever appended to the log (across checkpoints) up to the end of a record.
+// Each catalog records the LSN its contents reflect, so replay skips records
+// that already made it into the columnar files. A checkpoint starts a new
+// segment and, once the catalogs reflect everything before it, deletes the
+// older ones.
+
+#ifndef SRC_INCLUDE_WAL_H_
+#define SRC_INCLUDE_WAL_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+
+#define WAL_MAGIC 0x204C4157  // "WAL "
+#define WAL_VERSION 1
+
+// Size of each of the two in-memory log buffers. No record may be larger.
+#define WAL_BUFFER_SIZE (1 << 20)
+
+// Number of rows batched into each WAL_LOAD_ROWS record during a load.
+#define WAL_LOAD_BATCH 4096
+
+typedef enum WalRecordType {
+    WAL_COMMAND = 1,    // The text of a DSL statement.
+    WAL_LOAD_BEGIN,     // The column header of a load (db.tbl.col1,...).
+    WAL_LOAD_ROWS,      // A batch of rows of the current load as ints.
+    WAL_LOAD_END,       // The load completed; the table can be clustered.
+} WalRecordType;
+
+typedef struct wal_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_lsn;  // LSN of the first byte after this header.
+} wal_file_header;
+
+typedef struct wal_record_header {
+    uint32_t type;
+    uint32_t length;    // Bytes of payload following the header.
+    uint64_t checksum;  // Checksum of the payload.
+} wal_record_header;
+
+// Called for every complete record during replay. lsn is the LSN at the end
+// of the record.
+typedef void (*wal_apply)(WalRecordType type, const char* payload,
+    size_t length, uint64_t lsn);
+
+// Replays every segment of the log name (if any) through apply, in order.
+// Replay stops at the first torn or corrupt record of a segment, and never
+// applies part of a load that did not finish; the segment is truncated there
+// so new records follow the last complete statement.
+status wal_replay(const char* name, wal_apply apply);
+
+// Opens the last segment of the log name for appending and starts the
+// flusher. A new segment starts at start_lsn, which must be past every
+// catalog's LSN, if there is none or the catalogs are past its end.
+status wal_open(const char* name, uint64_t start_lsn);
+
+// Flushes everything appended so far, stops the flusher and closes the log.
+void wal_close(void);
+
+// Append a record to the log. Return the LSN to pass to wal_commit, or 0 if
+// the log is not open (e.g. while replaying).
+uint64_t wal_log_command(const char* command);
+uint64_t wal_log_load_begin(const char* header);
+uint64_t wal_log_load_rows(const int* values, size_t count);
+uint64_t wal_log_load_end(void);
+
+// Blocks until every record up to lsn is durable. lsn 0 returns immediately.
+status wal_commit(uint64_t lsn);
+
+// Returns the LSN at the end of the last appended record.
+uint64_t wal_lsn(void);
+
+// Starts a new segment for the records appended from now on, and returns
+// the LSN it starts at: the end of the log so far. Must be called with
+// execution_lock held, so that no statement is half logged. Records still
+// buffered for the previous segment are written out to it in the background.
+uint64_t wal_switch(void);
+
+// Called once every database has been synced up to lsn, which wal_switch
+// returned: deletes the segments that hold nothing after lsn. It takes no
+// locks, so statements keep running while it deletes the files.
+status wal_checkpoint(uint64_t lsn);
+
+#endif  // SRC_INCLUDE_WAL_H_
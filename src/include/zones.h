@@ -0,0 +1,82 @@
+// zones.h
+// CS165 Fall 2015
+//
+// Copyright 2015 <Luis Perez>
+//
+// Zone maps: the smallest and largest value of each block of ZONE_ROWS rows
+// of a column. A full scan only looks at the blocks whose range overlaps
+// what the select asks for, and takes blocks that lie entirely inside it
+// without looking at their values.
+//
+// Zones never exclude a value the block holds, but they may be wider than
+// it: inserting into the middle of a column shifts one value into each later
+// block, and we only widen the zones to take it in. Rebuilding (as
+// cluster_table does) tightens them again.
+
+#ifndef SRC_INCLUDE_ZONES_H_
+#define SRC_INCLUDE_ZONES_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cs165_api.h"
+#include "kernels.h"
+#include "storage.h"
+
+// Rows per block. A multiple of 64, so each block starts on a bitmap word.
+#ifndef ZONE_ROWS
+#define ZONE_ROWS 4096
+#endif
+
+// The number of blocks covering n rows.
+#define ZONE_BLOCKS(n) (((n) + ZONE_ROWS - 1) / ZONE_ROWS)
+
+/**
+ * zone_map
+ * - blocks, the number of blocks with a zone.
+ * - capacity, the number of blocks min and max have room for.
+ * - min/max, the bounds of the values of each block.
+ **/
+typedef struct zone_map {
+    size_t blocks;
+    size_t capacity;
+    int64_t* min;
+    int64_t* max;
+} zone_map;
+
+// Zones only speed up scans, so a column we cannot keep them for (out of
+// memory) is simply left without: the functions below then free them and
+// set col->zones to NULL.
+
+// Gives col an empty zone map. Only INT and LONGINT columns have zones;
+// anything else is left without.
+void create_zones(column* col);
+
+// Recomputes the zones of col (which must not be packed) from its values.
+void build_zones(column* col);
+
+// Takes in the value just inserted at row pos of col (which must not be
+// packed), along with the values it shifted into later blocks. Does nothing
+// to columns without zones.
+void update_zones(column* col, size_t pos);
+
+// Frees z and what it owns.
+void free_zones(zone_map* z);
+
+// Stages the zones of col in batch: a header of the rows they cover, the
+// number of blocks and the checksum of the bounds, then every min and every
+// max.
+void stage_zones(column* col, file_batch* batch);
+
+// Reads zones staged by stage_zones from fp into col. Returns 0 (leaving col
+// without zones) if fp does not hold zones for the rows col has.
+int read_zones(column* col, FILE* fp);
+
+// Evaluates p on the n rows of col from start on (the first row of a block)
+// like scan_packed, but only on the blocks the zones cannot decide. Sets
+// *count to how many rows qualified. Returns 0 (having done nothing) if col
+// has no zones or p did not compile to ranges.
+int zone_scan(const predicate* p, column* col, size_t start, size_t n, uint64_t* bits,
+    size_t* count);
+
+#endif  // SRC_INCLUDE_ZONES_H_
@@ -0,0 +1,328 @@
+// Copyright 2015 <Luis Perez>
+
+// For syscall() and O_DIRECT.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "include/common.h"
+#include "include/io.h"
+#include "include/utils.h"
+
+#if USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// A piece of a request small enough to be one transfer.
+typedef struct io_chunk {
+    io_request* req;
+    char* buf;
+    size_t length;
+    uint64_t offset;
+} io_chunk;
+
+// Set once we find out the kernel will not give us an io_uring.
+static int uring_unavailable = !USE_IO_URING;
+
+const char* io_backend(void) {
+    return (uring_unavailable) ? "threads" : "io_uring";
+}
+
+int io_create(const char* fname, int* direct) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(fname, flags | ((*direct) ? O_DIRECT : 0), 0644);
+    if (fd < 0 && *direct && errno == EINVAL) {
+        // Not every file system takes O_DIRECT (tmpfs for one).
+        *direct = 0;
+        fd = open(fname, flags, 0644);
+    }
+    return fd;
+}
+
+// Carries out whatever is left of c with plain system calls. Returns 1 on
+// success.
+static int run_chunk(io_chunk* c) {
+    if (c->req->op == IO_FSYNC) {
+        return fsync(c->req->fd) == 0;
+    }
+    while (c->length > 0) {
+        ssize_t n = (c->req->op == IO_READ) ?
+            pread(c->req->fd, c->buf, c->length, c->offset) :
+            pwrite(c->req->fd, c->buf, c->length, c->offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        c->buf += n;
+        c->length -= n;
+        c->offset += n;
+    }
+    return 1;
+}
+
+// Chunks being worked through by a pool of threads.
+typedef struct io_pool {
+    io_chunk* chunks;
+    size_t n;
+    size_t next;
+    int ok;
+    pthread_mutex_t lock;
+} io_pool;
+
+static void* run_pool(void* arg) {
+    io_pool* pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->n) {
+            break;
+        }
+        if (!run_chunk(&pool->chunks[i])) {
+            pthread_mutex_lock(&pool->lock);
+            pool->ok = 0;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+// Runs the chunks on up to IO_THREADS threads (including this one).
+static int run_threads(io_chunk* chunks, size_t n) {
+    io_pool pool;
+    pool.chunks = chunks;
+    pool.n = n;
+    pool.next = 0;
+    pool.ok = 1;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    size_t nthreads = (n < IO_THREADS) ? n : IO_THREADS;
+    pthread_t threads[nthreads + 1];
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, run_pool, &pool) == 0) {
+            started++;
+        }
+    }
+    run_pool(&pool);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    return pool.ok;
+}
+
+#if USE_IO_URING
+
+// The parts of an io_uring we use, as mapped from the kernel.
+typedef struct ring {
+    int fd;
+    unsigned entries;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} ring;
+
+static void ring_close(ring* r) {
+    if (r->sqes && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    close(r->fd);
+}
+
+// Sets up a ring. We make a new one for every batch, which costs a few
+// system calls but means a forked checkpoint never shares one with the
+// server. Returns 1 on success.
+static int ring_open(ring* r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(ring));
+    r->fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+    if (r->fd < 0) {
+        return 0;
+    }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = (r->cq_len > r->sq_len) ? r->cq_len : r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+        r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ptr :
+        mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            r->fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+        r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ring_close(r);
+        return 0;
+    }
+
+    char* sq = r->sq_ptr;
+    char* cq = r->cq_ptr;
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 1;
+}
+
+// Keeps the ring full until every chunk has completed. Anything the kernel
+// transfers short or refuses (say, an opcode it is too old for) we finish
+// with plain system calls. Returns 1 on success.
+static int run_ring(ring* r, io_chunk* chunks, size_t n) {
+    size_t next = 0;
+    size_t inflight = 0;
+    size_t done = 0;
+    unsigned submit = 0;  // Queued but not yet taken by the kernel.
+    int ok = 1;
+    while (done < n) {
+        unsigned tail = *r->sq_tail;
+        while (inflight < r->entries && next < n) {
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe* sqe = &r->sqes[idx];
+            io_chunk* c = &chunks[next];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->fd = c->req->fd;
+            sqe->user_data = next;
+            if (c->req->op == IO_FSYNC) {
+                sqe->opcode = IORING_OP_FSYNC;
+            }
+            else {
+                sqe->opcode = (c->req->op == IO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe->addr = (uint64_t) (uintptr_t) c->buf;
+                sqe->len = c->length;
+                sqe->off = c->offset;
+            }
+            r->sq_array[idx] = idx;
+            tail++;
+            next++;
+            inflight++;
+            submit++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        long ret = syscall(__NR_io_uring_enter, r->fd, submit, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            log_err("io_uring_enter failed: %s\n", strerror(errno));
+            return 0;
+        }
+        submit -= (ret > 0) ? (unsigned) ret : 0;
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            io_chunk* c = &chunks[cqe->user_data];
+            int res = cqe->res;
+            head++;
+            inflight--;
+            done++;
+            if (c->req->op != IO_FSYNC && res > 0) {
+                c->buf += res;
+                c->length -= res;
+                c->offset += res;
+            }
+            if ((res < 0 || c->length > 0) && !run_chunk(c)) {
+                ok = 0;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return ok;
+}
+
+#endif  // USE_IO_URING
+
+status io_run(io_request* reqs, size_t n) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+
+    // Cut everything into chunks.
+    size_t nchunks = 0;
+    for (size_t i = 0; i < n; i++) {
+        nchunks += (reqs[i].op == IO_FSYNC) ? 1 :
+            (reqs[i].length + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE;
+    }
+    if (nchunks == 0) {
+        return ret;
+    }
+    io_chunk* chunks = malloc(nchunks * sizeof(io_chunk));
+    if (!chunks) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory.\n";
+        return ret;
+    }
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (reqs[i].op == IO_FSYNC) {
+            chunks[c].req = &reqs[i];
+            chunks[c].buf = NULL;
+            chunks[c++].length = 0;
+            continue;
+        }
+        for (size_t start = 0; start < reqs[i].length; start += IO_CHUNK_SIZE) {
+            size_t length = reqs[i].length - start;
+            chunks[c].req = &reqs[i];
+            chunks[c].buf = (char*) reqs[i].buf + start;
+            chunks[c].length = (length < IO_CHUNK_SIZE) ? length : IO_CHUNK_SIZE;
+            chunks[c++].offset = reqs[i].offset + start;
+        }
+    }
+
+    int ok = -1;
+#if USE_IO_URING
+    if (!uring_unavailable) {
+        ring r;
+        if (ring_open(&r)) {
+            ok = run_ring(&r, chunks, c);
+            ring_close(&r);
+        }
+        else {
+            log_info("io_uring unavailable (%s), using threads.\n", strerror(errno));
+            uring_unavailable = 1;
+        }
+    }
+#endif
+    if (ok < 0) {
+        ok = run_threads(chunks, c);
+    }
+    free(chunks);
+
+    if (!ok) {
+        ret.code = ERROR;
+        ret.error_message = "I/O failed.\n";
+    }
+    return ret;
+}
@@ -0,0 +1,1078 @@
+// Copyright 2015 <Luis Perez>
+
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "include/alloc.h"
+#include "include/common.h"
+#include "include/kernels.h"
+#include "include/morsels.h"
+#include "include/positions.h"
+#include "include/utils.h"
+
+// Generates the kernels over values of type T, summed into an A. S is the
+// suffix of the generated names.
+#define DEFINE_VALUE_KERNELS(S, T, A)                                         \
+static size_t extreme_##S(const T* v, size_t n, int max) {                    \
+    size_t best = 0;                                                          \
+    for (size_t k = 1; k < n; k++) {                                          \
+        if ((max) ? v[k] > v[best] : v[k] < v[best]) {                        \
+            best = k;                                                         \
+        }                                                                     \
+    }                                                                         \
+    return best;                                                              \
+}                                                                             \
+                                                                              \
+static A sum_##S(const T* v, size_t n) {                                      \
+    A sum = 0;                                                                \
+    for (size_t k = 0; k < n; k++) {                                          \
+        sum += v[k];                                                          \
+    }                                                                         \
+    return sum;                                                               \
+}                                                                             \
+                                                                              \
+static void accumulate_##S(const T* v, size_t n, int sign, long int* out) {   \
+    for (size_t k = 0; k < n; k++) {                                          \
+        out[k] += sign * (long int) v[k];                                     \
+    }                                                                         \
+}
+
+// Generates check_S, which evaluates a chain of comparators on a single value
+// of type T (for chains too long to compile, see compile_predicate), and
+// gather_bitmap_S. Chains are left associative: "a | b & c" is "(a | b) & c".
+#define DEFINE_CHECK(S, T)                                                    \
+static inline int check_##S(comparator* f, T value) {                         \
+    int success = 1;                                                          \
+    Junction mode = AND;                                                      \
+    for (comparator* cur = f; cur; cur = cur->next_comparator) {             \
+        int match;                                                            \
+        switch ((int) cur->type) {                                            \
+            case LESS_THAN: match = value < cur->p_val; break;                \
+            case GREATER_THAN: match = value > cur->p_val; break;             \
+            case EQUAL: match = value == cur->p_val; break;                   \
+            case EQUAL | LESS_THAN: match = value <= cur->p_val; break;       \
+            case EQUAL | GREATER_THAN: match = value >= cur->p_val; break;    \
+            default:                                                          \
+                log_err("Unsupported comparator type!");                      \
+                return 0;                                                     \
+        }                                                                     \
+        if (mode == AND) {                                                    \
+            success = success && match;                                       \
+        }                                                                     \
+        else if (mode == OR) {                                                \
+            success = success || match;                                       \
+        }                                                                     \
+        mode = cur->mode;                                                     \
+    }                                                                         \
+    return success;                                                           \
+}                                                                             \
+                                                                              \
+static void gather_bitmap_##S(const T* src, const uint64_t* bits,             \
+    size_t rows, T* dst) {                                                    \
+    size_t k = 0;                                                             \
+    for (size_t w = 0; w < BITMAP_WORDS(rows); w++) {                         \
+        uint64_t word = bits[w];                                              \
+        while (word) {                                                        \
+            dst[k++] = src[w * 64 + __builtin_ctzll(word)];                   \
+            word &= word - 1;                                                 \
+        }                                                                     \
+    }                                                                         \
+}
+
+// Generates gather_S_PS, which copies the values of type T at positions of
+// type P. S and PS are the suffixes of T and P.
+#define DEFINE_POS_KERNELS(S, T, PS, P)                                       \
+static void gather_##S##_##PS(const T* src, const P* pos, size_t n, T* dst) { \
+    for (size_t k = 0; k < n; k++) {                                          \
+        dst[k] = src[pos[k]];                                                 \
+    }                                                                         \
+}
+
+DEFINE_VALUE_KERNELS(int, int, long int)
+DEFINE_VALUE_KERNELS(long, long int, long int)
+DEFINE_VALUE_KERNELS(double, double, double)
+DEFINE_VALUE_KERNELS(p32, uint32_t, long int)
+DEFINE_VALUE_KERNELS(p64, uint64_t, long int)
+
+DEFINE_CHECK(int, int)
+DEFINE_CHECK(long, long int)
+DEFINE_CHECK(double, double)
+
+DEFINE_POS_KERNELS(int, int, p32, uint32_t)
+DEFINE_POS_KERNELS(long, long int, p32, uint32_t)
+DEFINE_POS_KERNELS(double, double, p32, uint32_t)
+DEFINE_POS_KERNELS(int, int, p64, uint64_t)
+DEFINE_POS_KERNELS(long, long int, p64, uint64_t)
+DEFINE_POS_KERNELS(double, double, p64, uint64_t)
+
+// A chain of comparators compiles into the union of the ranges of values it
+// accepts (see compile_predicate). Each range is tested with no branch: an
+// integer x lies in [lo, lo + span] when (U) x - lo <= span, in the unsigned
+// type U as wide as x, and a double when it is at least its low bound and at
+// most its high one. The match kernels do 8 values (INT) or 4 (LONGINT,
+// DOUBLE) at a time with AVX2 where the CPU has it.
+
+#if SIMD_SCANS && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline int have_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+// For each of the 256 masks of 8 values, the indices of the set ones first
+// (one per byte), so that a shuffle moves the values that qualified to the
+// front. compress_lut64 does the same for the 16 masks of 4 values of 64
+// bits, as the indices of their two 32-bit halves.
+static uint64_t compress_lut[256];
+static uint64_t compress_lut64[16];
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+
+static void init_compress_lut(void) {
+    for (unsigned m = 0; m < 256; m++) {
+        uint64_t entry = 0;
+        uint64_t entry64 = 0;
+        int k = 0;
+        for (int j = 0; j < 8; j++) {
+            if (m & (1u << j)) {
+                entry |= (uint64_t) j << (8 * k);
+                if (m < 16) {
+                    entry64 |= (uint64_t) (2 * j | (2 * j + 1) << 8) << (16 * k);
+                }
+                k++;
+            }
+        }
+        compress_lut[m] = entry;
+        if (m < 16) {
+            compress_lut64[m] = entry64;
+        }
+    }
+}
+
+// The bits of the 64 values from v on that lie in [lo, lo + span]. Signed
+// compares stand in for unsigned ones by flipping the sign bit of both sides.
+AVX2 static uint64_t range_word_int_avx2(const int* v, uint32_t lo, uint32_t span) {
+    __m256i vlo = _mm256_set1_epi32((int) lo);
+    __m256i sign = _mm256_set1_epi32(INT_MIN);
+    __m256i limit = _mm256_set1_epi32((int) (span ^ 0x80000000u));
+    uint64_t word = 0;
+    for (int b = 0; b < 8; b++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (v + 8 * b));
+        __m256i above = _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_sub_epi32(x, vlo), sign), limit);
+        word |= (uint64_t) (~_mm256_movemask_ps(_mm256_castsi256_ps(above)) & 0xff) << (8 * b);
+    }
+    return word;
+}
+
+AVX2 static uint64_t range_word_long_avx2(const long int* v, uint64_t lo, uint64_t span) {
+    __m256i vlo = _mm256_set1_epi64x((long long) lo);
+    __m256i sign = _mm256_set1_epi64x(LLONG_MIN);
+    __m256i limit = _mm256_set1_epi64x((long long) (span ^ 0x8000000000000000ULL));
+    uint64_t word = 0;
+    for (int b = 0; b < 16; b++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (v + 4 * b));
+        __m256i above = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_sub_epi64(x, vlo), sign), limit);
+        word |= (uint64_t) (~_mm256_movemask_pd(_mm256_castsi256_pd(above)) & 0xf) << (4 * b);
+    }
+    return word;
+}
+
+AVX2 static uint64_t range_word_double_avx2(const double* v, double low, double high) {
+    __m256d vlow = _mm256_set1_pd(low);
+    __m256d vhigh = _mm256_set1_pd(high);
+    uint64_t word = 0;
+    for (int b = 0; b < 16; b++) {
+        __m256d x = _mm256_loadu_pd(v + 4 * b);
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(x, vlow, _CMP_GE_OQ),
+            _mm256_cmp_pd(x, vhigh, _CMP_LE_OQ));
+        word |= (uint64_t) _mm256_movemask_pd(in) << (4 * b);
+    }
+    return word;
+}
+
+// Stores the positions of the bits set in word, which covers 64 rows, at out
+// and returns how many it stored. Row j is at pos[j], or first + j when pos
+// is NULL. Each group of 8 rows is stored whole, with those that qualified
+// shuffled to the front, so out needs room for 64 positions.
+AVX2 static size_t emit_p32_avx2(uint64_t word, const uint32_t* pos, uint32_t first,
+    uint32_t* out) {
+    __m256i step = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t count = 0;
+    for (int b = 0; b < 8; b++) {
+        unsigned m = (word >> (8 * b)) & 0xff;
+        __m256i p = (pos) ? _mm256_loadu_si256((const __m256i*) (pos + 8 * b)) :
+            _mm256_add_epi32(_mm256_set1_epi32((int) (first + 8 * b)), step);
+        __m256i order = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &compress_lut[m]));
+        _mm256_storeu_si256((__m256i*) (out + count), _mm256_permutevar8x32_epi32(p, order));
+        count += __builtin_popcount(m);
+    }
+    return count;
+}
+
+// Like emit_p32_avx2, for 64-bit positions in groups of 4 rows.
+AVX2 static size_t emit_p64_avx2(uint64_t word, const uint64_t* pos, uint64_t first,
+    uint64_t* out) {
+    __m256i step = _mm256_setr_epi64x(0, 1, 2, 3);
+    size_t count = 0;
+    for (int b = 0; b < 16; b++) {
+        unsigned m = (word >> (4 * b)) & 0xf;
+        __m256i p = (pos) ? _mm256_loadu_si256((const __m256i*) (pos + 4 * b)) :
+            _mm256_add_epi64(_mm256_set1_epi64x((long long) (first + 4 * b)), step);
+        __m256i order = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*) &compress_lut64[m]));
+        _mm256_storeu_si256((__m256i*) (out + count), _mm256_permutevar8x32_epi32(p, order));
+        count += __builtin_popcount(m);
+    }
+    return count;
+}
+
+#else
+
+static inline int have_avx2(void) {
+    return 0;
+}
+
+static inline uint64_t range_word_int_avx2(const int* v, uint32_t lo, uint32_t span) {
+    (void) v;
+    (void) lo;
+    (void) span;
+    return 0;
+}
+
+static inline uint64_t range_word_long_avx2(const long int* v, uint64_t lo, uint64_t span) {
+    (void) v;
+    (void) lo;
+    (void) span;
+    return 0;
+}
+
+static inline uint64_t range_word_double_avx2(const double* v, double low, double high) {
+    (void) v;
+    (void) low;
+    (void) high;
+    return 0;
+}
+
+static inline size_t emit_p32_avx2(uint64_t word, const uint32_t* pos, uint32_t first,
+    uint32_t* out) {
+    (void) word;
+    (void) pos;
+    (void) first;
+    (void) out;
+    return 0;
+}
+
+static inline size_t emit_p64_avx2(uint64_t word, const uint64_t* pos, uint64_t first,
+    uint64_t* out) {
+    (void) word;
+    (void) pos;
+    (void) first;
+    (void) out;
+    return 0;
+}
+
+#endif
+
+// The bits of the n (at most 64) values from v on that lie in a range.
+#define DEFINE_RANGE_WORD(S, T, U)                                            \
+static inline uint64_t range_word_##S(const T* v, size_t n, U lo, U span) {   \
+    if (n == 64 && have_avx2()) {                                             \
+        return range_word_##S##_avx2(v, lo, span);                            \
+    }                                                                         \
+    uint64_t word = 0;                                                        \
+    for (size_t j = 0; j < n; j++) {                                          \
+        word |= (uint64_t) ((U) ((U) v[j] - lo) <= span) << j;                \
+    }                                                                         \
+    return word;                                                              \
+}
+
+DEFINE_RANGE_WORD(int, int, uint32_t)
+DEFINE_RANGE_WORD(long, long int, uint64_t)
+
+static inline uint64_t range_word_double(const double* v, size_t n, double low,
+    double high) {
+    if (n == 64 && have_avx2()) {
+        return range_word_double_avx2(v, low, high);
+    }
+    uint64_t word = 0;
+    for (size_t j = 0; j < n; j++) {
+        word |= (uint64_t) ((v[j] >= low) & (v[j] <= high)) << j;
+    }
+    return word;
+}
+
+// Generates the match kernels on values of type T (see predicate):
+// match_S_ranges tests the ranges of p, and match_S_chain (for chains that do
+// not compile) evaluates its comparators on each value. RANGE_WORD(v, n, p, r)
+// tests range r.
+#define DEFINE_MATCH(S, T, RANGE_WORD)                                        \
+static uint64_t match_##S##_ranges(const predicate* p, const void* v,         \
+    size_t n) {                                                               \
+    uint64_t word = 0;                                                        \
+    for (size_t r = 0; r < p->ranges; r++) {                                  \
+        word |= RANGE_WORD((const T*) v, n, p, r);                            \
+    }                                                                         \
+    return word;                                                              \
+}                                                                             \
+                                                                              \
+static uint64_t match_##S##_chain(const predicate* p, const void* v,          \
+    size_t n) {                                                               \
+    uint64_t word = 0;                                                        \
+    for (size_t j = 0; j < n; j++) {                                          \
+        word |= (uint64_t) check_##S(p->f, ((const T*) v)[j]) << j;           \
+    }                                                                         \
+    return word;                                                              \
+}
+
+#define INT_RANGE_WORD(v, n, p, r)                                            \
+    range_word_int(v, n, (uint32_t) (p)->lo[r], (uint32_t) (p)->span[r])
+#define LONG_RANGE_WORD(v, n, p, r)                                           \
+    range_word_long(v, n, (p)->lo[r], (p)->span[r])
+#define DOUBLE_RANGE_WORD(v, n, p, r)                                         \
+    range_word_double(v, n, (p)->low[r], (p)->high[r])
+
+DEFINE_MATCH(int, int, INT_RANGE_WORD)
+DEFINE_MATCH(long, long int, LONG_RANGE_WORD)
+DEFINE_MATCH(double, double, DOUBLE_RANGE_WORD)
+
+static uint64_t match_none(const predicate* p, const void* v, size_t n) {
+    (void) p;
+    (void) v;
+    (void) n;
+    return 0;
+}
+
+// The next double above d (with up set) or below it. d is finite.
+static double next_double(double d, int up) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if (d == 0) {
+        bits = (up) ? 1 : 0x8000000000000001ULL;
+    }
+    else if ((d > 0) == (up != 0)) {
+        bits++;
+    }
+    else {
+        bits--;
+    }
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline long int next_long(long int v, int up) {
+    return (up) ? v + 1 : v - 1;
+}
+
+// Generates compile_S, which computes the ranges [lo[k], hi[k]] of the values
+// in [min, max] of type T that f accepts, left associatively as check_S
+// does: AND intersects what the chain accepted so far with the range of the
+// next comparator, and OR adds it. lo and hi have room for PREDICATE_RANGES
+// ranges. Returns how many there are, or -1 if f needs more than that or
+// has a comparator we do not know. NEXT(v, up) is the value after (or
+// before) v.
+#define DEFINE_COMPILE(S, T, NEXT)                                            \
+static int compile_##S(comparator* f, T min, T max, T* lo, T* hi) {           \
+    int n = 1;                                                                \
+    Junction mode = AND;                                                      \
+    lo[0] = min;                                                              \
+    hi[0] = max;                                                              \
+    for (comparator* cur = f; cur; cur = cur->next_comparator) {             \
+        T v = (T) cur->p_val;                                                 \
+        T a = min;                                                            \
+        T b = max;                                                            \
+        switch ((int) cur->type) {                                            \
+            case LESS_THAN: b = NEXT(v, 0); break;                            \
+            case GREATER_THAN: a = NEXT(v, 1); break;                         \
+            case EQUAL: a = b = v; break;                                     \
+            case EQUAL | LESS_THAN: b = v; break;                             \
+            case EQUAL | GREATER_THAN: a = v; break;                          \
+            default: return -1;                                               \
+        }                                                                     \
+        a = (a < min) ? min : a;                                              \
+        b = (b > max) ? max : b;                                              \
+        if (mode == AND) {                                                    \
+            int kept = 0;                                                     \
+            for (int k = 0; k < n; k++) {                                     \
+                T l = (lo[k] > a) ? lo[k] : a;                                \
+                T h = (hi[k] < b) ? hi[k] : b;                                \
+                if (l <= h) {                                                 \
+                    lo[kept] = l;                                             \
+                    hi[kept++] = h;                                           \
+                }                                                             \
+            }                                                                 \
+            n = kept;                                                         \
+        }                                                                     \
+        else if (mode == OR && a <= b) {                                      \
+            /* The ranges [a, b] overlaps are folded into it. */              \
+            int kept = 0;                                                     \
+            for (int k = 0; k < n; k++) {                                     \
+                if (lo[k] <= b && a <= hi[k]) {                               \
+                    a = (lo[k] < a) ? lo[k] : a;                              \
+                    b = (hi[k] > b) ? hi[k] : b;                              \
+                }                                                             \
+                else {                                                        \
+                    lo[kept] = lo[k];                                         \
+                    hi[kept++] = hi[k];                                       \
+                }                                                             \
+            }                                                                 \
+            if (kept == PREDICATE_RANGES) {                                   \
+                return -1;                                                    \
+            }                                                                 \
+            lo[kept] = a;                                                     \
+            hi[kept++] = b;                                                   \
+            n = kept;                                                         \
+        }                                                                     \
+        mode = cur->mode;                                                     \
+    }                                                                         \
+    return n;                                                                 \
+}
+
+DEFINE_COMPILE(long, long int, next_long)
+DEFINE_COMPILE(double, double, next_double)
+
+// Stores the positions of the bits set in word at out and returns how many
+// it stored. Row j is at pos[j], or first + j when pos is NULL. This is the
+// branching kernel: it costs a branch for each position, so little when few
+// rows qualify but more the more do. The branch-free emit_PS_avx2 costs the
+// same however many do. Done one row at a time, with no AVX2, storing every
+// row would cost more than the branches it saves.
+#define DEFINE_EMIT(PS, P)                                                    \
+static inline size_t emit_##PS(uint64_t word, const P* pos, size_t first,      \
+    P* out) {                                                                 \
+    size_t count = 0;                                                         \
+    while (word) {                                                            \
+        size_t j = __builtin_ctzll(word);                                     \
+        word &= word - 1;                                                     \
+        out[count++] = (pos) ? pos[j] : (P) (first + j);                      \
+    }                                                                         \
+    return count;                                                             \
+}
+
+DEFINE_EMIT(p32, uint32_t)
+DEFINE_EMIT(p64, uint64_t)
+
+size_t type_width(DataType type) {
+    switch (type) {
+        case LONGINT:
+            return sizeof(long int);
+        case DOUBLE:
+            return sizeof(double);
+        case POS32:
+            return sizeof(uint32_t);
+        case POS64:
+        case POSRANGE:
+        case POSBITMAP:
+            return sizeof(uint64_t);
+        default:
+            return sizeof(int);
+    }
+}
+
+DataType pos_type(size_t rows) {
+    return (rows <= UINT32_MAX) ? POS32 : POS64;
+}
+
+Values alloc_values(DataType type, size_t n) {
+    Values v;
+    v.raw = column_alloc(n, type_width(type));
+    return v;
+}
+
+Values alloc_values_uninit(DataType type, size_t n) {
+    Values v;
+    v.raw = column_alloc_uninit(n, type_width(type));
+    return v;
+}
+
+Values values_at(Values v, DataType type, size_t i) {
+    Values at;
+    at.raw = (v.raw) ? (char*) v.raw + i * type_width(type) : NULL;
+    return at;
+}
+
+Data get_value(Values v, DataType type, size_t i) {
+    Data d;
+    d.li = 0;
+    if (type == LONGINT) {
+        d.li = v.li[i];
+    }
+    else if (type == DOUBLE) {
+        d.f = v.f[i];
+    }
+    else if (type == POS32 || type == POS64 || type == POSRANGE) {
+        d.li = (long int) get_pos(v, type, i);
+    }
+    else {
+        d.i = v.i[i];
+    }
+    return d;
+}
+
+void set_value(Values v, DataType type, size_t i, Data value) {
+    if (type == LONGINT) {
+        v.li[i] = value.li;
+    }
+    else if (type == DOUBLE) {
+        v.f[i] = value.f;
+    }
+    else if (type == POS32 || type == POS64) {
+        set_pos(v, type, i, (size_t) value.li);
+    }
+    else {
+        v.i[i] = value.i;
+    }
+}
+
+size_t get_pos(Values v, DataType type, size_t i) {
+    if (type == POSRANGE) {
+        return v.p64[0] + i;
+    }
+    return (type == POS64) ? (size_t) v.p64[i] : (size_t) v.p32[i];
+}
+
+void set_pos(Values v, DataType type, size_t i, size_t pos) {
+    if (type == POS64) {
+        v.p64[i] = pos;
+    }
+    else {
+        v.p32[i] = (uint32_t) pos;
+    }
+}
+
+// Copies the values of src at the rows set in bits (over rows rows) into dst.
+static void gather_bits(Values src, DataType type, const uint64_t* bits, size_t rows,
+    Values dst) {
+    if (type == LONGINT) {
+        gather_bitmap_long(src.li, bits, rows, dst.li);
+    }
+    else if (type == DOUBLE) {
+        gather_bitmap_double(src.f, bits, rows, dst.f);
+    }
+    else {
+        gather_bitmap_int(src.i, bits, rows, dst.i);
+    }
+}
+
+// gather_values on one thread.
+static void gather_rows(Values src, DataType type, Values pos, DataType ptype,
+    size_t n, Values dst) {
+    if (ptype == POSRANGE) {
+        memcpy(dst.raw, values_at(src, type, pos.p64[0]).raw, n * type_width(type));
+    }
+    else if (ptype == POSBITMAP) {
+        gather_bits(src, type, bitmap_words(pos), bitmap_rows(pos), dst);
+    }
+    else if (ptype == POS64) {
+        if (type == LONGINT) {
+            gather_long_p64(src.li, pos.p64, n, dst.li);
+        }
+        else if (type == DOUBLE) {
+            gather_double_p64(src.f, pos.p64, n, dst.f);
+        }
+        else {
+            gather_int_p64(src.i, pos.p64, n, dst.i);
+        }
+    }
+    else {
+        if (type == LONGINT) {
+            gather_long_p32(src.li, pos.p32, n, dst.li);
+        }
+        else if (type == DOUBLE) {
+            gather_double_p32(src.f, pos.p32, n, dst.f);
+        }
+        else {
+            gather_int_p32(src.i, pos.p32, n, dst.i);
+        }
+    }
+}
+
+void compile_predicate(comparator* f, DataType type, predicate* p) {
+    long int lo[PREDICATE_RANGES];
+    long int hi[PREDICATE_RANGES];
+    double low[PREDICATE_RANGES];
+    double high[PREDICATE_RANGES];
+    int n;
+
+    p->type = type;
+    p->f = f;
+    p->ranges = 0;
+    if (type == DOUBLE) {
+        n = compile_double(f, -INFINITY, INFINITY, low, high);
+        for (int k = 0; k < n; k++) {
+            p->low[k] = low[k];
+            p->high[k] = high[k];
+        }
+    }
+    else {
+        n = (type == LONGINT) ? compile_long(f, LONG_MIN, LONG_MAX, lo, hi) :
+            compile_long(f, INT_MIN, INT_MAX, lo, hi);
+        for (int k = 0; k < n; k++) {
+            p->lo[k] = (uint64_t) lo[k];
+            p->span[k] = (uint64_t) hi[k] - (uint64_t) lo[k];
+        }
+    }
+
+    if (n < 0) {
+        p->interpret = 1;
+        p->match = (type == LONGINT) ? match_long_chain :
+            (type == DOUBLE) ? match_double_chain : match_int_chain;
+        return;
+    }
+    p->interpret = 0;
+    p->ranges = n;
+    p->match = (n == 0) ? match_none : (type == LONGINT) ? match_long_ranges :
+        (type == DOUBLE) ? match_double_ranges : match_int_ranges;
+#if SIMD_SCANS && defined(__x86_64__) && defined(__GNUC__)
+    pthread_once(&compress_once, init_compress_lut);
+#endif
+}
+
+int predicate_value(const predicate* p, long int value) {
+    if (p->interpret) {
+        return check_long(p->f, value);
+    }
+    int match = 0;
+    for (size_t r = 0; r < p->ranges; r++) {
+        match |= (uint64_t) value - p->lo[r] <= p->span[r];
+    }
+    return match;
+}
+
+int predicate_covers(const predicate* p, long int min, long int max) {
+    if (p->interpret) {
+        return 0;
+    }
+    int overlaps = 0;
+    for (size_t r = 0; r < p->ranges; r++) {
+        long int lo = (long int) p->lo[r];
+        long int hi = (long int) (p->lo[r] + p->span[r]);
+        if (lo <= min && max <= hi) {
+            return 1;
+        }
+        overlaps |= lo <= max && min <= hi;
+    }
+    return (overlaps) ? 0 : -1;
+}
+
+// Selects store their positions SELECT_BLOCK rows at a time, each block with
+// the kernel that suits the share of rows that qualified in the one before
+// (see emit_p32 and emit_p32_avx2): the branching one below 1 in
+// BRANCHING_RATIO, the branch-free one otherwise. The first block, which
+// nothing is known about yet, samples the selectivity with the branch-free
+// one, whose cost does not depend on it. Without AVX2 every block branches.
+#define SELECT_BLOCK 1024
+#define BRANCHING_RATIO 32
+
+// The blocks each kernel stored, over all selects.
+static select_stats stats;
+
+// select_values on one thread.
+static size_t select_rows(const predicate* p, Values v, Values pos, DataType ptype,
+    size_t base, size_t n, int gather, Values out) {
+    // Room for 64 values of any type, gathered through pos.
+    uint64_t block[64];
+    size_t count = 0;
+    size_t branching_blocks = 0;
+    int branching = !have_avx2();
+    for (size_t first = 0; first < n; first += SELECT_BLOCK) {
+        size_t rows = (n - first < SELECT_BLOCK) ? n - first : SELECT_BLOCK;
+        size_t before = count;
+        for (size_t k = first; k < first + rows; k += 64) {
+            size_t end = (n - k < 64) ? n - k : 64;
+            Values at = values_at(pos, ptype, k);
+            Values values = values_at(v, p->type, k);
+            if (gather) {
+                values.raw = block;
+                gather_rows(v, p->type, at, ptype, end, values);
+            }
+            uint64_t word = p->match(p, values.raw, end);
+            if (!word) {
+                continue;
+            }
+            if (ptype == POS64) {
+                count += (branching || end < 64) ?
+                    emit_p64(word, at.p64, base + k, out.p64 + count) :
+                    emit_p64_avx2(word, at.p64, base + k, out.p64 + count);
+            }
+            else {
+                count += (branching || end < 64) ?
+                    emit_p32(word, at.p32, base + k, out.p32 + count) :
+                    emit_p32_avx2(word, at.p32, (uint32_t) (base + k), out.p32 + count);
+            }
+        }
+        branching_blocks += branching;
+        branching = !have_avx2() ||
+            (ADAPTIVE_SELECTS && (count - before) * BRANCHING_RATIO < rows);
+    }
+    size_t blocks = (n + SELECT_BLOCK - 1) / SELECT_BLOCK;
+    __atomic_fetch_add(&stats.branching, branching_blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.branch_free, blocks - branching_blocks, __ATOMIC_RELAXED);
+    return count;
+}
+
+select_stats get_select_stats(void) {
+    select_stats now;
+    now.branching = __atomic_load_n(&stats.branching, __ATOMIC_RELAXED);
+    now.branch_free = __atomic_load_n(&stats.branch_free, __ATOMIC_RELAXED);
+    return now;
+}
+
+// scan_bitmap on one thread.
+static size_t scan_rows(const predicate* p, Values v, size_t n, uint64_t* bits) {
+    size_t count = 0;
+    for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+        size_t end = (n - w * 64 < 64) ? n - w * 64 : 64;
+        bits[w] = p->match(p, values_at(v, p->type, w * 64).raw, end);
+        count += __builtin_popcountll(bits[w]);
+    }
+    return count;
+}
+
+// refine_bitmap on one thread.
+static size_t refine_rows(const predicate* p, Values v, uint64_t* bits, size_t rows,
+    int gather) {
+    size_t count = 0;
+    size_t k = 0;
+    for (size_t w = 0; w < BITMAP_WORDS(rows); w++) {
+        uint64_t word = bits[w];
+        uint64_t keep = 0;
+        if (word && gather) {
+            // The lines holding the word's values are read either way.
+            size_t end = (rows - w * 64 < 64) ? rows - w * 64 : 64;
+            keep = word & p->match(p, values_at(v, p->type, w * 64).raw, end);
+        }
+        else if (word) {
+            // The next values of v are those of the bits set in word, in
+            // order: bit t of match is the t-th of them.
+            size_t set = __builtin_popcountll(word);
+            uint64_t match = p->match(p, values_at(v, p->type, k).raw, set);
+            k += set;
+            while (word) {
+                int j = __builtin_ctzll(word);
+                word &= word - 1;
+                keep |= (match & 1) << j;
+                match >>= 1;
+            }
+        }
+        bits[w] = keep;
+        count += __builtin_popcountll(keep);
+    }
+    return count;
+}
+
+// extreme_values on one thread.
+static size_t extreme_rows(Values v, DataType type, size_t n, int max) {
+    switch (type) {
+        case LONGINT:
+            return extreme_long(v.li, n, max);
+        case DOUBLE:
+            return extreme_double(v.f, n, max);
+        case POS32:
+            return extreme_p32(v.p32, n, max);
+        case POS64:
+            return extreme_p64(v.p64, n, max);
+        default:
+            return extreme_int(v.i, n, max);
+    }
+}
+
+// sum_values on one thread.
+static Data sum_rows(Values v, DataType type, size_t n) {
+    Data d;
+    switch (type) {
+        case LONGINT:
+            d.li = sum_long(v.li, n);
+            break;
+        case DOUBLE:
+            d.f = sum_double(v.f, n);
+            break;
+        case POS32:
+            d.li = sum_p32(v.p32, n);
+            break;
+        case POS64:
+            d.li = sum_p64(v.p64, n);
+            break;
+        default:
+            d.li = sum_int(v.i, n);
+    }
+    return d;
+}
+
+// accumulate_values on one thread.
+static void accumulate_rows(Values v, DataType type, size_t n, int sign, long int* out) {
+    switch (type) {
+        case LONGINT:
+            accumulate_long(v.li, n, sign, out);
+            break;
+        case DOUBLE:
+            accumulate_double(v.f, n, sign, out);
+            break;
+        case POS32:
+            accumulate_p32(v.p32, n, sign, out);
+            break;
+        case POS64:
+            accumulate_p64(v.p64, n, sign, out);
+            break;
+        default:
+            accumulate_int(v.i, n, sign, out);
+    }
+}
+
+// A kernel run over morsels (see morsels.h). Morsel m works on its rows of
+// the inputs and leaves what it found in counts[m] or partial[m]. offsets[m]
+// is where its values start in the inputs (or outputs) that only hold the
+// rows a bitmap selects.
+typedef struct kernel_job {
+    const predicate* p;
+    Values v;
+    DataType type;
+    Values pos;
+    DataType ptype;
+    size_t base;
+    int gather;
+    int flag;
+    Values out;
+    uint64_t* bits;
+    long int* acc;
+    size_t* offsets;
+    size_t* counts;
+    Data* partial;
+} kernel_job;
+
+// Sets offsets[m] to the number of bits set in bits before morsel m.
+static void bit_offsets(const uint64_t* bits, size_t rows, size_t* offsets) {
+    size_t set = 0;
+    for (size_t m = 0; m < MORSELS(rows); m++) {
+        offsets[m] = set;
+        size_t end = (rows - m * MORSEL_ROWS < MORSEL_ROWS) ? rows : (m + 1) * MORSEL_ROWS;
+        for (size_t w = m * MORSEL_ROWS / 64; w < BITMAP_WORDS(end); w++) {
+            set += __builtin_popcountll(bits[w]);
+        }
+    }
+}
+
+static void select_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    Values v = (job->gather) ? job->v : values_at(job->v, job->p->type, start);
+    job->counts[m] = select_rows(job->p, v, values_at(job->pos, job->ptype, start),
+        job->ptype, job->base + start, end - start, job->gather,
+        values_at(job->out, job->ptype, start));
+}
+
+size_t select_values(const predicate* p, Values v, Values pos, DataType ptype,
+    size_t base, size_t n, int gather, Values out) {
+    kernel_job job;
+    job.counts = (parallel_rows(n)) ? malloc(MORSELS(n) * sizeof(size_t)) : NULL;
+    if (!job.counts) {
+        return select_rows(p, v, pos, ptype, base, n, gather, out);
+    }
+    job.p = p;
+    job.v = v;
+    job.pos = pos;
+    job.ptype = ptype;
+    job.base = base;
+    job.gather = gather;
+    job.out = out;
+    run_morsels(select_morsel, &job, n);
+
+    // Each morsel left its positions where its rows start. They go right
+    // after those of the morsel before.
+    size_t width = type_width(ptype);
+    size_t count = 0;
+    for (size_t m = 0; m < MORSELS(n); m++) {
+        memmove((char*) out.raw + count * width, (char*) out.raw + m * MORSEL_ROWS * width,
+            job.counts[m] * width);
+        count += job.counts[m];
+    }
+    free(job.counts);
+    return count;
+}
+
+static void scan_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    job->counts[m] = scan_rows(job->p, values_at(job->v, job->p->type, start),
+        end - start, job->bits + start / 64);
+}
+
+size_t scan_bitmap(const predicate* p, Values v, size_t n, uint64_t* bits) {
+    kernel_job job;
+    job.counts = (parallel_rows(n)) ? malloc(MORSELS(n) * sizeof(size_t)) : NULL;
+    if (!job.counts) {
+        return scan_rows(p, v, n, bits);
+    }
+    job.p = p;
+    job.v = v;
+    job.bits = bits;
+    run_morsels(scan_morsel, &job, n);
+    size_t count = 0;
+    for (size_t m = 0; m < MORSELS(n); m++) {
+        count += job.counts[m];
+    }
+    free(job.counts);
+    return count;
+}
+
+static void refine_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    Values v = values_at(job->v, job->p->type, (job->gather) ? start : job->offsets[m]);
+    job->counts[m] = refine_rows(job->p, v, job->bits + start / 64, end - start,
+        job->gather);
+}
+
+size_t refine_bitmap(const predicate* p, Values v, uint64_t* bits, size_t rows,
+    int gather) {
+    kernel_job job;
+    job.counts = (parallel_rows(rows)) ? malloc(2 * MORSELS(rows) * sizeof(size_t)) : NULL;
+    if (!job.counts) {
+        return refine_rows(p, v, bits, rows, gather);
+    }
+    job.offsets = job.counts + MORSELS(rows);
+    if (!gather) {
+        bit_offsets(bits, rows, job.offsets);
+    }
+    job.p = p;
+    job.v = v;
+    job.bits = bits;
+    job.gather = gather;
+    run_morsels(refine_morsel, &job, rows);
+    size_t count = 0;
+    for (size_t m = 0; m < MORSELS(rows); m++) {
+        count += job.counts[m];
+    }
+    free(job.counts);
+    return count;
+}
+
+static void gather_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    if (job->ptype == POSBITMAP) {
+        gather_bits(values_at(job->v, job->type, start), job->type,
+            bitmap_words(job->pos) + start / 64, end - start,
+            values_at(job->out, job->type, job->offsets[m]));
+    }
+    else if (job->ptype == POSRANGE) {
+        uint64_t first = job->pos.p64[0] + start;
+        Values at;
+        at.p64 = &first;
+        gather_rows(job->v, job->type, at, POSRANGE, end - start,
+            values_at(job->out, job->type, start));
+    }
+    else {
+        gather_rows(job->v, job->type, values_at(job->pos, job->ptype, start), job->ptype,
+            end - start, values_at(job->out, job->type, start));
+    }
+}
+
+void gather_values(Values src, DataType type, Values pos, DataType ptype,
+    size_t n, Values dst) {
+    // A bitmap is split by rows, and each morsel's values go after the
+    // values of the rows set before it.
+    size_t rows = (ptype == POSBITMAP) ? bitmap_rows(pos) : n;
+    kernel_job job;
+    job.offsets = (parallel_rows(rows)) ? malloc(MORSELS(rows) * sizeof(size_t)) : NULL;
+    if (!job.offsets) {
+        gather_rows(src, type, pos, ptype, n, dst);
+        return;
+    }
+    if (ptype == POSBITMAP) {
+        bit_offsets(bitmap_words(pos), rows, job.offsets);
+    }
+    job.v = src;
+    job.type = type;
+    job.pos = pos;
+    job.ptype = ptype;
+    job.out = dst;
+    run_morsels(gather_morsel, &job, rows);
+    free(job.offsets);
+}
+
+// Whether value a of v is smaller (or, with max set, larger) than value b.
+static int more_extreme(Values v, DataType type, size_t a, size_t b, int max) {
+    Data x = get_value(v, type, a);
+    Data y = get_value(v, type, b);
+    if (type == DOUBLE) {
+        return (max) ? x.f > y.f : x.f < y.f;
+    }
+    if (type == INT) {
+        return (max) ? x.i > y.i : x.i < y.i;
+    }
+    return (max) ? x.li > y.li : x.li < y.li;
+}
+
+static void extreme_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    job->counts[m] = start + extreme_rows(values_at(job->v, job->type, start), job->type,
+        end - start, job->flag);
+}
+
+size_t extreme_values(Values v, DataType type, size_t n, int max) {
+    kernel_job job;
+    job.counts = (parallel_rows(n)) ? malloc(MORSELS(n) * sizeof(size_t)) : NULL;
+    if (!job.counts) {
+        return extreme_rows(v, type, n, max);
+    }
+    job.v = v;
+    job.type = type;
+    job.flag = max;
+    run_morsels(extreme_morsel, &job, n);
+
+    // Going through the morsels in order keeps the first of equal values.
+    size_t best = job.counts[0];
+    for (size_t m = 1; m < MORSELS(n); m++) {
+        if (more_extreme(v, type, job.counts[m], best, max)) {
+            best = job.counts[m];
+        }
+    }
+    free(job.counts);
+    return best;
+}
+
+static void sum_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    job->partial[m] = sum_rows(values_at(job->v, job->type, start), job->type, end - start);
+}
+
+Data sum_values(Values v, DataType type, size_t n) {
+    kernel_job job;
+    job.partial = (parallel_rows(n)) ? malloc(MORSELS(n) * sizeof(Data)) : NULL;
+    if (!job.partial) {
+        return sum_rows(v, type, n);
+    }
+    job.v = v;
+    job.type = type;
+    run_morsels(sum_morsel, &job, n);
+    Data sum;
+    sum.li = 0;
+    if (type == DOUBLE) {
+        sum.f = 0;
+    }
+    for (size_t m = 0; m < MORSELS(n); m++) {
+        if (type == DOUBLE) {
+            sum.f += job.partial[m].f;
+        }
+        else {
+            sum.li += job.partial[m].li;
+        }
+    }
+    free(job.partial);
+    return sum;
+}
+
+static void accumulate_morsel(void* arg, size_t m, size_t start, size_t end) {
+    kernel_job* job = arg;
+    (void) m;
+    accumulate_rows(values_at(job->v, job->type, start), job->type, end - start, job->flag,
+        job->acc + start);
+}
+
+void accumulate_values(Values v, DataType type, size_t n, int sign, long int* out) {
+    kernel_job job;
+    job.v = v;
+    job.type = type;
+    job.flag = sign;
+    job.acc = out;
+    run_morsels(accumulate_morsel, &job, n);
+}
@@ -0,0 +1,152 @@
+// Copyright 2015 <Luis Perez>
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "include/common.h"
+#include "include/morsels.h"
+#include "include/utils.h"
+
+// The most worker threads we start, whatever the machine.
+#define MAX_WORKERS 256
+
+// The pool, and the job it is working on. A job is handed to every worker:
+// each takes morsels until there are none left and then checks out, and the
+// caller returns once all of them have.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;       // Wakes the workers for a new job.
+    pthread_cond_t done;       // Wakes the caller once they have checked out.
+    pthread_t threads[MAX_WORKERS];
+    size_t nthreads;
+    int busy;                  // Set while a job runs.
+    int stop;
+    unsigned long job;         // Counts the jobs handed out.
+    size_t active;             // Workers still on the current job.
+
+    morsel_fn fn;
+    void* arg;
+    size_t rows;
+    size_t morsels;
+    size_t next;               // The next morsel to take.
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// Takes morsels of the current job until there are none left.
+static void take_morsels(void) {
+    while (1) {
+        size_t m = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+        if (m >= pool.morsels) {
+            return;
+        }
+        size_t start = m * MORSEL_ROWS;
+        size_t end = (pool.rows - start < MORSEL_ROWS) ? pool.rows : start + MORSEL_ROWS;
+        pool.fn(pool.arg, m, start, end);
+    }
+}
+
+static void* run_worker(void* arg) {
+    (void) arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (!pool.stop && pool.job == seen) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        if (pool.stop) {
+            break;
+        }
+        seen = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+        take_morsels();
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// The threads that run morsels, the calling one included.
+static size_t scan_threads(void) {
+    long n = SCAN_THREADS;
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    return (n > MAX_WORKERS + 1) ? MAX_WORKERS + 1 : (size_t) n;
+}
+
+static void start_workers(void) {
+    size_t want = scan_threads() - 1;
+    pthread_mutex_lock(&pool.lock);
+    for (size_t i = 0; i < want; i++) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, run_worker, NULL) != 0) {
+            log_err("Could only start %zu of %zu scan workers.\n", pool.nthreads, want);
+            break;
+        }
+        pool.nthreads++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int parallel_rows(size_t n) {
+    if (n <= MORSEL_ROWS) {
+        return 0;
+    }
+    pthread_once(&pool_once, start_workers);
+    return pool.nthreads > 0;
+}
+
+void run_morsels(morsel_fn fn, void* arg, size_t n) {
+    int parallel = parallel_rows(n);
+    pthread_mutex_lock(&pool.lock);
+    if (!parallel || pool.busy || pool.stop) {
+        pthread_mutex_unlock(&pool.lock);
+        for (size_t m = 0; m < MORSELS(n); m++) {
+            size_t start = m * MORSEL_ROWS;
+            fn(arg, m, start, (n - start < MORSEL_ROWS) ? n : start + MORSEL_ROWS);
+        }
+        return;
+    }
+    pool.busy = 1;
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.rows = n;
+    pool.morsels = MORSELS(n);
+    pool.next = 0;
+    pool.active = pool.nthreads;
+    pool.job++;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    take_morsels();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void stop_workers(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (size_t i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+}
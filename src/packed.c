@@ -0,0 +1,636 @@
+// Copyright 2015 <Luis Perez>
+
+#include <string.h>
+
+#include "include/alloc.h"
+#include "include/common.h"
+#include "include/kernels.h"
+#include "include/packed.h"
+#include "include/positions.h"
+#include "include/storage.h"
+#include "include/utils.h"
+#include "include/var_store.h"
+
+// Slots in the hash table we count distinct values with (a power of two).
+#define DICT_SLOTS (2 * PACK_DICT_LIMIT)
+
+// The fewest bits that hold every number up to range (at least 1).
+static uint32_t bits_for(uint64_t range) {
+    uint32_t bits = 1;
+    while (bits < 64 && (range >> bits)) {
+        bits++;
+    }
+    return bits;
+}
+
+// Words holding n codes of bits bits, plus one so that reading the word
+// after the last code is always safe.
+static size_t code_words(size_t n, uint32_t bits) {
+    return (n * bits + 63) / 64 + 1;
+}
+
+// Code i of codes, which may straddle two words. Branch-free, so the loops
+// below stay tight.
+static inline uint64_t get_code(const uint64_t* codes, uint32_t bits, size_t i) {
+    size_t bit = i * bits;
+    const uint64_t* w = codes + bit / 64;
+    unsigned off = bit % 64;
+    uint64_t v = (w[0] >> off) | ((w[1] << 1) << (63 - off));
+    return v & (~0ULL >> (64 - bits));
+}
+
+static inline void put_code(uint64_t* codes, uint32_t bits, size_t i, uint64_t code) {
+    size_t bit = i * bits;
+    uint64_t* w = codes + bit / 64;
+    unsigned off = bit % 64;
+    w[0] |= code << off;
+    w[1] |= (code >> 1) >> (63 - off);
+}
+
+static inline int64_t plain_value(Values v, DataType type, size_t i) {
+    return (type == LONGINT) ? v.li[i] : v.i[i];
+}
+
+static inline void store_value(Values v, DataType type, size_t i, int64_t value) {
+    if (type == LONGINT) {
+        v.li[i] = value;
+    }
+    else {
+        v.i[i] = (int) value;
+    }
+}
+
+static Data to_data(DataType type, int64_t value) {
+    Data d;
+    d.li = 0;
+    if (type == LONGINT) {
+        d.li = value;
+    }
+    else {
+        d.i = (int) value;
+    }
+    return d;
+}
+
+// Open addressing table from the distinct values of a column to their code.
+typedef struct dict_builder {
+    int64_t* keys;
+    uint32_t* codes;
+    uint8_t* used;
+    size_t count;
+} dict_builder;
+
+static size_t find_slot(dict_builder* d, int64_t value) {
+    size_t slot = ((uint64_t) value * 0x9E3779B97F4A7C15ULL) >> 40;
+    slot &= DICT_SLOTS - 1;
+    while (d->used[slot] && d->keys[slot] != value) {
+        slot = (slot + 1) & (DICT_SLOTS - 1);
+    }
+    return slot;
+}
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Collects the distinct values of the n values in v into a sorted
+// dictionary, giving each its index as code. Returns 0 if there are more
+// than PACK_DICT_LIMIT of them (or we are out of memory).
+static int build_dict(Values v, DataType type, size_t n, dict_builder* d,
+    int64_t** dict) {
+    d->keys = malloc(DICT_SLOTS * sizeof(int64_t));
+    d->codes = malloc(DICT_SLOTS * sizeof(uint32_t));
+    d->used = calloc(DICT_SLOTS, sizeof(uint8_t));
+    d->count = 0;
+    *dict = NULL;
+    if (!d->keys || !d->codes || !d->used) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        int64_t value = plain_value(v, type, i);
+        size_t slot = find_slot(d, value);
+        if (!d->used[slot]) {
+            if (d->count == PACK_DICT_LIMIT) {
+                return 0;
+            }
+            d->used[slot] = 1;
+            d->keys[slot] = value;
+            d->count++;
+        }
+    }
+
+    *dict = malloc(d->count * sizeof(int64_t));
+    if (!*dict) {
+        return 0;
+    }
+    size_t k = 0;
+    for (size_t slot = 0; slot < DICT_SLOTS; slot++) {
+        if (d->used[slot]) {
+            (*dict)[k++] = d->keys[slot];
+        }
+    }
+    qsort(*dict, d->count, sizeof(int64_t), compare_int64);
+    for (size_t i = 0; i < d->count; i++) {
+        d->codes[find_slot(d, (*dict)[i])] = i;
+    }
+    return 1;
+}
+
+static void free_dict_builder(dict_builder* d) {
+    free(d->keys);
+    free(d->codes);
+    free(d->used);
+}
+
+status pack_column(column* col) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    if (!PACK_COLUMNS || col->packed || !col->data.raw || col->count == 0 ||
+        (col->type != INT && col->type != LONGINT)) {
+        return ret;
+    }
+
+    // One pass for the range and the number of runs.
+    Values v = col->data;
+    size_t n = col->count;
+    int64_t min = plain_value(v, col->type, 0);
+    int64_t max = min;
+    size_t runs = 1;
+    for (size_t i = 1; i < n; i++) {
+        int64_t value = plain_value(v, col->type, i);
+        min = (value < min) ? value : min;
+        max = (value > max) ? value : max;
+        runs += value != plain_value(v, col->type, i - 1);
+    }
+
+    // The size of each scheme, and the smallest.
+    size_t plain_size = n * type_width(col->type);
+    uint32_t for_bits = bits_for((uint64_t) max - (uint64_t) min);
+    size_t best_size = (for_bits < 64) ? code_words(n, for_bits) * sizeof(uint64_t) : SIZE_MAX;
+    PackScheme scheme = PACK_FOR;
+    if (runs * 2 * sizeof(int64_t) < best_size) {
+        best_size = runs * 2 * sizeof(int64_t);
+        scheme = PACK_RLE;
+    }
+    dict_builder builder;
+    int64_t* dict = NULL;
+    uint32_t dict_bits = 0;
+    if (build_dict(v, col->type, n, &builder, &dict)) {
+        dict_bits = bits_for(builder.count - 1);
+        size_t dict_size = builder.count * sizeof(int64_t) +
+            code_words(n, dict_bits) * sizeof(uint64_t);
+        if (dict_size < best_size) {
+            best_size = dict_size;
+            scheme = PACK_DICT;
+        }
+    }
+    if (best_size > plain_size / 2) {
+        free_dict_builder(&builder);
+        free(dict);
+        return ret;
+    }
+
+    packed_column* p = calloc(1, sizeof(packed_column));
+    if (!p) {
+        free_dict_builder(&builder);
+        free(dict);
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        return ret;
+    }
+    p->scheme = scheme;
+    p->type = col->type;
+    p->count = n;
+    if (scheme == PACK_RLE) {
+        p->entries = runs;
+        p->values = column_alloc(runs, sizeof(int64_t));
+        p->ends = column_alloc(runs, sizeof(uint64_t));
+        if (p->values && p->ends) {
+            size_t r = 0;
+            p->values[0] = plain_value(v, col->type, 0);
+            for (size_t i = 1; i < n; i++) {
+                int64_t value = plain_value(v, col->type, i);
+                if (value != p->values[r]) {
+                    p->ends[r++] = i;
+                    p->values[r] = value;
+                }
+            }
+            p->ends[r] = n;
+        }
+    }
+    else {
+        p->bits = (scheme == PACK_DICT) ? dict_bits : for_bits;
+        p->codes = column_alloc(code_words(n, p->bits), sizeof(uint64_t));
+        if (p->codes && scheme == PACK_DICT) {
+            p->entries = builder.count;
+            p->values = dict;
+            dict = NULL;
+            for (size_t i = 0; i < n; i++) {
+                put_code(p->codes, p->bits, i,
+                    builder.codes[find_slot(&builder, plain_value(v, col->type, i))]);
+            }
+        }
+        else if (p->codes) {
+            p->base = min;
+            for (size_t i = 0; i < n; i++) {
+                put_code(p->codes, p->bits, i, (uint64_t) plain_value(v, col->type, i) - min);
+            }
+        }
+    }
+    free_dict_builder(&builder);
+    free(dict);
+    if ((scheme == PACK_RLE && (!p->values || !p->ends)) ||
+        (scheme != PACK_RLE && (!p->codes || (scheme == PACK_DICT && !p->values)))) {
+        free_packed(p);
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        return ret;
+    }
+
+    // Views point into the data we are about to let go of.
+    ret = detach_views(col);
+    if (ret.code != OK) {
+        free_packed(p);
+        return ret;
+    }
+    release_data(col);
+    col->packed = p;
+    col->size = 0;
+    return ret;
+}
+
+void unpack_values(packed_column* p, Values data) {
+    if (p->scheme == PACK_RLE) {
+        size_t i = 0;
+        for (size_t r = 0; r < p->entries; r++) {
+            for (; i < p->ends[r]; i++) {
+                store_value(data, p->type, i, p->values[r]);
+            }
+        }
+    }
+    else if (p->scheme == PACK_DICT) {
+        for (size_t i = 0; i < p->count; i++) {
+            store_value(data, p->type, i, p->values[get_code(p->codes, p->bits, i)]);
+        }
+    }
+    else {
+        for (size_t i = 0; i < p->count; i++) {
+            store_value(data, p->type, i, p->base + get_code(p->codes, p->bits, i));
+        }
+    }
+}
+
+status unpack_column(column* col) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    if (!col->packed) {
+        return ret;
+    }
+    Values data = alloc_values_uninit(col->type, col->count);
+    if (!data.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
+    }
+    unpack_values(col->packed, data);
+    free_packed(col->packed);
+    col->packed = NULL;
+    col->data = data;
+    col->size = col->count;
+    return ret;
+}
+
+void free_packed(packed_column* p) {
+    if (p) {
+        free(p->values);
+        free(p->ends);
+        free(p->codes);
+        free(p);
+    }
+}
+
+size_t packed_size(packed_column* p) {
+    size_t size = sizeof(packed_column) + p->entries * sizeof(int64_t);
+    if (p->scheme == PACK_RLE) {
+        size += p->entries * sizeof(uint64_t);
+    }
+    else {
+        size += code_words(p->count, p->bits) * sizeof(uint64_t);
+    }
+    return size;
+}
+
+// Value i of p. For PACK_RLE, *run is where we start looking for the run of
+// i and is left at it, so walking rows in order costs O(1) each.
+static int64_t value_at(packed_column* p, size_t i, size_t* run) {
+    if (p->scheme == PACK_DICT) {
+        return p->values[get_code(p->codes, p->bits, i)];
+    }
+    else if (p->scheme == PACK_FOR) {
+        return p->base + get_code(p->codes, p->bits, i);
+    }
+    size_t r = *run;
+    if (r < p->entries && i < p->ends[r] && (r == 0 || i >= p->ends[r - 1])) {
+        return p->values[r];
+    }
+    if (r + 1 < p->entries && i >= p->ends[r] && i < p->ends[r + 1]) {
+        *run = r + 1;
+        return p->values[r + 1];
+    }
+
+    // The first run ending after i.
+    size_t lo = 0;
+    size_t hi = p->entries - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->ends[mid] <= i) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    *run = lo;
+    return p->values[lo];
+}
+
+Data packed_value(packed_column* p, size_t i) {
+    size_t run = 0;
+    return to_data(p->type, value_at(p, i, &run));
+}
+
+size_t packed_lower_bound(packed_column* p, size_t n, long int value) {
+    if (n == 0) {
+        return 0;
+    }
+    if (p->scheme == PACK_RLE) {
+        // Only the runs up to the one holding row n - 1 are in order.
+        size_t lo = 0;
+        size_t hi = 0;
+        value_at(p, n - 1, &hi);
+        hi++;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (p->values[mid] < value) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return (lo == 0) ? 0 : (p->ends[lo - 1] < n) ? p->ends[lo - 1] : n;
+    }
+    size_t run = 0;
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (value_at(p, mid, &run) < value) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Sets the bits of rows [start, end) in bits.
+static void set_rows(uint64_t* bits, size_t start, size_t end) {
+    for (size_t w = start / 64; w < BITMAP_WORDS(end); w++) {
+        size_t lo = w * 64;
+        size_t from = (start > lo) ? start - lo : 0;
+        size_t to = (end < lo + 64) ? end - lo : 64;
+        bits[w] |= (to - from == 64) ? ~0ULL : ((1ULL << (to - from)) - 1) << from;
+    }
+}
+
+// The kernels below fill whole 64-row words of the bitmap at a time, and
+// each row costs an unpack and a compare with no branches.
+
+// Sets bit i of out for each of the n codes from start on with
+// lo <= code start + i <= hi.
+static size_t scan_codes(const uint64_t* codes, uint32_t bits, size_t start,
+    size_t n, uint64_t lo, uint64_t hi, uint64_t* out) {
+    uint64_t span = hi - lo;
+    size_t count = 0;
+    for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+        size_t end = (n - w * 64 < 64) ? n - w * 64 : 64;
+        uint64_t word = 0;
+        for (size_t j = 0; j < end; j++) {
+            word |= (uint64_t) (get_code(codes, bits, start + w * 64 + j) - lo <= span) << j;
+        }
+        out[w] = word;
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+// Sets bit i of out for each of the n codes from start on whose entry in
+// table is set.
+static size_t scan_table(const uint64_t* codes, uint32_t bits, size_t start,
+    size_t n, const uint8_t* table, uint64_t* out) {
+    size_t count = 0;
+    for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+        size_t end = (n - w * 64 < 64) ? n - w * 64 : 64;
+        uint64_t word = 0;
+        for (size_t j = 0; j < end; j++) {
+            word |= (uint64_t) table[get_code(codes, bits, start + w * 64 + j)] << j;
+        }
+        out[w] = word;
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+size_t scan_packed(const predicate* pred, packed_column* p, size_t start, size_t n,
+    uint64_t* bits) {
+    size_t count = 0;
+    if (p->scheme == PACK_RLE) {
+        // Each run (or the part of it in the rows we scan) qualifies as a
+        // whole.
+        size_t end = start + n;
+        size_t run = 0;
+        if (n == 0) {
+            return 0;
+        }
+        value_at(p, start, &run);
+        for (size_t r = run; r < p->entries; r++) {
+            size_t from = (r == 0 || p->ends[r - 1] < start) ? start : p->ends[r - 1];
+            if (from >= end) {
+                break;
+            }
+            size_t to = (p->ends[r] < end) ? p->ends[r] : end;
+            if (predicate_value(pred, p->values[r])) {
+                set_rows(bits, from - start, to - start);
+                count += to - from;
+            }
+        }
+        return count;
+    }
+
+    if (p->scheme == PACK_DICT) {
+        // Each dictionary entry is checked once. The dictionary is sorted,
+        // so a range predicate leaves a range of codes.
+        uint8_t* table = malloc(p->entries);
+        if (!table) {
+            return 0;
+        }
+        size_t first = p->entries;
+        size_t last = 0;
+        size_t matches = 0;
+        for (size_t k = 0; k < p->entries; k++) {
+            table[k] = predicate_value(pred, p->values[k]);
+            if (table[k]) {
+                first = (k < first) ? k : first;
+                last = k;
+                matches++;
+            }
+        }
+        if (matches == 0) {
+            count = 0;
+        }
+        else if (last - first + 1 == matches) {
+            count = scan_codes(p->codes, p->bits, start, n, first, last, bits);
+        }
+        else {
+            count = scan_table(p->codes, p->bits, start, n, table, bits);
+        }
+        free(table);
+        return count;
+    }
+
+    // Frame of reference: bounds on values are bounds on codes.
+    if (!pred->interpret && pred->ranges == 0) {
+        return 0;
+    }
+    if (!pred->interpret && pred->ranges == 1) {
+        long int lo = (long int) pred->lo[0];
+        long int hi = (long int) (pred->lo[0] + pred->span[0]);
+        uint64_t max_code = ~0ULL >> (64 - p->bits);
+        if (hi < p->base) {
+            return 0;
+        }
+        uint64_t code_lo = (lo <= p->base) ? 0 : (uint64_t) lo - (uint64_t) p->base;
+        if (code_lo > max_code) {
+            return 0;
+        }
+        uint64_t code_hi = (uint64_t) hi - (uint64_t) p->base;
+        code_hi = (code_hi < max_code) ? code_hi : max_code;
+        return scan_codes(p->codes, p->bits, start, n, code_lo, code_hi, bits);
+    }
+    for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+        size_t end = (n - w * 64 < 64) ? n - w * 64 : 64;
+        uint64_t word = 0;
+        for (size_t j = 0; j < end; j++) {
+            word |= (uint64_t) predicate_value(pred,
+                p->base + get_code(p->codes, p->bits, start + w * 64 + j)) << j;
+        }
+        bits[w] = word;
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+size_t refine_packed(const predicate* pred, packed_column* p, size_t start, size_t n,
+    uint64_t* bits) {
+    size_t count = 0;
+    size_t run = 0;
+    for (size_t w = 0; w < BITMAP_WORDS(n); w++) {
+        uint64_t word = bits[w];
+        uint64_t keep = 0;
+        while (word) {
+            int j = __builtin_ctzll(word);
+            word &= word - 1;
+            keep |= (uint64_t) predicate_value(pred,
+                value_at(p, start + w * 64 + j, &run)) << j;
+        }
+        bits[w] = keep;
+        count += __builtin_popcountll(keep);
+    }
+    return count;
+}
+
+size_t select_packed(const predicate* pred, packed_column* p, Values pos,
+    DataType ptype, size_t n, Values out, DataType out_type) {
+    size_t count = 0;
+    size_t run = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t i = get_pos(pos, ptype, k);
+        if (predicate_value(pred, value_at(p, i, &run))) {
+            set_pos(out, out_type, count++, i);
+        }
+    }
+    return count;
+}
+
+void gather_packed(packed_column* p, Values pos, DataType ptype, size_t n, Values dst) {
+    size_t run = 0;
+    if (ptype == POSBITMAP) {
+        const uint64_t* bits = bitmap_words(pos);
+        size_t k = 0;
+        for (size_t w = 0; w < BITMAP_WORDS(bitmap_rows(pos)); w++) {
+            uint64_t word = bits[w];
+            while (word) {
+                size_t i = w * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                store_value(dst, p->type, k++, value_at(p, i, &run));
+            }
+        }
+        return;
+    }
+    for (size_t k = 0; k < n; k++) {
+        store_value(dst, p->type, k, value_at(p, get_pos(pos, ptype, k), &run));
+    }
+}
+
+Data packed_extreme(packed_column* p, int max) {
+    // Every dictionary entry occurs, and they are sorted.
+    if (p->scheme == PACK_DICT) {
+        return to_data(p->type, p->values[(max) ? p->entries - 1 : 0]);
+    }
+    int64_t best;
+    if (p->scheme == PACK_RLE) {
+        best = p->values[0];
+        for (size_t r = 1; r < p->entries; r++) {
+            best = ((max) ? p->values[r] > best : p->values[r] < best) ? p->values[r] : best;
+        }
+        return to_data(p->type, best);
+    }
+    uint64_t code = get_code(p->codes, p->bits, 0);
+    for (size_t i = 1; i < p->count; i++) {
+        uint64_t c = get_code(p->codes, p->bits, i);
+        code = ((max) ? c > code : c < code) ? c : code;
+    }
+    return to_data(p->type, p->base + code);
+}
+
+Data packed_sum(packed_column* p) {
+    Data d;
+    d.li = 0;
+    if (p->scheme == PACK_RLE) {
+        size_t start = 0;
+        for (size_t r = 0; r < p->entries; r++) {
+            d.li += p->values[r] * (long int) (p->ends[r] - start);
+            start = p->ends[r];
+        }
+    }
+    else if (p->scheme == PACK_DICT) {
+        for (size_t i = 0; i < p->count; i++) {
+            d.li += p->values[get_code(p->codes, p->bits, i)];
+        }
+    }
+    else {
+        uint64_t codes = 0;
+        for (size_t i = 0; i < p->count; i++) {
+            codes += get_code(p->codes, p->bits, i);
+        }
+        d.li = p->base * (long int) p->count + (long int) codes;
+    }
+    return d;
+}
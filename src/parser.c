@@ -9,8 +9,13 @@
 
 #include "db.h"
 #include "include/b_tree.h"
+#include "include/checkpoint.h"
 #include "include/common.h"
+#include "include/kernels.h"
+#include "include/packed.h"
+#include "include/positions.h"
 #include "include/var_store.h"
+#include "include/wal.h"
 
 // Global column to store pointers to databases we've created/loaded etc.
 extern Storage databases;
@@ -122,6 +127,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
                     databases.data = realloc(databases.data, (2 * databases.count + 1) * sizeof(struct db*));
                 }
                 databases.data[databases.count++] = db1;
+                op->logged = 1;
                 ret.code = OK;
             }
         }
@@ -197,6 +203,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
                 }
                 else {
                     set_resource(full_name, tbl1);
+                    op->logged = 1;
                     ret.code = OK;
                 }
             }
@@ -279,6 +286,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
                         }
                         else {
                             col1->index->type = SORTED;
+                            col1->index->dirty = 1;
 
                             // We use a SortedIndex except we don't need to copy the data
                             // because we sort it in place.
@@ -301,7 +309,9 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
                         }
                         else {
                             col1->index->type = B_PLUS_TREE;
+                            col1->index->dirty = 1;
                             Node* root = calloc(1, sizeof(Node));
+                            init_tree(root);
                             col1->index->index = root;
                             // The table is clustered on this column
                             tbl1->cluster_column = col1;
@@ -316,6 +326,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
                         ret.error_message = "Index for column cannot be created.";
                     }
                     set_resource(full_name, col1);
+                    op->logged = 1;
                 }
             }
             else {
@@ -360,8 +371,9 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             ret.error_message = "Table does not exists!";
         }
         else {
-            // Now we need to create a query plan?
+            // Now we need to create a query plan? It is logged once it ran.
             op->type = INSERT;
+            op->logged = 1;
 
             // Add table
             op->tables = calloc(1, sizeof(struct table*));
@@ -386,8 +398,8 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
 
             // All others are set to null
             op->var_name = NULL;
-            op->pos1 = NULL;
-            op->pos2 = NULL;
+            op->pos1.raw = NULL;
+            op->pos2.raw = NULL;
             op->value2 = NULL;
             op->c = NULL;
             // NOTE: agg is not set?
@@ -438,7 +450,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             op->value1type = LONGINT;
         }
         else {
-            op->pos1 = NULL;
+            op->pos1.raw = NULL;
             op->value1 = NULL;
         }
 
@@ -469,7 +481,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             return ret;
         }
         op->columns[0] = col1;
-        op->pos2 = NULL;
+        op->pos2.raw = NULL;
         op->value2 = NULL;
 
         // Note agg is not set
@@ -587,6 +599,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         narray->type = r->type;
         narray->size = r->num_tuples;
         narray->count = r->num_tuples;
+        narray->base = r->base;
         set_var(op->var_name, narray);
 
         free(str_cpy);
@@ -623,24 +636,41 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             }
         }
 
-        // Find the minimum or maximum (ONLY SUPPORT INTEGERS)
+        // We read the vector value by value, so ranges and bitmaps become arrays.
+        ret = expand_positions(vec_val);
+        if (ret.code != OK) {
+            free(str_cpy);
+            return ret;
+        }
+
+        // Find the minimum or maximum, which has the type of the vector.
         // The below runs on an unsorted column with no indexes.
         Data* res = calloc(1, sizeof(Data));
-        if (!vec_val->index || !vec_val->index->index) {
-            *res = vec_val->data[0];
-            if (strcmp(fun_str, "min") == 0) {
-                for (size_t i = 0; i < vec_val->count; i++) {
-                    if (vec_val->data[i].i < res->i) {
-                        *res = vec_val->data[i];
-                    }
-                }
+        DataType type = vec_val->type;
+        if (vec_val->count == 0) {
+            // An empty vector has no extreme, so the result is empty too.
+            column* col = calloc(1, sizeof(struct column));
+            col->type = type;
+            set_var(val_str, col);
+            free(str_cpy);
+            free(res);
+            ret.code = OK;
+            return ret;
+        }
+        // The delta store of a cluster column (see merge_delta) is out of
+        // order, so then we look at every value.
+        if (!vec_val->index || !vec_val->index->index || vec_val->delta) {
+            int max = strcmp(fun_str, "max") == 0;
+            if (vec_val->packed && (max || strcmp(fun_str, "min") == 0)) {
+                *res = packed_extreme(vec_val->packed, max);
             }
-            else if (strcmp(fun_str, "max") == 0) {
-                for (size_t i = 0; i < vec_val->count; i++) {
-                    if (vec_val->data[i].i > res->i) {
-                        *res = vec_val->data[i];
-                    }
-                }
+            else if (strcmp(fun_str, "min") == 0) {
+                *res = get_value(vec_val->data, type,
+                    extreme_values(vec_val->data, type, vec_val->count, 0));
+            }
+            else if (max) {
+                *res = get_value(vec_val->data, type,
+                    extreme_values(vec_val->data, type, vec_val->count, 1));
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -657,11 +687,14 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             SortedIndex* idx = vec_val->index->index;
             if (strcmp(fun_str, "min") == 0) {
                 // Access the sorted data and return the first value.
-                *res = idx->data->data[0];
+                res->i = (idx->data->packed) ? packed_value(idx->data->packed, 0).i :
+                    idx->data->data.i[0];
             }
             else if (strcmp(fun_str, "max") == 0) {
                 // Access the sorted data and return the last value
-                *res = idx->data->data[idx->data->count - 1];
+                res->i = (idx->data->packed) ?
+                    packed_value(idx->data->packed, idx->data->count - 1).i :
+                    idx->data->data.i[idx->data->count - 1];
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -676,11 +709,11 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             Node* root = vec_val->index->index;
             if (strcmp(fun_str, "min") == 0) {
                 // Access the sorted data and return the first value.
-                *res = get_min_key(root);
+                res->i = get_min_key(root);
             }
             else if (strcmp(fun_str, "max") == 0) {
                 // Access the sorted data and return the last value
-                *res = get_max_key(root);
+                res->i = get_max_key(root);
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -703,13 +736,15 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
 
         // Store the result the a vector of length 1
         column* col = calloc(1, sizeof(struct column));
-        col->data = res;
-        col->type = INT;
+        col->data = alloc_values(type, 1);
+        set_value(col->data, type, 0, *res);
+        col->type = type;
         col->size = 1;
         col->count = 1;
         set_var(val_str, col);
 
         free(str_cpy);
+        free(res);
 
         ret.code = OK;
         return ret;
@@ -761,23 +796,42 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             }
         }
 
+        // We read the vectors value by value, so ranges and bitmaps become
+        // arrays and packed columns are unpacked.
+        ret = expand_positions(vec_val);
+        if (ret.code == OK) {
+            ret = unpack_column(vec_val);
+        }
+        if (ret.code == OK && vec_pos) {
+            ret = expand_positions(vec_pos);
+        }
+        if (ret.code != OK) {
+            free(str_cpy);
+            return ret;
+        }
+
         // Find the index of the minimum or maximum
         Data* res = calloc(1, sizeof(Data));
+        DataType type = vec_val->type;
+        if (vec_val->count == 0) {
+            // An empty vector has no extreme, so both results are empty too.
+            column* col = calloc(1, sizeof(struct column));
+            col->type = type;
+            set_var(val_str, col);
+            col = calloc(1, sizeof(struct column));
+            col->type = (vec_pos) ? vec_pos->type : pos_type(0);
+            set_var(pos_str, col);
+            free(str_cpy);
+            free(res);
+            ret.code = OK;
+            return ret;
+        }
         if (!vec_val->index || !vec_val->index->index) {
-            *res = vec_val->data[0];
             if (strcmp(fun_str, "min") == 0) {
-                for (size_t i = 0; i < vec_val->count; i++) {
-                    if (vec_val->data[i].i < res->i) {
-                        res->i = i;
-                    }
-                }
+                res->li = extreme_values(vec_val->data, type, vec_val->count, 0);
             }
             else if (strcmp(fun_str, "max") == 0) {
-                for (size_t i = 0; i < vec_val->count; i++) {
-                    if (vec_val->data[i].i > res->i) {
-                        res->i = i;
-                    }
-                }
+                res->li = extreme_values(vec_val->data, type, vec_val->count, 1);
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -793,10 +847,11 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         else if (vec_val->index->type == SORTED) {
             SortedIndex* idx = vec_val->index->index;
             if (strcmp(fun_str, "min") == 0) {
-                *res =  idx->pos->data[0];
+                res->li = get_pos(idx->pos->data, idx->pos->type, 0);
             }
             else if (strcmp(fun_str, "max") == 0) {
-                *res = idx->pos->data[idx->pos->count - 1];
+                res->li = get_pos(idx->pos->data, idx->pos->type,
+                    idx->pos->count - 1);
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -810,10 +865,10 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         else if (vec_val->index->type == B_PLUS_TREE) {
             Node* root = vec_val->index->index;
             if (strcmp(fun_str, "min") == 0) {
-                *res =  get_min_value(root);
+                res->li = get_min_value(root);
             }
             else if (strcmp(fun_str, "max") == 0) {
-                *res = get_max_value(root);
+                res->li = get_max_value(root);
             }
             else {
                 ret.error_message = "Unsupported operation.\n";
@@ -834,27 +889,28 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             return ret;
         }
 
-        // Store the value result
-        Data* value = calloc(1, sizeof(Data));
-        *value = vec_val->data[res->i];
-
-        // Store in an array of length 1
+        // Store the value result in an array of length 1
         column* col = calloc(1, sizeof(struct column));
-        col->data = value;
-        col->type = INT;
+        col->data = alloc_values(type, 1);
+        set_value(col->data, type, 0, get_value(vec_val->data, type, res->li));
+        col->type = type;
         col->size = 1;
         col->count = 1;
         set_var(val_str, col);
 
         // Determine index to store
+        DataType ptype = pos_type(vec_val->count);
         if (vec_pos) {
-            *res = vec_pos->data[res->i];
+            ptype = vec_pos->type;
+            res->li = get_pos(vec_pos->data, ptype, res->li);
         }
 
         // Store in an array of length 1
         col = calloc(1, sizeof(struct column));
-        col->data = res;
-        col->type = INT;
+        col->data = alloc_values(ptype, 1);
+        set_pos(col->data, ptype, 0, res->li);
+        free(res);
+        col->type = ptype;
         col->size = 1;
         col->count = 1;
         set_var(pos_str, col);
@@ -891,26 +947,15 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             }
         }
 
-        // Find the average
-        long int sum = 0.;
-        if (vec_val->type == LONGINT) {
-            for (size_t i = 0; i < vec_val->count; i++) {
-                sum += vec_val->data[i].li;
-            }
-        }
-        else if (vec_val->type == DOUBLE) {
-            for (size_t i = 0; i < vec_val->count; i++) {
-                sum += vec_val->data[i].f;
-            }
-
+        // We read the vector value by value, so ranges and bitmaps become arrays.
+        ret = expand_positions(vec_val);
+        if (ret.code != OK) {
+            free(str_cpy);
+            return ret;
         }
-        else if (vec_val->type == INT) {
-            for (size_t i = 0; i < vec_val->count; i++) {
-                sum += vec_val->data[i].i;
-            }
 
-        }
-        else {
+        // Find the average
+        if (vec_val->type != INT && vec_val->type != LONGINT && vec_val->type != DOUBLE) {
             log_err("Unsupported data type. %s: error in line %d\n",
                 __func__, __LINE__);
             ret.code = ERROR;
@@ -919,13 +964,16 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             return ret;
 
         }
-        Data* res = calloc(1, sizeof(Data));
-        res->f = (double) sum / ((double) vec_val->count);
+        Data sum = (vec_val->packed) ? packed_sum(vec_val->packed) :
+            sum_values(vec_val->data, vec_val->type, vec_val->count);
+        double* res = calloc(1, sizeof(double));
+        *res = ((vec_val->type == DOUBLE) ? sum.f : (double) sum.li) /
+            ((double) vec_val->count);
 
         // Size of vector is 1
         column* col = calloc(1, sizeof(struct column));
         // TODO: Figure out how to deal with these!
-        col->data = res;
+        col->data.f = res;
         col->type = DOUBLE;
         col->size = 1;
         col->count = 1;
@@ -976,6 +1024,23 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             }
         }
 
+        // We read the vectors value by value, so ranges and bitmaps become
+        // arrays and packed columns are unpacked.
+        ret = expand_positions(vec_val1);
+        if (ret.code == OK) {
+            ret = expand_positions(vec_val2);
+        }
+        if (ret.code == OK) {
+            ret = unpack_column(vec_val1);
+        }
+        if (ret.code == OK) {
+            ret = unpack_column(vec_val2);
+        }
+        if (ret.code != OK) {
+            free(str_cpy);
+            return ret;
+        }
+
         // Vectors must be the same size.
         if (vec_val1->count != vec_val2->count) {
             log_err("Vectors of different size: %d, %d",
@@ -990,20 +1055,18 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         column* res = calloc(1, sizeof(struct column));
         res->size = n;
         res->count = n;
-        res->data = calloc(res->size, sizeof(Data));
+        res->data = alloc_values(LONGINT, res->size);
         res->type = LONGINT;
 
         // Determine operation to be performed!
         // TODO (What would be really cool would be to do all of this lazily!)
         if (strcmp(fun_str, "sub") == 0) {
-            for (size_t i = 0; i < n; i++) {
-                res->data[i].li = (long int) vec_val1->data[i].i - (long int) vec_val2->data[i].i;
-            }
+            accumulate_values(vec_val1->data, vec_val1->type, n, 1, res->data.li);
+            accumulate_values(vec_val2->data, vec_val2->type, n, -1, res->data.li);
         }
         else if (strcmp(fun_str, "add") == 0) {
-            for (size_t i = 0; i < n; i++) {
-                res->data[i].li = (long int) vec_val1->data[i].i + (long int) vec_val2->data[i].i;
-            }
+            accumulate_values(vec_val1->data, vec_val1->type, n, 1, res->data.li);
+            accumulate_values(vec_val2->data, vec_val2->type, n, 1, res->data.li);
         }
         else {
             ret.error_message = "Unsupported operation.\n";
@@ -1032,7 +1095,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         // Set defaults to query plan.
         op->type = PRINT;
         op->tables = NULL;
-        op->pos2 = NULL;
+        op->pos2.raw = NULL;
         op->value1 = NULL;
         op->value2 = NULL;
         op->c = NULL;
@@ -1050,8 +1113,8 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         // Extract the first column!
         status ret;
         op->columns = calloc(ncols, sizeof(struct column*));
-        op->pos1 = calloc(1, sizeof(Data));
-        op->pos1->i = ncols;  // We override this to pass along the information  about ncols
+        op->pos1.i = calloc(1, sizeof(int));
+        op->pos1.i[0] = ncols;  // We override this to pass along the information  about ncols
         char* col_name = strtok(args, comma);
         column* col = get_resource(col_name);
         if (!col){
@@ -1073,6 +1136,9 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         for (int i = 1; i < ncols; i++) {
             col_name = strtok(NULL, comma);
             col = get_resource(col_name);
+            if (!col) {
+                col = get_var(col_name);
+            }
             if (!col) {
                 log_err("Variable %s not defined. %s: error at line %d\n",
                     col_name, __func__, __LINE__);
@@ -1207,6 +1273,7 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
             }
         }
 
+        op->logged = 1;
         ret.code = OK;
         free(str_cpy);
         return ret;
@@ -1220,46 +1287,48 @@ status parse_dsl(char* str, dsl* d, db_operator* op)
         ret.code = OK;
         return ret;
     }
+    else if (d->g == BATCH_QUERIES_COMMAND || d->g == BATCH_EXECUTE_COMMAND) {
+        // The server keeps the batch (see execute_db_operator).
+        status ret;
+        op->type = (d->g == BATCH_QUERIES_COMMAND) ? BATCH_QUERIES : BATCH_EXECUTE;
+        ret.code = OK;
+        return ret;
+    }
+    else if (d->g == SELECT_STATS_COMMAND) {
+        // The counts live with the select kernels (see execute_db_operator).
+        status ret;
+        op->type = SELECT_STATS;
+        ret.code = OK;
+        return ret;
+    }
     else if (d->g == SHUTDOWNCOMMAND) {
         status ret;
 
+        // We take over from the background checkpoints.
+        stop_checkpointer();
+        stop_warmup();
+
         if (changed) {
-            // Make our data directory if it doesn't already exist.
-            struct stat st = {0};
-            if (stat(DATA_FOLDER, &st) == -1) {
-                mkdir(DATA_FOLDER, 0700);
+            // Everything logged so far has been applied, so the databases
+            // we write out are current up to here, where a new segment of
+            // the log starts.
+            uint64_t lsn = wal_switch();
+            status s = sync_databases(lsn);
+            if (s.code != OK) {
+                return s;
             }
 
-            // Our metadata file needs to be overwritten
-            char filename[DEFAULT_ARRAY_SIZE];
-            sprintf(filename, "%s/%s.meta", DATA_FOLDER, SYSTEM_META_FILE);
-            FILE* mfile = fopen(filename, "w");
-            if (!mfile) {
-                log_err("Could not create metadata file %s for server.\n", filename);
-                ret.code = ERROR;
-                ret.error_message = "File creation failed.\n";
-                return ret;
+            // The log no longer needs anything up to lsn.
+            s = wal_checkpoint(lsn);
+            if (s.code != OK) {
+                log_err("Could not checkpoint the log.\n");
+                return s;
             }
 
-            // Write out the number of databases
-            fprintf(mfile, "%zu\n", databases.count);
-
+            // Free some data
             for (size_t i = 0; i < databases.count; i++) {
-                db* db = (struct db*)(databases.data[i]);
-                fprintf(mfile, "%s %zu\n", db->name, db->table_count);
-                status s = sync_db(db);
-                if (s.code != OK) {
-                    log_err("Unable to store database %s", db->name);
-                    fclose(mfile);
-                    return s;
-                }
-
-                // Free some data
-                free(db->name);
-                free(db->tables);
-                free(db);
+                free_db(databases.data[i]);
             }
-            fclose(mfile);
         }
 
         // Successfully persisted the data.
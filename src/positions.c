@@ -0,0 +1,216 @@
+// Copyright 2015 <Luis Perez>
+
+#include <string.h>
+
+#include "include/alloc.h"
+#include "include/kernels.h"
+#include "include/positions.h"
+#include "include/utils.h"
+
+int is_positions(DataType type) {
+    return type == POS32 || type == POS64 || type == POSRANGE || type == POSBITMAP;
+}
+
+Values alloc_range(size_t start) {
+    Values v;
+    v.p64 = malloc(sizeof(uint64_t));
+    if (v.p64) {
+        v.p64[0] = start;
+    }
+    return v;
+}
+
+Values alloc_bitmap(size_t rows) {
+    Values v;
+    v.p64 = column_alloc(1 + BITMAP_WORDS(rows), sizeof(uint64_t));
+    if (v.p64) {
+        v.p64[0] = rows;
+    }
+    return v;
+}
+
+size_t bitmap_rows(Values v) {
+    return v.p64[0];
+}
+
+uint64_t* bitmap_words(Values v) {
+    return v.p64 + 1;
+}
+
+// Writes the positions set in the nwords words of bits into out, of type
+// type, in increasing order.
+static void bitmap_to_array(const uint64_t* bits, size_t nwords, Values out, DataType type) {
+    size_t k = 0;
+    for (size_t w = 0; w < nwords; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            set_pos(out, type, k++, w * 64 + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+}
+
+void compact_bitmap(Values* v, DataType* type, size_t count) {
+    size_t rows = bitmap_rows(*v);
+    size_t nwords = BITMAP_WORDS(rows);
+    uint64_t* bits = bitmap_words(*v);
+
+    // An empty vector is an empty range. We never hand out a NULL array,
+    // which would read as no positions at all.
+    Values compact;
+    if (count == 0) {
+        compact = alloc_range(0);
+        if (compact.raw) {
+            free(v->raw);
+            *v = compact;
+            *type = POSRANGE;
+        }
+        return;
+    }
+
+    size_t first = 0;
+    while (!bits[first]) {
+        first++;
+    }
+    size_t last = nwords - 1;
+    while (!bits[last]) {
+        last--;
+    }
+    first = first * 64 + __builtin_ctzll(bits[first]);
+    last = last * 64 + 63 - __builtin_clzll(bits[last]);
+    if (last - first + 1 == count) {
+        compact = alloc_range(first);
+        if (compact.raw) {
+            free(v->raw);
+            *v = compact;
+            *type = POSRANGE;
+        }
+        return;
+    }
+
+    DataType array_type = pos_type(rows);
+    if (count * type_width(array_type) < nwords * sizeof(uint64_t)) {
+        compact = alloc_values_uninit(array_type, count);
+        if (compact.raw) {
+            bitmap_to_array(bits, nwords, compact, array_type);
+            free(v->raw);
+            *v = compact;
+            *type = array_type;
+        }
+    }
+}
+
+status expand_positions(column* col) {
+    status ret;
+    ret.code = OK;
+    if (col->type != POSRANGE && col->type != POSBITMAP) {
+        return ret;
+    }
+
+    // Ranges never go past the end of their table.
+    size_t rows = (col->type == POSRANGE) ? col->data.p64[0] + col->count :
+        bitmap_rows(col->data);
+    DataType type = pos_type(rows);
+    Values v = alloc_values_uninit(type, (col->count) ? col->count : 1);
+    if (!v.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+        return ret;
+    }
+    if (col->type == POSRANGE) {
+        for (size_t i = 0; i < col->count; i++) {
+            set_pos(v, type, i, col->data.p64[0] + i);
+        }
+    }
+    else {
+        bitmap_to_array(bitmap_words(col->data), BITMAP_WORDS(rows), v, type);
+    }
+    free(col->data.raw);
+    col->data = v;
+    col->type = type;
+    col->size = col->count;
+    return ret;
+}
+
+// Sets the bits of the n positions in v (of any form) in bits, or clears
+// every other bit if mask is set.
+static void mark_positions(Values v, DataType type, size_t n, uint64_t* bits,
+    size_t nwords, int mask) {
+    if (type == POSRANGE) {
+        size_t start = v.p64[0];
+        size_t end = start + n;
+        for (size_t w = 0; w < nwords; w++) {
+            size_t lo = w * 64;
+            uint64_t word = 0;
+            if (end > lo && start < lo + 64) {
+                size_t from = (start > lo) ? start - lo : 0;
+                size_t to = (end < lo + 64) ? end - lo : 64;
+                word = (to - from == 64) ? ~0ULL : ((1ULL << (to - from)) - 1) << from;
+            }
+            bits[w] = (mask) ? bits[w] & word : bits[w] | word;
+        }
+    }
+    else if (type == POSBITMAP) {
+        const uint64_t* other = bitmap_words(v);
+        for (size_t w = 0; w < nwords; w++) {
+            bits[w] = (mask) ? bits[w] & other[w] : bits[w] | other[w];
+        }
+    }
+    else if (!mask) {
+        for (size_t i = 0; i < n; i++) {
+            size_t p = get_pos(v, type, i);
+            bits[p / 64] |= 1ULL << (p % 64);
+        }
+    }
+    else {
+        // Masking by an array: keep only the bits it also has.
+        uint64_t* keep = column_alloc(nwords, sizeof(uint64_t));
+        for (size_t i = 0; keep && i < n; i++) {
+            size_t p = get_pos(v, type, i);
+            keep[p / 64] |= bits[p / 64] & (1ULL << (p % 64));
+        }
+        if (keep) {
+            memcpy(bits, keep, nwords * sizeof(uint64_t));
+            free(keep);
+        }
+    }
+}
+
+status intersect_positions(Values a, DataType at, size_t an, Values b, DataType bt,
+    size_t bn, size_t rows, result* out) {
+    status ret;
+    ret.code = OK;
+
+    // Two ranges meet in a range.
+    if (at == POSRANGE && bt == POSRANGE) {
+        size_t start = (a.p64[0] > b.p64[0]) ? a.p64[0] : b.p64[0];
+        size_t end = (a.p64[0] + an < b.p64[0] + bn) ? a.p64[0] + an : b.p64[0] + bn;
+        out->payload = alloc_range(start);
+        out->type = POSRANGE;
+        out->num_tuples = (end > start) ? end - start : 0;
+    }
+    // Otherwise we mark a in a bitmap, mask it by b and pick the best form.
+    else {
+        out->payload = alloc_bitmap(rows);
+        out->type = POSBITMAP;
+        if (out->payload.raw) {
+            uint64_t* bits = bitmap_words(out->payload);
+            size_t nwords = BITMAP_WORDS(rows);
+            mark_positions(a, at, an, bits, nwords, 0);
+            mark_positions(b, bt, bn, bits, nwords, 1);
+            size_t count = 0;
+            for (size_t w = 0; w < nwords; w++) {
+                count += __builtin_popcountll(bits[w]);
+            }
+            out->num_tuples = count;
+            compact_bitmap(&out->payload, &out->type, count);
+        }
+    }
+    if (!out->payload.raw) {
+        ret.code = ERROR;
+        ret.error_message = "Low on memory";
+        log_err(ret.error_message);
+    }
+    return ret;
+}
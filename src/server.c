@@ -16,18 +16,28 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
 
+#include "alloc.h"
+#include "catalog.h"
+#include "checkpoint.h"
 #include "common.h"
 #include "cs165_api.h"
+#include "db.h"
 #include "include/var_store.h"
+#include "kernels.h"
+#include "morsels.h"
 #include "message.h"
+#include "packed.h"
 #include "parser.h"
+#include "positions.h"
 #include "utils.h"
+#include "wal.h"
 
 #define DEFAULT_QUERY_BUFFER_SIZE 1024
 
@@ -64,25 +74,167 @@ db_operator* parse_command(message* recv_message, message* send_message) {
     return dbo;
 }
 
+// The selects queued since batch_queries(), which batch_execute() runs
+// together. Their variables are only set then.
+static struct {
+    int open;
+    db_operator** ops;
+    size_t count;
+    size_t capacity;
+} batch;
+
+// Stores what the select query produced in r as its variable, and frees
+// what the parser allocated for it.
+static void finish_select(db_operator* query, result* r) {
+    // The results payload is NEW! Now we can store it as an Array.
+    column* res = calloc(1, sizeof(struct column));
+    res->data = r->payload;
+    res->size = r->num_tuples;
+    res->count = r->num_tuples;
+    res->type = r->type;
+
+    // Add it to the var_map so we can access it later!
+    set_var(query->var_name, res);
+    free(query->var_name);
+
+    // Free everything we've malloced.
+    free(query->columns);
+    comparator* cur = query->c;
+    comparator* tmp;
+    while (cur) {
+        tmp = cur;
+        cur = cur->next_comparator;
+        free(tmp);
+    }
+}
+
+// Runs the select query on its own. Returns an error message, if any.
+static char* run_select(db_operator* query) {
+    char* ret = "";
+    result r;
+    r.payload = query->pos1;
+    r.type = query->pos1type;
+    r.num_tuples = (query->value1) ? (size_t) query->value1->li : query->columns[0]->count;
+
+    result* rp = &r;
+    status s = col_scan(query->c, query->columns[0], &rp);
+    if (s.code != OK) {
+        log_err("Column scan failed %s. %s: error in line %d\n",
+            s.error_message, __func__, __LINE__);
+        ret = s.error_message;
+    }
+    finish_select(query, &r);
+    return ret;
+}
+
+// Adds query to the batch. Returns 0 if we have no room for it.
+static int queue_select(db_operator* query) {
+    if (batch.count == batch.capacity) {
+        size_t capacity = (batch.capacity) ? 2 * batch.capacity : 16;
+        db_operator** ops = realloc(batch.ops, capacity * sizeof(db_operator*));
+        if (!ops) {
+            return 0;
+        }
+        batch.ops = ops;
+        batch.capacity = capacity;
+    }
+    batch.ops[batch.count++] = query;
+    return 1;
+}
+
+// Runs the selects of the batch, those over the same column in a single
+// shared scan (see batch_scan), and closes it.
+static char* execute_batch(void) {
+    char* ret = "";
+    comparator** f = malloc(batch.count * sizeof(comparator*));
+    result** r = malloc(batch.count * sizeof(result*));
+    result* results = calloc(batch.count, sizeof(result));
+    db_operator** ops = malloc(batch.count * sizeof(db_operator*));
+    for (size_t i = 0; i < batch.count; i++) {
+        if (!batch.ops[i]) {
+            continue;
+        }
+        if (!f || !r || !results || !ops) {
+            // We make do with a scan each.
+            char* s = run_select(batch.ops[i]);
+            ret = (*ret) ? ret : s;
+            free(batch.ops[i]);
+            continue;
+        }
+
+        // Every select over the same column as this one.
+        column* col = batch.ops[i]->columns[0];
+        size_t n = 0;
+        for (size_t j = i; j < batch.count; j++) {
+            if (batch.ops[j] && batch.ops[j]->columns[0] == col) {
+                ops[n] = batch.ops[j];
+                f[n] = ops[n]->c;
+                r[n] = &results[n];
+                r[n]->payload.raw = NULL;
+                r[n]->num_tuples = col->count;
+                batch.ops[j] = NULL;
+                n++;
+            }
+        }
+
+        status s = batch_scan(f, n, col, r);
+        if (s.code != OK) {
+            log_err("Batched scan failed %s. %s: error in line %d\n",
+                s.error_message, __func__, __LINE__);
+            ret = (*ret) ? ret : s.error_message;
+        }
+        for (size_t q = 0; q < n; q++) {
+            finish_select(ops[q], r[q]);
+            free(ops[q]);
+        }
+    }
+    free(f);
+    free(r);
+    free(results);
+    free(ops);
+    batch.count = 0;
+    batch.open = 0;
+    return ret;
+}
+
+// Drops whatever is left of the batch of a client that is gone.
+static void drop_batch(void) {
+    result none;
+    memset(&none, 0, sizeof(result));
+    for (size_t i = 0; i < batch.count; i++) {
+        finish_select(batch.ops[i], &none);
+        free(batch.ops[i]);
+    }
+    free(batch.ops);
+    batch.ops = NULL;
+    batch.count = batch.capacity = 0;
+    batch.open = 0;
+}
+
 /** execute_db_operator takes as input the db_operator and executes the query.
  * It should return the result (currently as a char*, although I'm not clear
  * on what the return type should be, maybe a result struct, and then have
  * a serialization into a string message).
+ * The caller owns, and must free, the string returned.
  **/
 char* execute_db_operator(db_operator* query) {
     if (!query){
-        return "Failed!";
+        return copystr("Failed!");
     }
 
     // Let's see what the query wants us to do!
+    // Messages are mostly static strings, but a print builds its own.
     char* ret = "";
+    char* printed = NULL;
     if (query->type == INSERT) {
         // Extract the table.
         table* tbl = query->tables[0];
 
-        // If we don't have a clustered column, we can just insert at the end.
-        size_t ipos = tbl->col[0]->count - 1;
-        if (tbl->cluster_column) {
+        // If we don't have a clustered column, we can just insert at the end,
+        // where no row moves and the secondary indexes stay valid. So can a
+        // clustered table, into its delta store (see merge_delta).
+        size_t ipos = tbl->col[0]->count;
+        if (tbl->cluster_column && !DELTA_STORE) {
             // Determine the position at which to insert based on clustering
             column* col = tbl->cluster_column;
             if (!col->index) {
@@ -111,57 +263,62 @@ char* execute_db_operator(db_operator* query) {
                 break;
             }
         }
+        if (tbl->cluster_column && DELTA_STORE && !*ret) {
+            status s = add_to_delta(tbl);
+            if (s.code != OK) {
+                ret = s.error_message;
+            }
+        }
 
         // We still need to free the stuff allocated by parse.
         free(query->tables);
         free(query->value1);
     }
     else if (query->type == SELECT) {
-        result* r = calloc(1, sizeof(struct result));
-        r->payload = query->pos1;
-        r->type = query->pos1type;
-        r->num_tuples = (query->value1) ? (size_t) query->value1->li : query->columns[0]->count;
-
-        status s = col_scan(query->c, query->columns[0], &r);
-        if (s.code != OK) {
-            log_err("Column scan failed %s. %s: error in line %d\n",
-                s.error_message, __func__, __LINE__);
-            ret = s.error_message;
+        // Selects over a whole column wait for the rest of their batch.
+        if (batch.open && !query->pos1.raw && queue_select(query)) {
+            return copystr(ret);
         }
 
-        // The results payload is NEW! Now we can store it as an Array.
-        column* res = calloc(1, sizeof(struct column));
-        res->data = r->payload;
-        res->size = r->num_tuples;
-        res->count = r->num_tuples;
-        res->type = r->type;
-
-        // Add it to the var_map so we can access it later!
-        set_var(query->var_name, res);
-        free(query->var_name);
-
-        // Free everything we've malloced.
-        free(query->columns);
-        comparator* cur = query->c;
-        comparator* tmp;
-        while (cur) {
-            tmp = cur;
-            cur = cur->next_comparator;
-            free(tmp);
+        ret = run_select(query);
+    }
+    else if (query->type == BATCH_QUERIES) {
+        batch.open = 1;
+    }
+    else if (query->type == BATCH_EXECUTE) {
+        ret = execute_batch();
+    }
+    else if (query->type == SELECT_STATS) {
+        // How the selects so far stored their positions (see select_values).
+        select_stats stats = get_select_stats();
+        ret = printed = calloc(2 * MAX_STRING_LENGTH, sizeof(char));
+        if (printed) {
+            sprintf(printed, "%zu,%zu", stats.branching, stats.branch_free);
+        }
+        else {
+            ret = "Low on memory";
         }
-        free(r);
     }
     else if (query->type == PRINT) {
 
         // Need to construct a string with the result
         size_t rows = query->columns[0]->count;
-        int ncols = query->pos1->i;
+        int ncols = query->pos1.i[0];
+
+        // We print value by value, so position vectors become arrays and
+        // packed columns are unpacked.
+        for (int col = 0; col < ncols; col++) {
+            if (expand_positions(query->columns[col]).code != OK ||
+                unpack_column(query->columns[col]).code != OK) {
+                log_err("Could not expand a column to print.\n");
+            }
+        }
 
         // We allocate space for the result based on upper bound estimate.
         // TODO(luisperez): Dynamically resize to avoid buffer overflow problems!
         char* res = calloc(1 + ((MAX_STRING_LENGTH * ncols) + 1) * rows, sizeof(char));
         res[0] = '\0';
-        ret = res; // Keep track of the start.
+        ret = printed = res; // Keep track of the start.
 
         column* column;
         for(size_t row = 0; row < rows; row++) {
@@ -170,13 +327,16 @@ char* execute_db_operator(db_operator* query) {
                 column = query->columns[col];
                 // Grab the value
                 if (column->type == LONGINT) {
-                    res += sprintf(res, "%ld,", column->data[row].li);
+                    res += sprintf(res, "%ld,", column->data.li[row]);
                 }
                 else if (column->type == DOUBLE) {
-                    res += sprintf(res, "%.12f,", column->data[row].f);
+                    res += sprintf(res, "%.12f,", column->data.f[row]);
                 }
                 else if (column->type == INT) {
-                    res += sprintf(res, "%d,", column->data[row].i);
+                    res += sprintf(res, "%d,", column->data.i[row]);
+                }
+                else if (column->type == POS32 || column->type == POS64) {
+                    res += sprintf(res, "%zu,", get_pos(column->data, column->type, row));
                 }
                 else {
                     log_err("Incompatible type!");
@@ -189,13 +349,16 @@ char* execute_db_operator(db_operator* query) {
             column = query->columns[ncols - 1];
             // Grab the value
             if (column->type == LONGINT) {
-                res += sprintf(res, "%ld\n", column->data[row].li);
+                res += sprintf(res, "%ld\n", column->data.li[row]);
             }
             else if (column->type == DOUBLE) {
-                res += sprintf(res, "%.12f\n", column->data[row].f);
+                res += sprintf(res, "%.12f\n", column->data.f[row]);
             }
             else if (column->type == INT) {
-                res += sprintf(res, "%d\n", column->data[row].i);
+                res += sprintf(res, "%d\n", column->data.i[row]);
+            }
+            else if (column->type == POS32 || column->type == POS64) {
+                res += sprintf(res, "%zu\n", get_pos(column->data, column->type, row));
             }
             else {
                 log_err("Incompatible type!");
@@ -210,80 +373,65 @@ char* execute_db_operator(db_operator* query) {
 
         // NEED TO FREE COLS AND POS1
         free(query->columns);
-        free(query->pos1);
+        free(query->pos1.raw);
     }
     else if (query->type == SHUTDOWN) {
         // We send a special message to the client to shutdown gracefully!
         ret = SHUTDOWN_MESSAGE;
     }
     free(query);
-    return ret;
+    return (printed) ? printed : copystr(ret);
 }
 
-// Load command executed, so synchronize with client and read incoming messages.
-void load_data(int client_socket, message* recv_message){
-    // Read the first line of the file (foo.t1.a,foo.t1.b) and get columns
-    int length = recv(client_socket, recv_message, sizeof(struct message), 0);
-    if (length <= 0) {
-        log_err("Client connection closed!\n");
-    }
+// A load in progress: the columns being loaded, in the order of the file.
+typedef struct load_state {
+    column** cols;
+    int ncol;
+} load_state;
 
-    char buffer[recv_message->length];
-    length = recv(client_socket, buffer, recv_message->length, 0);
-    buffer[recv_message->length] = '\0';
-
-    // Read the rest of the input line by line until payload TERMINATES.
+// Resolves the columns in the load header (foo.t1.a,foo.t1.b). Modifies header.
+status begin_load(char* header, load_state* load) {
+    status ret;
     // First, let's count how many columns we have
-    int ncol = 1;
-    int i = 0;
-    while (buffer[i] != '\0') {
-        if (buffer[i] == ',') {
-            ncol++;
+    load->ncol = 1;
+    for (int i = 0; header[i] != '\0'; i++) {
+        if (header[i] == ',') {
+            load->ncol++;
         }
-        i++;
     }
 
     // Now we can parse each col.
-    column** cols = calloc(sizeof(struct column*), ncol);
-    cols[0] = get_resource(strtok(buffer, ","));
-    if (!cols[0]) {
-        log_err("Resource not found. Column name invalid: %s.", buffer);
-        return;
-    }
-    for (int i = 1; i < ncol; i++) {
-        cols[i] = get_resource(strtok(NULL, ","));
-        if (!cols[i]) {
-            log_err("Resource not found.");
+    load->cols = calloc(sizeof(struct column*), load->ncol);
+    for (int i = 0; i < load->ncol; i++) {
+        load->cols[i] = get_resource(strtok((i == 0) ? header : NULL, ","));
+        if (!load->cols[i]) {
+            log_err("Resource not found. Column name invalid in load.\n");
+            free(load->cols);
+            ret.code = ERROR;
+            ret.error_message = "Resource not found.\n";
+            return ret;
         }
     }
+    ret.code = OK;
+    return ret;
+}
 
-    // Now we read line by line and insert into the database
-    while(recv(client_socket, recv_message, sizeof(message), 0) > 0) {
-        recv(client_socket, buffer, recv_message->length, 0);
-        buffer[recv_message->length] = '\0';
-
-        // Break out of loop if we received the EOF message
-        if (strcmp(buffer, TERMINATE_LOAD) == 0) {
-            log_info("Received termination signal from client. Load completed.");
-            break;
-        }
-        // Insert into respective columns
-        char* str = NULL;
-        for (int i = 0; i < ncol; i++){
-            str = strtok((i == 0) ? buffer : NULL, ",");
-            if (!str) {
-                log_err("Could not parse. Error in load.\n", buffer);
-            }
-            Data datum;
-            datum.i = atoi(str);
-            status s = insert(cols[i], datum);
-            if (s.code != OK) {
-                log_err("Could not insert value %s into column during load.", str);
-            }
+// Inserts a row of values (one per column) into the columns being loaded.
+void load_row(load_state* load, const int* values) {
+    for (int i = 0; i < load->ncol; i++) {
+        Data datum;
+        datum.i = values[i];
+        status s = insert(load->cols[i], datum);
+        if (s.code != OK) {
+            log_err("Could not insert value %d into column during load.", values[i]);
         }
     }
+}
 
+// Clusters and packs the table we loaded into and frees the load state.
+void finish_load(load_state* load) {
     // Let's extract the table name.
+    column** cols = load->cols;
     char* str_cpy = calloc(strlen(cols[0]->name) + 1, sizeof(char));
     strncpy(str_cpy, cols[0]->name, strlen(cols[0]->name) + 1);
 
@@ -301,13 +449,112 @@ void load_data(int client_socket, message* recv_message){
         return;
     }
 
-    // Let's cluster the table!
+    // Let's cluster the table, then keep its columns packed.
     (void) cluster_table(tbl);
+    for (size_t i = 0; i < tbl->col_count; i++) {
+        if (pack_column(tbl->col[i]).code != OK) {
+            log_err("Could not pack column %s.\n", tbl->col[i]->name);
+        }
+    }
 
     free(cols);
     free(str_cpy);
 }
 
+// Load command executed, so synchronize with client and read incoming messages.
+// Returns the log position to commit before acknowledging the load.
+uint64_t load_data(int client_socket, message* recv_message){
+    // Read the first line of the file (foo.t1.a,foo.t1.b) and get columns
+    int length = recv(client_socket, recv_message, sizeof(struct message), 0);
+    if (length <= 0) {
+        log_err("Client connection closed!\n");
+    }
+
+    // Rows can be longer than the header, so the buffer grows to fit each
+    // message as it arrives.
+    size_t size = recv_message->length + 1;
+    char* buffer = malloc(size);
+    if (!buffer) {
+        log_err("Low on memory. Could not load.\n");
+        return 0;
+    }
+    if (recv_all(client_socket, buffer, recv_message->length) != 0) {
+        log_err("Client connection closed!\n");
+    }
+    buffer[recv_message->length] = '\0';
+
+    // Keep the header for the log, begin_load tokenizes it.
+    char header[recv_message->length + 1];
+    strcpy(header, buffer);
+    load_state load;
+    if (begin_load(buffer, &load).code != OK) {
+        free(buffer);
+        return 0;
+    }
+    wal_log_load_begin(header);
+
+    // Rows are logged in batches; each batch has to fit in a log record.
+    size_t batch = (WAL_BUFFER_SIZE - sizeof(wal_record_header)) / (load.ncol * sizeof(int));
+    if (batch > WAL_LOAD_BATCH) {
+        batch = WAL_LOAD_BATCH;
+    }
+    int* rows = calloc(batch * load.ncol, sizeof(int));
+    size_t nrows = 0;
+
+    // Read the rest of the input line by line until payload TERMINATES.
+    while(recv(client_socket, recv_message, sizeof(message), 0) > 0) {
+        if (recv_message->length + 1 > size) {
+            char* grown = realloc(buffer, recv_message->length + 1);
+            if (!grown) {
+                log_err("Low on memory. Load incomplete.\n");
+                break;
+            }
+            buffer = grown;
+            size = recv_message->length + 1;
+        }
+        if (recv_all(client_socket, buffer, recv_message->length) != 0) {
+            log_err("Client connection closed!\n");
+            break;
+        }
+        buffer[recv_message->length] = '\0';
+
+        // Break out of loop if we received the EOF message
+        if (strcmp(buffer, TERMINATE_LOAD) == 0) {
+            log_info("Received termination signal from client. Load completed.");
+            break;
+        }
+        // Insert into respective columns
+        int* row = &rows[nrows * load.ncol];
+        char* str = NULL;
+        int i = 0;
+        for (; i < load.ncol; i++){
+            str = strtok((i == 0) ? buffer : NULL, ",");
+            if (!str) {
+                break;
+            }
+            row[i] = atoi(str);
+        }
+        // We skip rows with too few values rather than load half of them.
+        if (i < load.ncol) {
+            log_err("Could not parse. Skipping row in load.\n");
+            continue;
+        }
+        load_row(&load, row);
+        if (++nrows == batch) {
+            wal_log_load_rows(rows, nrows * load.ncol);
+            nrows = 0;
+        }
+    }
+    if (nrows > 0) {
+        wal_log_load_rows(rows, nrows * load.ncol);
+    }
+    free(rows);
+    free(buffer);
+
+    finish_load(&load);
+    return wal_log_load_end();
+}
+
 /**
  * handle_client(client_socket)
  * This is the execution routine after a client has connected.
@@ -347,56 +594,77 @@ int handle_client(int client_socket) {
         }
 
         if (!done) {
-            char recv_buffer[recv_message.length];
-            length = recv(client_socket, recv_buffer, recv_message.length,0);
+            char recv_buffer[recv_message.length + 1];
+            length = recv_all(client_socket, recv_buffer, recv_message.length);
             recv_message.payload = recv_buffer;
             recv_message.payload[recv_message.length] = '\0';
 
+            // Checkpoints must not see a statement half applied.
+            pthread_mutex_lock(&execution_lock);
+
             // 1. Parse command
             db_operator* query = parse_command(&recv_message, &send_message);
 
             // We have to special case LOAD! We just do a lot of logging on errors!
+            uint64_t lsn = 0;
+            int logged = query && query->logged;
             if (query && query->type == LOADFILE) {
                 changed = 1;
-                load_data(client_socket, &recv_message);
+                lsn = load_data(client_socket, &recv_message);
             }
 
             // 2. Handle request
             char* result = execute_db_operator(query);
             send_message.length = strlen(result);
 
+            // Only statements that ran without error are logged, so replay
+            // never sees one that failed.
+            if (logged && send_message.length == 0) {
+                lsn = wal_log_command(recv_message.payload);
+            }
+            pthread_mutex_unlock(&execution_lock);
+
+            // The statement may only be acknowledged once it is in the log.
+            if (wal_commit(lsn).code != OK) {
+                log_err("Could not commit statement to the log.\n");
+            }
+
             // 3. Send status of the received message (OK, UNKNOWN_QUERY, etc)
             if (send(client_socket, &(send_message), sizeof(struct message), 0) == -1) {
                 log_err("Failed to send message.");
+                free(result);
                 ret = -1;
                 break;
             }
 
-            // 4. Send response of request
-            if (send(client_socket, result, send_message.length, 0) == -1) {
+            // 4. Send response of request. The client does not wait for an
+            // empty one and may already have hung up.
+            if (send_message.length > 0 &&
+                send_all(client_socket, result, send_message.length) == -1) {
                 log_err("Failed to send message.");
+                free(result);
                 ret = -1;
                 break;
             }
 
             // If we sent a shutdown to the client, the server has persisted
             // and needs to exit.
-            if (strcmp(result, SHUTDOWN_MESSAGE) == 0) {
+            int shutdown = strcmp(result, SHUTDOWN_MESSAGE) == 0;
+
+            // Free the message
+            free(result);
+            if (shutdown) {
                 log_info("Client requested server shutdown. Closing socket %d!\n", client_socket);
                 ret = 1;
                 break;
             }
 
-            // Free the message
-            if (strlen(result) > 1) {
-                free(result);
-            }
-
         }
     } while (!done);
 
     log_info("Connection closed at socket %d!\n", client_socket);
     close(client_socket);
+    drop_batch();
 
     // Successfully closed connection to client with no errors and no requests
     // to shutdown.
@@ -449,33 +717,32 @@ int setup_server() {
 }
 
 
-// Function to load the metadata file from the server.
-// Returns True/False depending on whether we successfully loaded the persisted data.
+// Function to load the server catalog and the databases it lists.
 void load_server(void) {
-    // Open the metadata system file
+    // Map the system catalog
     char tmp[DEFAULT_QUERY_BUFFER_SIZE];
-    sprintf(tmp, "%s/%s.meta", DATA_FOLDER, SYSTEM_META_FILE);
-    FILE* mfile = fopen(tmp, "r");
-    if (!mfile) {
+    sprintf(tmp, "%s/%s.catalog", DATA_FOLDER, SYSTEM_META_FILE);
+    catalog cat;
+    if (access(tmp, F_OK) != 0) {
         log_info("No persisted data found.\n");
         return;
     }
-
-    // The first line tells us the number of databases
-    size_t ndbs = 0;
-    if (fscanf(mfile, "%zu\n", &ndbs) != 1) {
-        log_err("Unable to read metadata file.");
-        fclose(mfile);
+    status s = open_catalog(tmp, &cat);
+    if (s.code != OK) {
+        log_err("Unable to read system catalog. %s", s.error_message);
         return;
     }
 
+    // The header tells us the number of databases
+    size_t ndbs = cat.header->db_count;
+
     // Allocate space for the databases
     databases.count = ndbs;
     databases.size = ndbs;
     databases.data = calloc(sizeof(struct db*), ndbs);
     if (!databases.data) {
         log_err("Unable to allocate space for persisted data!");
-        fclose(mfile);
+        close_catalog(&cat);
         return;
     }
 
@@ -483,19 +750,13 @@ void load_server(void) {
     for (size_t i = 0; i < ndbs; i++) {
         db* db =  calloc(sizeof(struct db), 1);
         db->tables_available = 0;
+        db->name = copystr(cat.dbs[i].name);
 
-        // Store the name and table count
-        if (fscanf(mfile, "%s %zu\n", tmp, &db->table_count) != 2) {
-            log_err("Unable to read database metadata.");
-            return;
-        }
-        // Copy it to the database.
-        db->name = copystr(tmp);
-
-        sprintf(tmp, "%s/%s.meta", DATA_FOLDER, db->name);
+        sprintf(tmp, "%s/%s.catalog", DATA_FOLDER, db->name);
         status s = open_db(tmp, &db, LOAD);
         if (s.code != OK) {
             log_err("Unable to load db: %s\n", db->name);
+            close_catalog(&cat);
             return;
         }
 
@@ -506,9 +767,97 @@ void load_server(void) {
         set_resource(db->name, db);
     }
 
+    close_catalog(&cat);
     log_info("Successfully loaded persisted data!");
 }
 
+// Whether a logged insert or load into the table named at the start of name
+// (db.tbl...) is already reflected in the files we loaded for its database.
+int already_persisted(const char* name, uint64_t lsn) {
+    char db_name[DEFAULT_QUERY_BUFFER_SIZE];
+    size_t i = 0;
+    while (name[i] && name[i] != '.' && i < DEFAULT_QUERY_BUFFER_SIZE - 1) {
+        db_name[i] = name[i];
+        i++;
+    }
+    db_name[i] = '\0';
+    db* db = get_resource(db_name);
+    return db && lsn <= db->lsn;
+}
+
+// The load being replayed, if any, and whether it is already persisted.
+load_state replay_load;
+int replay_skip;
+
+// Re-executes a single log record during recovery.
+void replay_record(WalRecordType type, const char* payload, size_t length, uint64_t lsn) {
+    char text[length + 1];
+    memcpy(text, payload, length);
+    text[length] = '\0';
+
+    if (type == WAL_COMMAND) {
+        // Creating things is idempotent, inserting is not.
+        const char* args = strchr(text, '(');
+        if (strncmp(text, "relational_insert", strlen("relational_insert")) == 0 &&
+            args && already_persisted(args + 1, lsn)) {
+            return;
+        }
+        db_operator* dbo = calloc(1, sizeof(db_operator));
+        status s = parse_command_string(text, dsl_commands, dbo);
+        if (s.code != OK) {
+            log_err("Could not replay %s. %s", text, s.error_message);
+            free(dbo);
+            return;
+        }
+        free(execute_db_operator(dbo));
+    }
+    else if (type == WAL_LOAD_BEGIN) {
+        replay_skip = already_persisted(text, lsn) ||
+            begin_load(text, &replay_load).code != OK;
+        changed = changed || !replay_skip;
+    }
+    else if (type == WAL_LOAD_ROWS && !replay_skip) {
+        const int* values = (const int*) payload;
+        size_t count = length / sizeof(int);
+        for (size_t i = 0; i + replay_load.ncol <= count; i += replay_load.ncol) {
+            load_row(&replay_load, &values[i]);
+        }
+    }
+    else if (type == WAL_LOAD_END && !replay_skip) {
+        finish_load(&replay_load);
+    }
+}
+
+// Replays whatever was logged after the persisted data was written and then
+// opens the log for new statements. Must run after load_server.
+void recover_log(void) {
+    // Make our data directory if it doesn't already exist.
+    struct stat st = {0};
+    if (stat(DATA_FOLDER, &st) == -1) {
+        mkdir(DATA_FOLDER, 0700);
+    }
+
+    status s = wal_replay(SYSTEM_META_FILE, replay_record);
+    if (s.code != OK) {
+        log_err("Unable to replay the log. %s", s.error_message);
+        exit(1);
+    }
+
+    // New records must land after everything the catalogs already reflect.
+    uint64_t start = 0;
+    for (size_t i = 0; i < databases.count; i++) {
+        db* db = databases.data[i];
+        if (db->lsn > start) {
+            start = db->lsn;
+        }
+    }
+    s = wal_open(SYSTEM_META_FILE, start);
+    if (s.code != OK) {
+        log_err("Unable to open the log. %s", s.error_message);
+        exit(1);
+    }
+}
+
 // Currently this main will setup the socket and accept a single client.
 // After handling the client, it will exit.
 // You will need to extend this to handle multiple concurrent clients
@@ -523,12 +872,19 @@ int main(void)
     // No modification to the data have been made.
     changed = 0;
 
-    // Load persisted data!
-    load_server();
-
     // Populate the global dsl commands
     dsl_commands = dsl_commands_init();
 
+    // Load persisted data and anything logged since it was written!
+    load_server();
+    recover_log();
+    if (start_checkpointer().code != OK) {
+        exit(1);
+    }
+    if (start_warmup().code != OK) {
+        log_err("Continuing without warming up.\n");
+    }
+
     log_info("Waiting for a connection %d ...\n", server_socket);
 
     struct sockaddr_un remote;
@@ -545,6 +901,13 @@ int main(void)
         // Shutdown of server requested.
         int ret = handle_client(client_socket);
         if (ret == 1) {
+            alloc_stats stats = get_alloc_stats();
+            log_info("Allocated %zu column arrays (%zu bytes), %zu on huge pages (%zu bytes), "
+                "grew %zu without copying, %zu failed.\n", stats.allocations, stats.bytes,
+                stats.huge_allocations, stats.huge_bytes, stats.grows, stats.failures);
+            select_stats selects = get_select_stats();
+            log_info("Selects stored %zu blocks of positions branching, %zu branch-free.\n",
+                selects.branching, selects.branch_free);
             log_info("Shutdown!");
             break;
         }
@@ -558,6 +921,8 @@ int main(void)
         }
     }
 
+    stop_workers();
+    wal_close();
     return 0;
 }
 
@@ -0,0 +1,317 @@
+// Copyright 2015 <Luis Perez>
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "include/common.h"
+#include "include/io.h"
+#include "include/storage.h"
+#include "include/utils.h"
+
+mapping* map_file(const char* fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        log_err("Could not open %s for mapping.\n", fname);
+        return NULL;
+    }
+
+    // Nothing to map for empty files (mmap rejects a zero length).
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // MAP_PRIVATE gives us copy-on-write pages, so in-place updates (e.g.
+    // clustering) never reach the file until we explicitly sync it.
+    void* addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    // The mapping holds its own reference to the file.
+    close(fd);
+    if (addr == MAP_FAILED) {
+        log_err("Could not map %s. %s: line %d\n", fname, __func__, __LINE__);
+        return NULL;
+    }
+
+    mapping* m = calloc(1, sizeof(struct mapping));
+    m->addr = addr;
+    m->length = st.st_size;
+    m->refs = 1;
+    return m;
+}
+
+void release_mapping(mapping* m) {
+    if (--m->refs == 0) {
+        munmap(m->addr, m->length);
+        free(m);
+    }
+}
+
+void attach_mapping(column* col, mapping* m, size_t offset) {
+    col->data.raw = (char*) m->addr + offset;
+    col->map = m;
+    m->refs++;
+}
+
+void release_data(column* col) {
+    if (col->map) {
+        release_mapping(col->map);
+        col->map = NULL;
+    }
+    else {
+        free(col->data.raw);
+    }
+    col->data.raw = NULL;
+}
+
+FILE* begin_write(const char* fname, char* tmpname) {
+    sprintf(tmpname, "%s.tmp", fname);
+    FILE* fp = fopen(tmpname, "wb");
+    if (!fp) {
+        log_err("Could not open %s for writing.\n", tmpname);
+    }
+    return fp;
+}
+
+status commit_write(FILE* fp, const char* tmpname, const char* fname) {
+    status ret;
+    // The data has to be on disk before the rename makes it visible.
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        log_err("Could not flush %s.\n", tmpname);
+        abort_write(fp, tmpname);
+        ret.code = ERROR;
+        ret.error_message = "Could not flush file.\n";
+        return ret;
+    }
+    if (fclose(fp) != 0 || rename(tmpname, fname) != 0) {
+        log_err("Could not replace %s.\n", fname);
+        unlink(tmpname);
+        ret.code = ERROR;
+        ret.error_message = "Could not replace file.\n";
+        return ret;
+    }
+    ret.code = OK;
+    return ret;
+}
+
+void abort_write(FILE* fp, const char* tmpname) {
+    fclose(fp);
+    unlink(tmpname);
+}
+
+status sync_dir(const char* dir) {
+    status ret;
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        log_err("Could not sync directory %s.\n", dir);
+        if (fd >= 0) {
+            close(fd);
+        }
+        ret.code = ERROR;
+        ret.error_message = "Could not sync directory.\n";
+        return ret;
+    }
+    close(fd);
+    ret.code = OK;
+    return ret;
+}
+
+status read_file_range(FILE* fp, void* buf, size_t length, uint64_t offset) {
+    io_request req;
+    req.op = IO_READ;
+    req.fd = fileno(fp);
+    req.buf = buf;
+    req.length = length;
+    req.offset = offset;
+    return io_run(&req, 1);
+}
+
+void stage_file(file_batch* batch, const char* fname, int* dirty) {
+    if (batch->count == batch->size) {
+        batch->size = (batch->size) ? 2 * batch->size : 16;
+        batch->files = realloc(batch->files, batch->size * sizeof(staged_file));
+    }
+    staged_file* file = &batch->files[batch->count++];
+    file->fname = copystr(fname);
+    file->dirty = dirty;
+    file->segments = NULL;
+    file->nsegments = 0;
+    file->length = 0;
+}
+
+void stage_data(file_batch* batch, const void* buf, size_t length, int owned) {
+    staged_file* file = &batch->files[batch->count - 1];
+    file->segments = realloc(file->segments,
+        (file->nsegments + 1) * sizeof(staged_segment));
+    staged_segment* segment = &file->segments[file->nsegments++];
+    segment->buf = buf;
+    segment->length = length;
+    segment->owned = owned;
+    file->length += length;
+}
+
+// Frees what the batch holds. If failed, raises the dirty flags again.
+static void clear_files(file_batch* batch, int failed) {
+    for (size_t i = 0; i < batch->count; i++) {
+        staged_file* file = &batch->files[i];
+        if (failed && file->dirty) {
+            *file->dirty = 1;
+        }
+        for (size_t j = 0; j < file->nsegments; j++) {
+            if (file->segments[j].owned) {
+                free((void*) file->segments[j].buf);
+            }
+        }
+        free(file->segments);
+        free(file->fname);
+    }
+    free(batch->files);
+    batch->files = NULL;
+    batch->count = 0;
+    batch->size = 0;
+}
+
+void abort_files(file_batch* batch) {
+    clear_files(batch, 1);
+}
+
+status commit_files(file_batch* batch) {
+    status ret;
+    ret.code = OK;
+    ret.error_message = NULL;
+    size_t n = batch->count;
+    if (n == 0) {
+        return ret;
+    }
+
+    // One write per segment (or per file under O_DIRECT), then one fsync
+    // per file.
+    size_t nwrites = 0;
+    for (size_t i = 0; i < n; i++) {
+        nwrites += batch->files[i].nsegments;
+    }
+    io_request* reqs = calloc(nwrites + n, sizeof(io_request));
+    char** tmpnames = calloc(n, sizeof(char*));
+    void** aligned = calloc(n, sizeof(void*));
+    int* fds = malloc(n * sizeof(int));
+    int* direct = malloc(n * sizeof(int));
+    if (!reqs || !tmpnames || !aligned || !fds || !direct) {
+        free(reqs);
+        free(tmpnames);
+        free(aligned);
+        free(fds);
+        free(direct);
+        abort_files(batch);
+        ret.code = ERROR;
+        ret.error_message = "Low on memory.\n";
+        return ret;
+    }
+
+    size_t w = 0;
+    size_t opened = 0;
+    for (; opened < n; opened++) {
+        staged_file* file = &batch->files[opened];
+        tmpnames[opened] = malloc(strlen(file->fname) + 5);
+        sprintf(tmpnames[opened], "%s.tmp", file->fname);
+        direct[opened] = IO_DIRECT;
+        fds[opened] = io_create(tmpnames[opened], &direct[opened]);
+        if (fds[opened] < 0) {
+            log_err("Could not open %s for writing.\n", tmpnames[opened]);
+            free(tmpnames[opened]);
+            ret.code = ERROR;
+            ret.error_message = "Could not open file.\n";
+            break;
+        }
+
+        if (direct[opened]) {
+            // O_DIRECT wants aligned buffers and lengths, so we write a
+            // padded copy and cut the file back to size afterwards.
+            size_t padded = (file->length + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+            if (posix_memalign(&aligned[opened], IO_ALIGNMENT, padded + IO_ALIGNMENT) != 0) {
+                aligned[opened] = NULL;
+                opened++;
+                ret.code = ERROR;
+                ret.error_message = "Low on memory.\n";
+                break;
+            }
+            char* dest = aligned[opened];
+            for (size_t j = 0; j < file->nsegments; j++) {
+                memcpy(dest, file->segments[j].buf, file->segments[j].length);
+                dest += file->segments[j].length;
+            }
+            memset(dest, 0, padded - file->length);
+            reqs[w].op = IO_WRITE;
+            reqs[w].fd = fds[opened];
+            reqs[w].buf = aligned[opened];
+            reqs[w].length = padded;
+            reqs[w++].offset = 0;
+        }
+        else {
+            uint64_t offset = 0;
+            for (size_t j = 0; j < file->nsegments; j++) {
+                reqs[w].op = IO_WRITE;
+                reqs[w].fd = fds[opened];
+                reqs[w].buf = (void*) file->segments[j].buf;
+                reqs[w].length = file->segments[j].length;
+                reqs[w++].offset = offset;
+                offset += file->segments[j].length;
+            }
+        }
+    }
+
+    if (ret.code == OK) {
+        ret = io_run(reqs, w);
+    }
+    for (size_t i = 0; ret.code == OK && i < n; i++) {
+        if (direct[i] && ftruncate(fds[i], batch->files[i].length) != 0) {
+            ret.code = ERROR;
+            ret.error_message = "Could not truncate file.\n";
+        }
+    }
+
+    // The data has to be on disk before the renames make it visible.
+    if (ret.code == OK) {
+        for (size_t i = 0; i < n; i++) {
+            reqs[w + i].op = IO_FSYNC;
+            reqs[w + i].fd = fds[i];
+        }
+        ret = io_run(&reqs[w], n);
+    }
+    for (size_t i = 0; i < opened; i++) {
+        if (close(fds[i]) != 0 && ret.code == OK) {
+            ret.code = ERROR;
+            ret.error_message = "Could not close file.\n";
+        }
+        free(aligned[i]);
+    }
+    for (size_t i = 0; ret.code == OK && i < n; i++) {
+        if (rename(tmpnames[i], batch->files[i].fname) != 0) {
+            log_err("Could not replace %s.\n", batch->files[i].fname);
+            ret.code = ERROR;
+            ret.error_message = "Could not replace file.\n";
+        }
+    }
+    for (size_t i = 0; i < opened; i++) {
+        if (ret.code != OK) {
+            unlink(tmpnames[i]);
+        }
+        free(tmpnames[i]);
+    }
+    if (ret.code != OK) {
+        log_err("Could not write out %zu files. %s", n, ret.error_message);
+    }
+
+    clear_files(batch, ret.code != OK);
+    free(reqs);
+    free(tmpnames);
+    free(aligned);
+    free(fds);
+    free(direct);
+    return ret;
+}
@@ -1,219 +1,250 @@
-// Copyright (2015) - Luis Perez
-
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "utils.h"
-
-#define ANSI_COLOR_RED     "\x1b[31m"
-#define ANSI_COLOR_GREEN   "\x1b[32m"
-#define ANSI_COLOR_RESET   "\x1b[0m"
-
-void cs165_log(FILE* out, const char *format, ...) {
-#ifdef LOG
-    va_list v;
-    va_start(v, format);
-    vfprintf(out, format, v);
-    va_end(v);
-#else
-    (void) out;
-    (void) format;
-#endif
-}
-
-void log_err(const char *format, ...) {
-#ifdef LOG_ERR
-    va_list v;
-    va_start(v, format);
-    fprintf(stderr, ANSI_COLOR_RED);
-    vfprintf(stderr, format, v);
-    fprintf(stderr, ANSI_COLOR_RESET);
-    va_end(v);
-#else
-    (void) format;
-#endif
-}
-
-void log_info(const char *format, ...) {
-#ifdef LOG_INFO
-    va_list v;
-    va_start(v, format);
-    fprintf(stdout, ANSI_COLOR_GREEN);
-    vfprintf(stdout, format, v);
-    fprintf(stdout, ANSI_COLOR_RESET);
-    fflush(stdout);
-    va_end(v);
-#else
-    (void) format;
-#endif
-}
-
-void* resize(void* data, size_t osize, size_t nsize) {
-    assert(osize <= nsize);
-    void* ndata = calloc(nsize, sizeof(char));
-    memcpy(ndata, data, osize);
-    return ndata;
-}
-
-// Copies a string. Returns pointer to new string.
-char* copystr(const char* src) {
-    char* tmp = calloc(strlen(src) + 1, sizeof(char));
-    return strcpy(tmp, src);
-}
-
-size_t find_index(Data* array, size_t start, size_t end, Data el, size_t size) {
-    // In the case of an empty array, automatically return.
-    if (size <= 0 || end < start) {
-        return size;
-    }
-
-    // If only one element or if we've found the element.
-    size_t mid = (start + end) / 2;
-    if (start == end || el.i == array[mid].i) {
-        // We can insert here because they are equal.
-        if (array[start].i == el.i) {
-            return start;
-        }
-        // Search before until we hit bottom or find element smaller.
-        else if (el.i < array[start].i) {
-            while (start != 0) {
-                if (array[--start].i <= el.i) {
-                    return start + 1;
-                }
-            }
-
-            // Insert at the beginning of the array (so BAD!)
-            return start;
-        }
-        // Search after until we hit top or find element larger
-        else {
-            while (start != size) {
-                if (array[++start].i >= el.i) {
-                    return start;
-                }
-            }
-            // Insert at the end!
-            return size;
-        }
-    }
-
-    // Now we handle the recursive case!
-    if (el.i < array[mid].i) {
-        return find_index(array, start, (mid > start + 1) ? mid - 1 : start, el, size);
-    }
-    else { // el.i > array[mid].i
-        return find_index(array, (mid + 1 < end) ? mid + 1 : end, end, el, size);
-    }
-}
-
-// Merges the subsections of the input data array.
-// start - the starting index of the left side
-// end - the final (not-inclusive) index of the right
-// mid - the starting index of the right.
-// Keeps track of swapping positions using pos, which is
-//      assumed to mirror A.
-// Assumes data contains integers.
-void merge(Data* A, Data* pos, int start, int mid, int end) {
-    // Assume that [start, mid] sorted and [mid + 1,end] sorted.
-    int i = start;
-    int j = mid + 1;
-    int k = 0;
-
-    // Allocate space to temporarily hold the results.
-    Data* tpos;
-    Data* tmp = calloc((end - start + 1), sizeof(Data));
-    while (i <= mid && j <= end) {
-        if (A[i].i < A[j].i) {
-            tmp[k++] = A[i++];
-        }
-        else {
-            tmp[k++] = A[j++];
-        }
-    }
-
-    // Iterate over the i
-    while (i <= mid) {
-        tmp[k++] = A[i++];
-    }
-
-    // Iterate over the j
-    while (j <= end) {
-        tmp[k++] = A[j++];
-    }
-
-    int total = k;
-
-    // Merge the positions if they exist!
-    if (pos) {
-        i = start;
-        j = mid + 1;
-        k = 0;
-        tpos = calloc((end - start + 1), sizeof(Data));
-
-        while (i <= mid && j <= end) {
-            if (A[i].i < A[j].i) {
-                tpos[k++] = pos[i++];
-            }
-            else {
-                tpos[k++] = pos[j++];
-            }
-        }
-
-        // Iterate over the i
-        while (i <= mid) {
-            tpos[k++] = pos[i++];
-        }
-
-        // Iterate over the j
-        while (j <= end) {
-            tpos[k++] = pos[j++];
-        }
-
-        // Now we copy the results back into A assuming the spaces are continguous.
-        while (--k >= 0) {
-            pos[start + k] = tpos[k];
-        }
-
-        free(tpos);
-    }
-
-    // Now we copy the results back into A assuming the spaces are continguous.
-    while (--total >= 0) {
-        A[start + total] = tmp[total];
-    }
-
-    free(tmp);
-}
-
-void mergesort(Data* A, Data* pos, int start, int end) {
-    // Array of length 1 is already sorted.
-    if (end - start + 1 < 2) {
-        return;
-    }
-
-    // Otherwise split in half.
-    int mid = (end + start) / 2;
-
-    // Mergesort each half
-    mergesort(A, pos, start, mid);
-    mergesort(A, pos, mid + 1, end);
-
-    // And merge the two
-    merge(A, pos, start, mid, end);
-}
-
-column* xrange(size_t n){
-    column* res = calloc(1, sizeof(struct column));
-    res->data = calloc(n, sizeof(Data));
-    for (size_t i = 0; i < n; i++) {
-        res->data[i].i = i;
-    }
-    res->type = INT;
-    res->count = n;
-    res->size = n;
-
-    return res;
-}
-
+// Copyright (2015) - Luis Perez
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "kernels.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+void cs165_log(FILE* out, const char *format, ...) {
+#ifdef LOG
+    va_list v;
+    va_start(v, format);
+    vfprintf(out, format, v);
+    va_end(v);
+#else
+    (void) out;
+    (void) format;
+#endif
+}
+
+void log_err(const char *format, ...) {
+#ifdef LOG_ERR
+    va_list v;
+    va_start(v, format);
+    fprintf(stderr, ANSI_COLOR_RED);
+    vfprintf(stderr, format, v);
+    fprintf(stderr, ANSI_COLOR_RESET);
+    va_end(v);
+#else
+    (void) format;
+#endif
+}
+
+void log_info(const char *format, ...) {
+#ifdef LOG_INFO
+    va_list v;
+    va_start(v, format);
+    fprintf(stdout, ANSI_COLOR_GREEN);
+    vfprintf(stdout, format, v);
+    fprintf(stdout, ANSI_COLOR_RESET);
+    fflush(stdout);
+    va_end(v);
+#else
+    (void) format;
+#endif
+}
+
+void* resize(void* data, size_t osize, size_t nsize) {
+    assert(osize <= nsize);
+    void* ndata = calloc(nsize, sizeof(char));
+    memcpy(ndata, data, osize);
+    return ndata;
+}
+
+int send_all(int socket, const void* buf, size_t n) {
+    const char* at = buf;
+    while (n > 0) {
+        ssize_t sent = send(socket, at, n, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        at += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+int recv_all(int socket, void* buf, size_t n) {
+    char* at = buf;
+    while (n > 0) {
+        ssize_t got = recv(socket, at, n, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        at += got;
+        n -= got;
+    }
+    return 0;
+}
+
+// Copies a string. Returns pointer to new string.
+char* copystr(const char* src) {
+    char* tmp = calloc(strlen(src) + 1, sizeof(char));
+    return strcpy(tmp, src);
+}
+
+size_t find_index(int* array, size_t start, size_t end, int el, size_t size) {
+    // In the case of an empty array, automatically return.
+    if (size <= 0 || end < start) {
+        return size;
+    }
+
+    // If only one element or if we've found the element.
+    size_t mid = (start + end) / 2;
+    if (start == end || el == array[mid]) {
+        // We can insert here because they are equal.
+        if (array[start] == el) {
+            return start;
+        }
+        // Search before until we hit bottom or find element smaller.
+        else if (el < array[start]) {
+            while (start != 0) {
+                if (array[--start] <= el) {
+                    return start + 1;
+                }
+            }
+
+            // Insert at the beginning of the array (so BAD!)
+            return start;
+        }
+        // Search after until we hit top or find element larger
+        else {
+            while (start != size) {
+                if (array[++start] >= el) {
+                    return start;
+                }
+            }
+            // Insert at the end!
+            return size;
+        }
+    }
+
+    // Now we handle the recursive case!
+    if (el < array[mid]) {
+        return find_index(array, start, (mid > start + 1) ? mid - 1 : start, el, size);
+    }
+    else { // el > array[mid]
+        return find_index(array, (mid + 1 < end) ? mid + 1 : end, end, el, size);
+    }
+}
+
+// Merges the subsections of the input data array.
+// start - the starting index of the left side
+// end - the final (not-inclusive) index of the right
+// mid - the starting index of the right.
+// Keeps track of swapping positions using pos, which is
+//      assumed to mirror A and holds width bytes per element.
+// Assumes data contains integers.
+void merge(int* A, char* pos, size_t width, size_t start, size_t mid, size_t end) {
+    // Assume that [start, mid] sorted and [mid + 1,end] sorted.
+    size_t i = start;
+    size_t j = mid + 1;
+    size_t k = 0;
+
+    // Allocate space to temporarily hold the results.
+    char* tpos;
+    int* tmp = calloc((end - start + 1), sizeof(int));
+    while (i <= mid && j <= end) {
+        if (A[i] < A[j]) {
+            tmp[k++] = A[i++];
+        }
+        else {
+            tmp[k++] = A[j++];
+        }
+    }
+
+    // Iterate over the i
+    while (i <= mid) {
+        tmp[k++] = A[i++];
+    }
+
+    // Iterate over the j
+    while (j <= end) {
+        tmp[k++] = A[j++];
+    }
+
+    size_t total = k;
+
+    // Merge the positions if they exist!
+    if (pos) {
+        i = start;
+        j = mid + 1;
+        k = 0;
+        tpos = calloc((end - start + 1), width);
+
+        while (i <= mid && j <= end) {
+            if (A[i] < A[j]) {
+                memcpy(tpos + width * k++, pos + width * i++, width);
+            }
+            else {
+                memcpy(tpos + width * k++, pos + width * j++, width);
+            }
+        }
+
+        // Iterate over the i
+        if (i <= mid) {
+            memcpy(tpos + width * k, pos + width * i, width * (mid - i + 1));
+        }
+
+        // Iterate over the j
+        if (j <= end) {
+            memcpy(tpos + width * k, pos + width * j, width * (end - j + 1));
+        }
+
+        // Now we copy the results back into pos assuming the spaces are continguous.
+        memcpy(pos + width * start, tpos, width * (end - start + 1));
+
+        free(tpos);
+    }
+
+    // Now we copy the results back into A assuming the spaces are continguous.
+    memcpy(A + start, tmp, total * sizeof(int));
+
+    free(tmp);
+}
+
+void mergesort(int* A, void* pos, size_t width, size_t start, size_t end) {
+    // Array of length 1 is already sorted (as is an empty one, end = start - 1).
+    if (end + 1 <= start + 1) {
+        return;
+    }
+
+    // Otherwise split in half.
+    size_t mid = start + (end - start) / 2;
+
+    // Mergesort each half
+    mergesort(A, pos, width, start, mid);
+    mergesort(A, pos, width, mid + 1, end);
+
+    // And merge the two
+    merge(A, pos, width, start, mid, end);
+}
+
+column* xrange(size_t n){
+    column* res = calloc(1, sizeof(struct column));
+    res->type = pos_type(n);
+    res->data = alloc_values_uninit(res->type, n);
+    for (size_t i = 0; i < n; i++) {
+        set_pos(res->data, res->type, i, i);
+    }
+    res->count = n;
+    res->size = n;
+
+    return res;
+}
+
@@ -2,7 +2,10 @@
 //
 // General Note: Uses hash_maps for storage.
 
+#include <string.h>
+
 #include "include/hash_map.h"
+#include "include/kernels.h"
 #include "include/utils.h"
 #include "include/var_store.h"
 
@@ -12,6 +15,16 @@ hash_map var_mapping;
 // Global data structure to keep track of resources.
 hash_map resource_mapping;
 
+// A resource that has not been loaded yet.
+typedef struct lazy_resource {
+  void* value;
+  resource_loader load;
+} lazy_resource;
+
+// Lazy resources by name, until they are first looked up.
+hash_map lazy_mapping;
+size_t lazy_count = 0;
+
 void* get_var(const char* var)
 {
   return find_in_map(&var_mapping, var);
@@ -28,7 +41,23 @@ void set_var(const char* var, void* value)
 
 void* get_resource(const char* var)
 {
-  return find_in_map(&resource_mapping, var);
+  void* value = find_in_map(&resource_mapping, var);
+  if (!value || lazy_count == 0) {
+    return value;
+  }
+
+  lazy_resource* lazy = find_in_map(&lazy_mapping, var);
+  if (lazy) {
+    status s = lazy->load(lazy->value);
+    if (s.code != OK) {
+      log_err("Failed to load resource %s. %s", var, s.error_message);
+      return NULL;
+    }
+    remove_from_map(&lazy_mapping, var);
+    lazy_count--;
+    free(lazy);
+  }
+  return value;
 }
 
 void set_resource(const char* var, void* value)
@@ -39,6 +68,66 @@ void set_resource(const char* var, void* value)
   }
 }
 
+void set_lazy_resource(const char* var, void* value, resource_loader load)
+{
+  lazy_resource* lazy = malloc(sizeof(lazy_resource));
+  lazy->value = value;
+  lazy->load = load;
+  if (!insert_into_map(&lazy_mapping, var, lazy)) {
+    log_err("Resource %s is already waiting to be loaded.", var);
+    free(lazy);
+  }
+  else {
+    lazy_count++;
+  }
+  set_resource(var, value);
+}
+
+// The column whose views detach_view copies out, and how that went.
+typedef struct detach_job {
+  column* base;
+  status ret;
+} detach_job;
+
+// Copies out the values of value if it is a view of the column in arg.
+static void detach_view(void* value, void* arg) {
+  column* c = value;
+  detach_job* job = arg;
+  if (c->base != job->base) {
+    return;
+  }
+  size_t width = type_width(c->type);
+  void* copy = malloc((c->count) ? c->count * width : 1);
+  if (!copy) {
+    job->ret.code = ERROR;
+    job->ret.error_message = "Low on memory";
+    return;
+  }
+  memcpy(copy, c->data.raw, c->count * width);
+  c->data.raw = copy;
+  c->size = c->count;
+  c->base = NULL;
+}
+
+status detach_views(column* base)
+{
+  detach_job job;
+  job.base = base;
+  job.ret.code = OK;
+  if (!base->views) {
+    return job.ret;
+  }
+  for_each_in_map(&var_mapping, detach_view, &job);
+  if (job.ret.code != OK) {
+    log_err("Could not detach the views of %s. %s", base->name, job.ret.error_message);
+    return job.ret;
+  }
+
+  // Views that never made it into the pool can no longer be read.
+  base->views = 0;
+  return job.ret;
+}
+
 // TODO -- Determine what needs to be freed...
 void clear_vars(void) {
   clear_map(&var_mapping);
@@ -0,0 +1,542 @@
+// Copyright 2015 <Luis Perez>
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "include/catalog.h"
+#include "include/common.h"
+#include "include/storage.h"
+#include "include/utils.h"
+#include "include/wal.h"
+
+// The log is shared by every statement, so all of its state lives here,
+// guarded by lock. Appenders fill buffers[active] while the flusher writes
+// out the other one.
+static struct {
+    int fd;                    // Current segment, -1 while the log is closed.
+    int old_fd;                // Previous segment until it is all on disk.
+    char name[MAX_STRING_LENGTH];
+    char* buffers[2];
+    int active;
+    size_t used;               // Bytes used in buffers[active].
+    uint64_t base_lsn;         // LSN at the start of the current segment.
+    uint64_t appended;         // LSN at the end of the last appended record.
+    uint64_t durable;          // LSN up to which the log is on disk.
+    uint64_t requested;        // Highest LSN someone is waiting on.
+    int flushing;
+    int stop;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t flush;      // Wakes the flusher.
+    pthread_cond_t flushed;    // Wakes anyone waiting on the flusher.
+    pthread_t flusher;
+} wal = {
+    .fd = -1,
+    .old_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .flush = PTHREAD_COND_INITIALIZER,
+    .flushed = PTHREAD_COND_INITIALIZER,
+};
+
+// Writes all n bytes of buf to fd.
+static int write_all(int fd, const char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// The flusher writes out whatever has accumulated once someone commits (or
+// the buffer is filling up). Every record appended while it is busy with a
+// write + fdatasync goes out together with the next one. Records appended
+// before a segment switch still go to the previous segment.
+static void* flush_log(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&wal.lock);
+    while (1) {
+        while (!wal.stop && !(wal.used > 0 &&
+            (wal.requested > wal.durable || wal.used >= WAL_BUFFER_SIZE / 2))) {
+            pthread_cond_wait(&wal.flush, &wal.lock);
+        }
+        if (wal.used == 0) {
+            break;  // Stopping with nothing left to write.
+        }
+
+        // Swap buffers so appenders can keep going while we write.
+        int fd = wal.fd;
+        int old_fd = wal.old_fd;
+        char* buf = wal.buffers[wal.active];
+        size_t n = wal.used;
+        uint64_t end = wal.appended;
+        size_t before = 0;
+        if (old_fd >= 0 && wal.base_lsn > end - n) {
+            before = wal.base_lsn - (end - n);
+        }
+        wal.active ^= 1;
+        wal.used = 0;
+        wal.flushing = 1;
+        pthread_cond_broadcast(&wal.flushed);
+        pthread_mutex_unlock(&wal.lock);
+
+        int err = before > 0 &&
+            (write_all(old_fd, buf, before) != 0 || fdatasync(old_fd) != 0);
+        if (!err && n > before) {
+            err = write_all(fd, buf + before, n - before) != 0 || fdatasync(fd) != 0;
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        if (err) {
+            log_err("Could not write to the log %s.\n", wal.name);
+            wal.failed = 1;
+        }
+        else {
+            wal.durable = end;
+        }
+        if (wal.old_fd >= 0 && wal.durable >= wal.base_lsn) {
+            close(wal.old_fd);
+            wal.old_fd = -1;
+        }
+        wal.flushing = 0;
+        pthread_cond_broadcast(&wal.flushed);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return NULL;
+}
+
+// Appends a record made of header followed by length bytes of payload.
+static uint64_t append_record(WalRecordType type, const void* payload, size_t length) {
+    if (wal.fd < 0) {
+        return 0;
+    }
+    size_t size = sizeof(wal_record_header) + length;
+    if (size > WAL_BUFFER_SIZE) {
+        log_err("Record of %zu bytes does not fit in the log buffer.\n", size);
+        return 0;
+    }
+
+    wal_record_header header;
+    header.type = type;
+    header.length = length;
+    header.checksum = checksum(payload, length);
+
+    pthread_mutex_lock(&wal.lock);
+    // Wait for the flusher to hand us an empty buffer.
+    while (wal.used + size > WAL_BUFFER_SIZE && !wal.failed) {
+        wal.requested = wal.appended;
+        pthread_cond_signal(&wal.flush);
+        pthread_cond_wait(&wal.flushed, &wal.lock);
+    }
+    char* dst = wal.buffers[wal.active] + wal.used;
+    memcpy(dst, &header, sizeof(wal_record_header));
+    if (length) {
+        memcpy(dst + sizeof(wal_record_header), payload, length);
+    }
+    wal.used += size;
+    wal.appended += size;
+    uint64_t lsn = wal.appended;
+    if (wal.used >= WAL_BUFFER_SIZE / 2) {
+        pthread_cond_signal(&wal.flush);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+uint64_t wal_log_command(const char* command) {
+    return append_record(WAL_COMMAND, command, strlen(command));
+}
+
+uint64_t wal_log_load_begin(const char* header) {
+    return append_record(WAL_LOAD_BEGIN, header, strlen(header));
+}
+
+uint64_t wal_log_load_rows(const int* values, size_t count) {
+    return append_record(WAL_LOAD_ROWS, values, count * sizeof(int));
+}
+
+uint64_t wal_log_load_end(void) {
+    return append_record(WAL_LOAD_END, NULL, 0);
+}
+
+status wal_commit(uint64_t lsn) {
+    status ret;
+    ret.code = OK;
+    if (lsn == 0) {
+        return ret;
+    }
+    pthread_mutex_lock(&wal.lock);
+    if (lsn > wal.requested) {
+        wal.requested = lsn;
+        pthread_cond_signal(&wal.flush);
+    }
+    while (wal.durable < lsn && !wal.failed) {
+        pthread_cond_wait(&wal.flushed, &wal.lock);
+    }
+    if (wal.durable < lsn) {
+        ret.code = ERROR;
+        ret.error_message = "Could not write to the log.\n";
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return ret;
+}
+
+uint64_t wal_lsn(void) {
+    pthread_mutex_lock(&wal.lock);
+    uint64_t lsn = wal.appended;
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+// Reads and validates the file header of the log at fname.
+static status read_header(const char* fname, wal_file_header* header) {
+    status ret;
+    FILE* fp = fopen(fname, "rb");
+    if (!fp) {
+        ret.code = ERROR;
+        ret.error_message = "Could not open log.\n";
+        return ret;
+    }
+    if (1 != fread(header, sizeof(wal_file_header), 1, fp) ||
+        header->magic != WAL_MAGIC || header->version != WAL_VERSION) {
+        log_err("%s is not a log file we can read.\n", fname);
+        fclose(fp);
+        ret.code = ERROR;
+        ret.error_message = "Invalid log.\n";
+        return ret;
+    }
+    fclose(fp);
+    ret.code = OK;
+    return ret;
+}
+
+// Writes the name of the segment of the log starting at base_lsn into fname.
+static void segment_name(char* fname, const char* name, uint64_t base_lsn) {
+    snprintf(fname, DEFAULT_ARRAY_SIZE, "%s/%s.%llu.wal", DATA_FOLDER, name,
+        (unsigned long long) base_lsn);
+}
+
+static int compare_lsn(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Finds the segments of the log name in DATA_FOLDER. Returns how many there
+// are, with their base LSNs in ascending order in *bases (to be freed).
+static size_t list_segments(const char* name, uint64_t** bases) {
+    size_t count = 0;
+    size_t size = 0;
+    *bases = NULL;
+    DIR* dir = opendir(DATA_FOLDER);
+    if (!dir) {
+        return 0;
+    }
+    size_t len = strlen(name);
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        // <name>.<base_lsn>.wal
+        const char* file = entry->d_name;
+        if (strncmp(file, name, len) != 0 || file[len] != '.' ||
+            file[len + 1] < '0' || file[len + 1] > '9') {
+            continue;
+        }
+        char* rest;
+        unsigned long long base = strtoull(file + len + 1, &rest, 10);
+        if (strcmp(rest, ".wal") != 0) {
+            continue;
+        }
+        if (count == size) {
+            size = 2 * size + 4;
+            uint64_t* tmp = realloc(*bases, size * sizeof(uint64_t));
+            if (!tmp) {
+                break;
+            }
+            *bases = tmp;
+        }
+        (*bases)[count++] = base;
+    }
+    closedir(dir);
+    qsort(*bases, count, sizeof(uint64_t), compare_lsn);
+    return count;
+}
+
+// Deletes the segments of the log name that only hold records up to lsn,
+// which is every segment whose successor starts at or before lsn.
+static status drop_segments(const char* name, uint64_t lsn) {
+    status ret;
+    ret.code = OK;
+    uint64_t* bases;
+    size_t count = list_segments(name, &bases);
+    size_t dropped = 0;
+    for (size_t i = 0; i + 1 < count && bases[i + 1] <= lsn; i++) {
+        char fname[DEFAULT_ARRAY_SIZE];
+        segment_name(fname, name, bases[i]);
+        if (unlink(fname) != 0) {
+            log_err("Could not delete log segment %s.\n", fname);
+        }
+        dropped++;
+    }
+    free(bases);
+    if (dropped > 0) {
+        ret = sync_dir(DATA_FOLDER);
+    }
+    return ret;
+}
+
+// Creates an empty segment of the log name starting at base_lsn.
+static status create_segment(const char* name, uint64_t base_lsn) {
+    char fname[DEFAULT_ARRAY_SIZE];
+    char tmpname[DEFAULT_ARRAY_SIZE];
+    status ret;
+    wal_file_header header;
+    header.magic = WAL_MAGIC;
+    header.version = WAL_VERSION;
+    header.base_lsn = base_lsn;
+
+    segment_name(fname, name, base_lsn);
+    FILE* fp = begin_write(fname, tmpname);
+    if (!fp) {
+        ret.code = ERROR;
+        ret.error_message = "Could not create log.\n";
+        return ret;
+    }
+    if (1 != fwrite(&header, sizeof(wal_file_header), 1, fp)) {
+        abort_write(fp, tmpname);
+        ret.code = ERROR;
+        ret.error_message = "Could not write log.\n";
+        return ret;
+    }
+    ret = commit_write(fp, tmpname, fname);
+    if (ret.code == OK) {
+        ret = sync_dir(DATA_FOLDER);
+    }
+    return ret;
+}
+
+// Replays the segment in fname through apply. A statement never spans two
+// segments, so each one ends with a complete statement unless it is torn.
+static status replay_segment(const char* fname, wal_apply apply) {
+    wal_file_header header;
+    status ret = read_header(fname, &header);
+    if (ret.code != OK) {
+        return ret;
+    }
+    mapping* m = map_file(fname);
+    if (!m) {
+        ret.code = ERROR;
+        ret.error_message = "Could not map log.\n";
+        return ret;
+    }
+    const char* base = m->addr;
+
+    // First find the end of the last complete statement. Anything after it
+    // is a torn write or a load that never finished, neither of which was
+    // ever acknowledged.
+    size_t end = sizeof(wal_file_header);
+    size_t off = end;
+    int in_load = 0;
+    while (off + sizeof(wal_record_header) <= m->length) {
+        wal_record_header rec;
+        memcpy(&rec, base + off, sizeof(wal_record_header));
+        const char* payload = base + off + sizeof(wal_record_header);
+        if (rec.length > m->length - off - sizeof(wal_record_header) ||
+            checksum(payload, rec.length) != rec.checksum) {
+            break;
+        }
+        off += sizeof(wal_record_header) + rec.length;
+        if (rec.type == WAL_LOAD_BEGIN) {
+            in_load = 1;
+        }
+        else if (rec.type == WAL_LOAD_END) {
+            in_load = 0;
+        }
+        if (!in_load) {
+            end = off;
+        }
+    }
+
+    // Then apply everything up to it.
+    size_t records = 0;
+    off = sizeof(wal_file_header);
+    while (off < end) {
+        wal_record_header rec;
+        memcpy(&rec, base + off, sizeof(wal_record_header));
+        const char* payload = base + off + sizeof(wal_record_header);
+        off += sizeof(wal_record_header) + rec.length;
+        apply(rec.type, payload, rec.length,
+            header.base_lsn + (off - sizeof(wal_file_header)));
+        records++;
+    }
+    log_info("Replayed %zu log records from %s.\n", records, fname);
+
+    // Drop the incomplete tail so new records follow a complete statement.
+    size_t length = m->length;
+    release_mapping(m);
+    if (end < length) {
+        log_info("Discarding %zu bytes of incomplete log.\n", length - end);
+        if (truncate(fname, end) != 0) {
+            log_err("Could not truncate log %s.\n", fname);
+            ret.code = ERROR;
+            ret.error_message = "Could not truncate log.\n";
+            return ret;
+        }
+    }
+    ret.code = OK;
+    return ret;
+}
+
+status wal_replay(const char* name, wal_apply apply) {
+    status ret;
+    ret.code = OK;
+    uint64_t* bases;
+    size_t count = list_segments(name, &bases);
+    for (size_t i = 0; i < count && ret.code == OK; i++) {
+        char fname[DEFAULT_ARRAY_SIZE];
+        segment_name(fname, name, bases[i]);
+        ret = replay_segment(fname, apply);
+    }
+    free(bases);
+    return ret;
+}
+
+status wal_open(const char* name, uint64_t start_lsn) {
+    status ret;
+    strncpy(wal.name, name, MAX_STRING_LENGTH - 1);
+
+    // Append to the last segment unless everything in it is already part of
+    // the catalogs (or it is unusable), in which case we start a new one.
+    uint64_t* bases;
+    size_t count = list_segments(name, &bases);
+    char fname[DEFAULT_ARRAY_SIZE];
+    wal_file_header header;
+    struct stat st;
+    if (count > 0) {
+        segment_name(fname, name, bases[count - 1]);
+    }
+    free(bases);
+    if (count == 0 || read_header(fname, &header).code != OK || stat(fname, &st) != 0 ||
+        header.base_lsn + (st.st_size - sizeof(wal_file_header)) < start_lsn) {
+        ret = create_segment(name, start_lsn);
+        if (ret.code != OK) {
+            return ret;
+        }
+        segment_name(fname, name, start_lsn);
+        header.base_lsn = start_lsn;
+        st.st_size = sizeof(wal_file_header);
+    }
+
+    wal.fd = open(fname, O_WRONLY | O_APPEND);
+    if (wal.fd < 0) {
+        log_err("Could not open log %s.\n", fname);
+        ret.code = ERROR;
+        ret.error_message = "Could not open log.\n";
+        return ret;
+    }
+    wal.old_fd = -1;
+    wal.buffers[0] = malloc(WAL_BUFFER_SIZE);
+    wal.buffers[1] = malloc(WAL_BUFFER_SIZE);
+    wal.active = 0;
+    wal.used = 0;
+    wal.base_lsn = header.base_lsn;
+    wal.appended = header.base_lsn + (st.st_size - sizeof(wal_file_header));
+    wal.durable = wal.appended;
+    wal.requested = wal.appended;
+    wal.stop = 0;
+    wal.failed = 0;
+    if (pthread_create(&wal.flusher, NULL, flush_log, NULL) != 0) {
+        log_err("Could not start the log flusher.\n");
+        close(wal.fd);
+        wal.fd = -1;
+        ret.code = ERROR;
+        ret.error_message = "Could not start log flusher.\n";
+        return ret;
+    }
+    ret.code = OK;
+    return ret;
+}
+
+void wal_close(void) {
+    if (wal.fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&wal.lock);
+    wal.stop = 1;
+    pthread_cond_signal(&wal.flush);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_join(wal.flusher, NULL);
+
+    if (wal.old_fd >= 0) {
+        close(wal.old_fd);
+        wal.old_fd = -1;
+    }
+    close(wal.fd);
+    wal.fd = -1;
+    free(wal.buffers[0]);
+    free(wal.buffers[1]);
+}
+
+uint64_t wal_switch(void) {
+    if (wal.fd < 0) {
+        return 0;
+    }
+    // Nothing is appended while we hold execution_lock, so the new segment
+    // starts right where the log ends now.
+    uint64_t lsn = wal_lsn();
+    if (lsn == wal.base_lsn) {
+        return lsn;  // The current segment is still empty.
+    }
+    char fname[DEFAULT_ARRAY_SIZE];
+    segment_name(fname, wal.name, lsn);
+    int fd = -1;
+    if (create_segment(wal.name, lsn).code == OK) {
+        fd = open(fname, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) {
+        // We keep appending to the current segment.
+        log_err("Could not start log segment %s.\n", fname);
+        return lsn;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    // A previous segment still being written out has to finish first.
+    while (wal.old_fd >= 0 && !wal.failed) {
+        wal.requested = wal.appended;
+        pthread_cond_signal(&wal.flush);
+        pthread_cond_wait(&wal.flushed, &wal.lock);
+    }
+    // The flusher writes whatever is still in the buffers to the previous
+    // segment and then closes it.
+    if (wal.used > 0 || wal.flushing) {
+        wal.old_fd = wal.fd;
+    }
+    else {
+        close(wal.fd);
+    }
+    wal.fd = fd;
+    wal.base_lsn = lsn;
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+status wal_checkpoint(uint64_t lsn) {
+    status ret;
+    ret.code = OK;
+    if (wal.fd < 0) {
+        return ret;
+    }
+    return drop_segments(wal.name, lsn);
+}
@@ -0,0 +1,188 @@
+// Copyright 2015 <Luis Perez>
+
+#include <string.h>
+
+#include "include/catalog.h"
+#include "include/common.h"
+#include "include/kernels.h"
+#include "include/packed.h"
+#include "include/positions.h"
+#include "include/utils.h"
+#include "include/zones.h"
+
+static inline int64_t row_value(column* col, size_t i) {
+    return (col->type == LONGINT) ? col->data.li[i] : col->data.i[i];
+}
+
+// Makes room in the zones of col for blocks blocks, dropping them if we
+// cannot. Returns whether col still has zones.
+static int reserve_zones(column* col, size_t blocks) {
+    zone_map* z = col->zones;
+    if (blocks <= z->capacity) {
+        return 1;
+    }
+    size_t capacity = 2 * z->capacity;
+    if (capacity < blocks) {
+        capacity = blocks;
+    }
+    int64_t* min = realloc(z->min, capacity * sizeof(int64_t));
+    if (min) {
+        z->min = min;
+    }
+    int64_t* max = (min) ? realloc(z->max, capacity * sizeof(int64_t)) : NULL;
+    if (!max) {
+        log_err("Could not keep zones for column %s.\n", col->name);
+        free_zones(z);
+        col->zones = NULL;
+        return 0;
+    }
+    z->max = max;
+    z->capacity = capacity;
+    return 1;
+}
+
+void create_zones(column* col) {
+    if (!col->zones && (col->type == INT || col->type == LONGINT)) {
+        col->zones = calloc(1, sizeof(zone_map));
+    }
+}
+
+void build_zones(column* col) {
+    create_zones(col);
+    size_t blocks = ZONE_BLOCKS(col->count);
+    if (!col->zones || !reserve_zones(col, blocks)) {
+        return;
+    }
+    zone_map* z = col->zones;
+    for (size_t b = 0; b < blocks; b++) {
+        size_t start = b * ZONE_ROWS;
+        size_t end = (col->count - start < ZONE_ROWS) ? col->count : start + ZONE_ROWS;
+        int64_t lo = row_value(col, start);
+        int64_t hi = lo;
+        for (size_t i = start + 1; i < end; i++) {
+            int64_t v = row_value(col, i);
+            lo = (v < lo) ? v : lo;
+            hi = (v > hi) ? v : hi;
+        }
+        z->min[b] = lo;
+        z->max[b] = hi;
+    }
+    z->blocks = blocks;
+}
+
+// Widens zone b of z to take in value.
+static inline void widen_zone(zone_map* z, size_t b, int64_t value) {
+    if (value < z->min[b]) {
+        z->min[b] = value;
+    }
+    if (value > z->max[b]) {
+        z->max[b] = value;
+    }
+}
+
+void update_zones(column* col, size_t pos) {
+    size_t blocks = ZONE_BLOCKS(col->count);
+    if (!col->zones || !reserve_zones(col, blocks)) {
+        return;
+    }
+    zone_map* z = col->zones;
+
+    // A block the column just grew into starts out with its first value.
+    for (; z->blocks < blocks; z->blocks++) {
+        z->min[z->blocks] = z->max[z->blocks] = row_value(col, z->blocks * ZONE_ROWS);
+    }
+
+    // Every later block gained the value before its old first one. What each
+    // lost off its end we leave in, which only makes the zone wider.
+    widen_zone(z, pos / ZONE_ROWS, row_value(col, pos));
+    for (size_t b = pos / ZONE_ROWS + 1; b < blocks; b++) {
+        widen_zone(z, b, row_value(col, b * ZONE_ROWS));
+    }
+}
+
+void free_zones(zone_map* z) {
+    if (!z) {
+        return;
+    }
+    free(z->min);
+    free(z->max);
+    free(z);
+}
+
+// The checksum of the bounds of z.
+static uint64_t zones_checksum(zone_map* z) {
+    return checksum_extend(checksum(z->min, z->blocks * sizeof(int64_t)),
+        z->max, z->blocks * sizeof(int64_t));
+}
+
+void stage_zones(column* col, file_batch* batch) {
+    zone_map* z = col->zones;
+    uint64_t* header = malloc(3 * sizeof(uint64_t));
+    if (!header) {
+        // An empty file is never read back as zones.
+        return;
+    }
+    header[0] = col->count;
+    header[1] = z->blocks;
+    header[2] = zones_checksum(z);
+    stage_data(batch, header, 3 * sizeof(uint64_t), 1);
+    stage_data(batch, z->min, z->blocks * sizeof(int64_t), 0);
+    stage_data(batch, z->max, z->blocks * sizeof(int64_t), 0);
+}
+
+int read_zones(column* col, FILE* fp) {
+    uint64_t header[3];
+    size_t blocks = ZONE_BLOCKS(col->count);
+    create_zones(col);
+    if (!col->zones) {
+        return 0;
+    }
+    zone_map* z = col->zones;
+    if (fread(header, sizeof(uint64_t), 3, fp) == 3 && header[0] == col->count &&
+        header[1] == blocks && reserve_zones(col, blocks) &&
+        fread(z->min, sizeof(int64_t), blocks, fp) == blocks &&
+        fread(z->max, sizeof(int64_t), blocks, fp) == blocks) {
+        z->blocks = blocks;
+        if (zones_checksum(z) == header[2]) {
+            return 1;
+        }
+    }
+    free_zones(col->zones);
+    col->zones = NULL;
+    return 0;
+}
+
+int zone_scan(const predicate* p, column* col, size_t start, size_t n, uint64_t* bits,
+    size_t* count) {
+    zone_map* z = col->zones;
+    if (!z || z->blocks != ZONE_BLOCKS(col->count) || p->interpret) {
+        return 0;
+    }
+
+    size_t found = 0;
+    for (size_t first = start; first < start + n; first += ZONE_ROWS) {
+        size_t b = first / ZONE_ROWS;
+        size_t rows = (start + n - first < ZONE_ROWS) ? start + n - first : ZONE_ROWS;
+        uint64_t* words = bits + (first - start) / 64;
+        int covers = predicate_covers(p, z->min[b], z->max[b]);
+        if (covers < 0) {
+            continue;
+        }
+        if (covers > 0) {
+            // The whole block qualifies.
+            memset(words, 0xff, (rows / 64) * sizeof(uint64_t));
+            if (rows % 64) {
+                words[rows / 64] = (1ULL << (rows % 64)) - 1;
+            }
+            found += rows;
+        }
+        else if (col->packed) {
+            found += scan_packed(p, col->packed, first, rows, words);
+        }
+        else {
+            found += scan_bitmap(p, values_at(col->data, col->type, first), rows, words);
+        }
+    }
+    *count = found;
+    return 1;
+}